@@ -0,0 +1,200 @@
+#!/bin/sh
+# Benchmarks of PCWE on a synthetic corpus (make bench).
+#
+# Generates the corpus once, runs the microbenchmarks and an end-to-end training at
+# 1..THREADS threads, and writes all results to bench_data/bench.json.
+#
+#   THREADS   the largest number of threads (default: number of cores)
+#   WORDS     words of the synthetic corpus (default 5000000)
+#   SIZE      size of the vectors (default 200)
+#   ITER      training iterations of the end-to-end runs (default 1)
+#   SIZES     sizes of the single thread runs with and without -prefetch (default "100 200 400");
+#             their cache misses are counted when perf is installed
+#   ITERS     iterations of the runs with SGD and -adagrad on a corpus with topics, scored by
+#             qeval on the similarity set of the topics (default "1 3")
+#   HOT       -hot-rows of the thread scaling runs with per-thread buffers of the hot subword
+#             rows (default 256)
+#   TABLES    directory of the files of the -table-dir runs (default bench_data), which are
+#             trained with a -table-memory of 1, 1/2, 1/4 and 1/8 of the size of the tables
+#   DIST      whether to compare a training by two processes on this host (-dist-size 2) with
+#             one by a single process (-dist-size 1) on the corpus with topics (default 1)
+#   QPS       request rates of the pcwe-load runs against pcwe-serve, which serves the word
+#             vectors of the last training (default "1000 10000")
+
+THREADS=${THREADS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)}
+WORDS=${WORDS:-5000000}
+SIZE=${SIZE:-200}
+ITER=${ITER:-1}
+SIZES=${SIZES:-"100 200 400"}
+ITERS=${ITERS:-"1 3"}
+DIR=bench_data
+TABLES=${TABLES:-$DIR}
+HOT=${HOT:-256}
+QPS=${QPS:-"1000 10000"}
+DIST=${DIST:-1}
+SUB=../subcharacter
+
+mkdir -p $DIR
+if [ ! -f $DIR/corpus_$WORDS ]; then
+  ./gencorpus -char2comp $SUB/char2comp.txt -pron $SUB/pron_tone.txt -output $DIR/corpus_$WORDS \
+    -word2pron $DIR/word2pron_$WORDS -words $WORDS -vocab 100000 -zipf 1.0 -seed 1 || exit 1
+fi
+if [ ! -f $DIR/topics_$WORDS ]; then
+  ./gencorpus -char2comp $SUB/char2comp.txt -pron $SUB/pron_tone.txt -output $DIR/topics_$WORDS \
+    -word2pron $DIR/topics_word2pron_$WORDS -sim $DIR/topics_sim_$WORDS -words $WORDS -vocab 100000 \
+    -zipf 1.0 -topics 50 -seed 1 || exit 1
+fi
+
+./microbench -train $DIR/corpus_$WORDS -size $SIZE -json $DIR/micro.json -output $DIR/vectors.tmp || exit 1
+
+OUT=$DIR/bench.json
+{
+  echo "{"
+  echo "  \"corpus_words\": $WORDS, \"size\": $SIZE, \"iter\": $ITER,"
+  echo "  \"micro\": $(sed '2,$s/^/  /' $DIR/micro.json),"
+  echo "  \"end_to_end\": ["
+} > $OUT
+# Trains on CORPUS with the threads $1, the size $2 and the options $3..., which take
+# precedence over the defaults, and sets seconds and speed; with PERF set, also misses
+# (the cache misses counted by perf). The output of pcwe goes to $DIR/$LOG (default train.log).
+CORPUS=corpus_$WORDS
+W2P=word2pron_$WORDS
+Train() {
+  t=$1
+  s=$2
+  shift 2
+  $PERF ./pcwe "$@" -train $DIR/$CORPUS -output-word $DIR/word_vec -output-char $DIR/char_vec \
+    -output-comp $DIR/comp_vec -output-pron $DIR/pron_vec -size $s -window 5 -sample 1e-4 -negative 5 \
+    -iter $ITER -threads $t -min-count 5 -alpha 0.025 -binary 1 -comp $SUB/comp.txt \
+    -char2comp $SUB/char2comp.txt -pron $SUB/pron_tone.txt -word2pron $DIR/$W2P \
+    -join-type 1 -pos-type 3 -average-sum 1 > $DIR/${LOG:-train.log} || { echo "pcwe failed" >&2; exit 1; }
+  line=$(tr '\r' '\n' < $DIR/${LOG:-train.log} | grep '^Training time')
+  seconds=$(echo "$line" | sed 's/Training time: \([0-9.]*\) s.*/\1/')
+  speed=$(echo "$line" | sed 's/.*, \([0-9.]*\)k words\/sec/\1/')
+  [ -n "$seconds" ] || { echo "pcwe failed with $t threads" >&2; exit 1; }
+  misses=null
+  if [ -n "$PERF" ]; then
+    misses=$(grep cache-misses $DIR/perf.csv | cut -d, -f1)
+    [ -n "$misses" ] && [ "$misses" != "<not supported>" ] || misses=null
+  fi
+}
+
+t=1
+while [ $t -le $THREADS ]; do
+  Train $t $SIZE
+  [ $t -lt $THREADS ] && sep="," || sep=""
+  echo "    {\"threads\": $t, \"seconds\": $seconds, \"words_per_sec\": ${speed}e3}$sep" >> $OUT
+  t=$((t + 1))
+done
+echo "  ]," >> $OUT
+
+# Thread scaling with the updates of the hot subword rows buffered per thread
+echo "  \"hot_rows\": [" >> $OUT
+t=1
+while [ $t -le $THREADS ]; do
+  Train $t $SIZE -hot-rows $HOT
+  [ $t -lt $THREADS ] && sep="," || sep=""
+  echo "    {\"threads\": $t, \"hot_rows\": $HOT, \"seconds\": $seconds, \"words_per_sec\": ${speed}e3}$sep" >> $OUT
+  t=$((t + 1))
+done
+echo "  ]," >> $OUT
+
+# Prefetching of the rows of the next target word, at one thread
+echo "  \"prefetch\": [" >> $OUT
+command -v perf > /dev/null && PERF="perf stat -x, -e cache-misses -o $DIR/perf.csv"
+sep=""
+for s in $SIZES; do
+  for p in 0 1; do
+    Train 1 $s -prefetch $p
+    [ -n "$sep" ] && echo "$sep" >> $OUT
+    printf "    {\"size\": %s, \"prefetch\": %s, \"seconds\": %s, \"words_per_sec\": %se3, \"cache_misses\": %s}" \
+      $s $p $seconds $speed $misses >> $OUT
+    sep=","
+  done
+done
+PERF=""
+echo "" >> $OUT
+echo "  ]," >> $OUT
+
+# Out-of-core tables: in memory, mapped without a limit, and mapped with shrinking budgets
+echo "  \"out_of_core\": [" >> $OUT
+Train $THREADS $SIZE
+printf "    {\"table_memory_mb\": null, \"seconds\": %s, \"words_per_sec\": %se3, \"resident_mb\": null, \"paged_out_mb\": null}" \
+  $seconds $speed >> $OUT
+tables=""
+for m in 0 1 2 4 8; do
+  [ $m = 0 ] || [ $((tables / m)) -gt 0 ] || continue
+  if [ $m = 0 ]; then Train $THREADS $SIZE -table-dir $TABLES
+  else Train $THREADS $SIZE -table-dir $TABLES -table-memory $((tables / m))
+  fi
+  # the size of the two tables, from "Word tables mapped in <dir>: <MB> MB each"
+  [ -n "$tables" ] || tables=$(grep '^Word tables mapped' $DIR/train.log | sed 's/.*: \([0-9.]*\) MB each/\1/' | awk '{printf "%d", $1 * 2 + 1}')
+  resident=$(tr '\r' '\n' < $DIR/train.log | grep '^Word tables: at most' | sed 's/Word tables: at most \([0-9.]*\) MB.*/\1/')
+  paged=$(tr '\r' '\n' < $DIR/train.log | grep 'paged out' | sed 's/.*, \([0-9.]*\) MB paged out/\1/')
+  [ $m = 0 ] && budget=0 || budget=$((tables / m))
+  printf ",\n    {\"table_memory_mb\": %s, \"seconds\": %s, \"words_per_sec\": %se3, \"resident_mb\": %s, \"paged_out_mb\": %s}" \
+    $budget $seconds $speed ${resident:-null} ${paged:-0} >> $OUT
+done
+echo "" >> $OUT
+echo "  ]," >> $OUT
+
+# Time to quality of SGD (the linear decay of -alpha) and of -adagrad
+echo "  \"optimizer\": [" >> $OUT
+CORPUS=topics_$WORDS
+W2P=topics_word2pron_$WORDS
+sep=""
+for i in $ITERS; do
+  for opt in sgd adagrad; do
+    if [ $opt = sgd ]; then Train $THREADS $SIZE -iter $i
+    else Train $THREADS $SIZE -iter $i -adagrad 1 -alpha 0.2
+    fi
+    rho=$(./qeval -vec $DIR/word_vec -binary 1 -sim $DIR/topics_sim_$WORDS -queries 1 | grep spearman | sed 's/.*spearman //')
+    [ -n "$sep" ] && echo "$sep" >> $OUT
+    printf "    {\"optimizer\": \"%s\", \"iter\": %s, \"seconds\": %s, \"spearman\": %s}" $opt $i $seconds $rho >> $OUT
+    sep=","
+  done
+done
+echo "" >> $OUT
+echo "  ]," >> $OUT
+
+# Distributed training on this host: two processes over a Unix socket, each with half
+# of the threads, against one process; rank 0 must learn the same vocabulary, and the
+# vectors it saves are scored like those of the single process
+if [ "$DIST" = 1 ]; then
+  echo "  \"dist\": [" >> $OUT
+  half=$((THREADS / 2 > 0 ? THREADS / 2 : 1))
+  Train $THREADS $SIZE -dist-size 1
+  rows=$(head -n 1 $DIR/word_vec)
+  rho=$(./qeval -vec $DIR/word_vec -binary 1 -sim $DIR/topics_sim_$WORDS -queries 1 | grep spearman | sed 's/.*spearman //')
+  printf "    {\"processes\": 1, \"threads\": %s, \"seconds\": %s, \"spearman\": %s},\n" $THREADS $seconds $rho >> $OUT
+  LOG=train_rank1.log Train $half $SIZE -dist-size 2 -dist-rank 1 -dist-addr unix:$DIR/dist &
+  rank1=$!
+  Train $half $SIZE -dist-size 2 -dist-rank 0 -dist-addr unix:$DIR/dist
+  wait $rank1 || { echo "pcwe -dist-rank 1 failed" >&2; exit 1; }
+  [ "$(head -n 1 $DIR/word_vec)" = "$rows" ] || { echo "-dist-size 2 learned another vocabulary" >&2; exit 1; }
+  rho=$(./qeval -vec $DIR/word_vec -binary 1 -sim $DIR/topics_sim_$WORDS -queries 1 | grep spearman | sed 's/.*spearman //')
+  printf "    {\"processes\": 2, \"threads\": %s, \"seconds\": %s, \"spearman\": %s}\n" $half $seconds $rho >> $OUT
+  echo "  ]," >> $OUT
+fi
+
+# Latency of pcwe-serve at every rate of QPS, with 10% knn requests
+echo "  \"serve\": [" >> $OUT
+./pcwe-serve -word $DIR/word_vec -char $DIR/char_vec -comp $DIR/comp_vec -binary 1 -char2comp $SUB/char2comp.txt \
+  -socket $DIR/serve.sock -threads $THREADS > $DIR/serve.log &
+server=$!
+while [ ! -S $DIR/serve.sock ] && kill -0 $server 2> /dev/null; do sleep 0.1; done
+sep=""
+for q in $QPS; do
+  ./pcwe-load -words $DIR/word_vec -binary 1 -socket $DIR/serve.sock -qps $q -seconds 5 > $DIR/load.log || break
+  rate=$(grep '^Requests' $DIR/load.log | sed 's/.*s, \([0-9]*\) per second.*/\1/')
+  p50=$(grep '^Latency' $DIR/load.log | sed 's/.*p50 \([0-9]*\) us.*/\1/')
+  p99=$(grep '^Latency' $DIR/load.log | sed 's/.*p99 \([0-9]*\) us.*/\1/')
+  [ -n "$sep" ] && echo "$sep" >> $OUT
+  printf "    {\"target_qps\": %s, \"qps\": %s, \"p50_us\": %s, \"p99_us\": %s}" $q $rate $p50 $p99 >> $OUT
+  sep=","
+done
+kill $server
+echo "" >> $OUT
+echo "  ]" >> $OUT
+echo "}" >> $OUT
+cat $OUT
@@ -0,0 +1,99 @@
+// pcwe-convert: converts the vector files of pcwe between the text, binary, NumPy .npy
+// and aligned mmap formats (see vecio.h):
+//
+//   ./pcwe-convert -input word_vec -output word_vec.npy -format npy
+//
+// The format of the input is detected from its first bytes. Text files are parsed and
+// formatted by several threads; the text written is that of pcwe.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "vecio.h"
+
+#define MAX_STRING 1024
+
+const char *format_names[4] = {"text", "binary", "npy", "mmap"};
+char input_file[MAX_STRING], output_file[MAX_STRING];
+int input_format = VEC_AUTO, output_format = -1, num_threads = 0;
+
+double Seconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+double FileMB(const char *file) {
+  struct stat st;
+  return stat(file, &st) == 0 ? st.st_size / 1048576.0 : 0;
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  struct vec_table t;
+  double start, seconds;
+  int i;
+  if (argc == 1) {
+    printf("Vector file converter\n\n");
+    printf("Options:\n");
+    printf("\t-input <file>\n");
+    printf("\t\tVector file written by pcwe (-output-word etc.) or by pcwe-convert\n");
+    printf("\t-input-format <format>\n");
+    printf("\t\tFormat of the input: text, binary, npy or mmap; default is detected from the file\n");
+    printf("\t-output <file>\n");
+    printf("\t\tConverted file; the words of a npy file are written one per line to <file>.words\n");
+    printf("\t-format <format>\n");
+    printf("\t\tFormat of the output: text, binary, npy (NumPy float32 array) or mmap (rows aligned to %d bytes,\n", VEC_ALIGN);
+    printf("\t\tto be mapped by VecMap)\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tThreads parsing and formatting text; default is the number of cores\n");
+    printf("\nExamples:\n");
+    printf("./pcwe-convert -input word_vec -output word_vec.npy -format npy\n\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-input", argc, argv)) > 0) strcpy(input_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-input-format", argc, argv)) > 0 && (input_format = VecFormatByName(argv[i + 1])) < 0) {
+    printf("Unknown format: %s\n", argv[i + 1]);
+    return 1;
+  }
+  if ((i = ArgPos((char *)"-format", argc, argv)) > 0) output_format = VecFormatByName(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if (input_file[0] == 0 || output_file[0] == 0 || output_format < 0) {
+    printf("-input, -output and -format (text, binary, npy or mmap) must be given\n");
+    return 1;
+  }
+  if (input_format == VEC_AUTO && (input_format = VecFormat(input_file)) < 0) {
+    printf("Input file not found: %s\n", input_file);
+    return 1;
+  }
+  start = Seconds();
+  if (VecRead(&t, input_file, input_format, num_threads) != 0) return 1;
+  seconds = Seconds() - start;
+  printf("Read %lld rows of %lld values (%s) in %.2f s, %.0f MB/s\n", t.rows, t.dim, format_names[input_format],
+         seconds, FileMB(input_file) / (seconds + 1e-9));
+  start = Seconds();
+  if (VecWrite(&t, output_file, output_format, num_threads) != 0) {
+    printf("Cannot write %s\n", output_file);
+    return 1;
+  }
+  seconds = Seconds() - start;
+  printf("Wrote %s (%s) in %.2f s, %.0f MB/s\n", output_file, format_names[output_format], seconds,
+         FileMB(output_file) / (seconds + 1e-9));
+  VecFree(&t);
+  return 0;
+}
@@ -0,0 +1,404 @@
+// Compressed training corpora: gzip members and zstd frames behind a stdio stream.
+// See corpus.h.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#ifdef PCWE_ZSTD
+#include <zstd.h>
+#endif
+#include "corpus.h"
+
+#define CORPUS_GZIP 1
+#define CORPUS_ZSTD 2
+
+#define CORPUS_IN (1 << 18)        // bytes of compressed input read at once
+#define CORPUS_OUT (1 << 20)       // bytes of the decompressed window of a stream
+
+#define ZSTD_MAGIC 0xFD2FB528u
+#define ZSTD_SKIPPABLE 0x184D2A50u // ... 0x184D2A5F
+#define SEEKABLE_MAGIC 0x8F92EAB1u // the footer of the seek table
+
+struct corpus_frame {
+  long long in, in_size;           // compressed offset and size
+  long long out, out_size;         // uncompressed offset and size
+};
+
+// The frames of a corpus; frames of no output are not kept
+struct corpus_index {
+  char *path;
+  int format;
+  struct corpus_frame *frame;
+  long long frames, max_frames;
+  long long in_end, out_end;       // the end of the frames found so far
+  int complete;                    // all frames are found
+  struct corpus_index *next;
+};
+
+struct corpus_stream {
+  struct corpus_index *index;
+  FILE *f;
+  long long frame;                 // the frame being decompressed
+  long long frame_in, frame_out;   // its start
+  long long frame_size;            // and its output so far
+  int in_frame, eof;
+  unsigned char *in;               // in[in_pos, in_len) is at offset in_base + in_pos of f
+  long long in_base, in_pos, in_len;
+  unsigned char *out;              // the uncompressed text [out_start, out_start + out_len)
+  long long out_start, out_len, pos;
+  z_stream z;
+#ifdef PCWE_ZSTD
+  ZSTD_DCtx *zd;
+#endif
+};
+
+static struct corpus_index *indexes;
+
+static void CorpusFail(const char *path, const char *what) {
+  fprintf(stderr, "corpus: %s: %s\n", path, what);
+  exit(1);
+}
+
+static unsigned int Le32(const unsigned char *p) {
+  return p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static int Format(const unsigned char *p, long long n) {
+  unsigned int magic;
+  if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return CORPUS_GZIP;
+  if (n < 4) return 0;
+  magic = Le32(p);
+  if (magic == ZSTD_MAGIC || (magic & 0xFFFFFFF0u) == ZSTD_SKIPPABLE) return CORPUS_ZSTD;
+  return 0;
+}
+
+static void AddFrame(struct corpus_index *x, long long in, long long in_size, long long out_size) {
+  if (out_size > 0) {
+    if (x->frames == x->max_frames) {
+      x->max_frames = x->max_frames * 2 + 16;
+      x->frame = (struct corpus_frame *)realloc(x->frame, x->max_frames * sizeof(struct corpus_frame));
+      if (x->frame == NULL) CorpusFail(x->path, "memory allocation failed");
+    }
+    x->frame[x->frames].in = in;
+    x->frame[x->frames].in_size = in_size;
+    x->frame[x->frames].out = x->out_end;
+    x->frame[x->frames].out_size = out_size;
+    x->frames++;
+  }
+  x->in_end = in + in_size;
+  x->out_end += out_size;
+}
+
+// Frames of a seekable zstd file, from the seek table at its end; returns 0 if there is none
+static int ReadSeekTable(struct corpus_index *x, FILE *f) {
+  unsigned char footer[9], entry[12];
+  long long file_bytes, frames, size, table, in = 0, a;
+  if (fseeko(f, 0, SEEK_END) != 0 || (file_bytes = ftello(f)) < 9 + 8) return 0;
+  if (fseeko(f, file_bytes - 9, SEEK_SET) != 0 || fread(footer, 1, 9, f) != 9) return 0;
+  if (Le32(footer + 5) != SEEKABLE_MAGIC) return 0;
+  frames = Le32(footer);
+  size = footer[4] & 0x80 ? 12 : 8;
+  table = file_bytes - 9 - frames * size - 8;
+  if (table < 0 || fseeko(f, table, SEEK_SET) != 0 || fread(entry, 1, 8, f) != 8 ||
+      Le32(entry) != ZSTD_SKIPPABLE + 0xE || Le32(entry + 4) != frames * size + 9) return 0;
+  for (a = 0; a < frames; a++) {
+    if (fread(entry, 1, size, f) != (size_t)size) CorpusFail(x->path, "truncated seek table");
+    AddFrame(x, in, Le32(entry), Le32(entry + 4));
+    in += Le32(entry);
+  }
+  if (in != table) CorpusFail(x->path, "the seek table does not match the frames");
+  x->in_end = file_bytes;
+  x->complete = 1;
+  return 1;
+}
+
+// Frames of a zstd file from their headers, up to the first frame without its content size
+static void ScanFrameHeaders(struct corpus_index *x, FILE *f) {
+  unsigned char h[18];
+  long long in = 0, n, size, content, end;
+  int d, fcs, single, did;
+  while (1) {
+    if (fseeko(f, in, SEEK_SET) != 0) break;
+    n = fread(h, 1, sizeof(h), f);
+    if (n < 4) {
+      x->complete = 1;
+      break;
+    }
+    if ((Le32(h) & 0xFFFFFFF0u) == ZSTD_SKIPPABLE) {
+      if (n < 8) CorpusFail(x->path, "truncated frame");
+      AddFrame(x, in, 8 + (long long)Le32(h + 4), 0);
+      in = x->in_end;
+      continue;
+    }
+    if (Le32(h) != ZSTD_MAGIC) {
+      x->complete = 1;   // trailing data
+      break;
+    }
+    d = h[4];
+    fcs = d >> 6;
+    single = (d >> 5) & 1;
+    did = d & 3;
+    size = 5 + !single + (did == 3 ? 4 : did) + (fcs == 0 ? single : 1 << fcs);
+    if (fcs == 0 && !single) break;   // the content size is not in the header
+    if (n < size) CorpusFail(x->path, "truncated frame");
+    content = 0;
+    for (n = size - 1; n >= size - (fcs == 0 ? 1 : 1 << fcs); n--) content = content << 8 | h[n];
+    if (fcs == 1) content += 256;
+    // the blocks: 3 bytes of header (last block, type, size) and the block
+    end = in + size;
+    while (1) {
+      if (fseeko(f, end, SEEK_SET) != 0 || fread(h, 1, 3, f) != 3) CorpusFail(x->path, "truncated frame");
+      n = h[0] | h[1] << 8 | h[2] << 16;
+      end += 3 + (((n >> 1) & 3) == 1 ? 1 : n >> 3);
+      if (n & 1) break;
+    }
+    if (d & 4) end += 4;   // checksum
+    AddFrame(x, in, end - in, content);
+    in = end;
+  }
+}
+
+static struct corpus_index *FindIndex(const char *path) {
+  struct corpus_index *x;
+  for (x = indexes; x != NULL; x = x->next) if (!strcmp(x->path, path)) return x;
+  return NULL;
+}
+
+static struct corpus_index *NewIndex(const char *path, int format, FILE *f) {
+  struct corpus_index *x = (struct corpus_index *)calloc(1, sizeof(struct corpus_index));
+  if (x == NULL || (x->path = strdup(path)) == NULL) CorpusFail(path, "memory allocation failed");
+  x->format = format;
+  if (format == CORPUS_ZSTD && !ReadSeekTable(x, f)) ScanFrameHeaders(x, f);
+  x->next = indexes;
+  indexes = x;
+  return x;
+}
+
+static long long Refill(struct corpus_stream *s) {
+  long long n;
+  if (s->in_pos > 0) {
+    memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+    s->in_base += s->in_pos;
+    s->in_len -= s->in_pos;
+    s->in_pos = 0;
+  }
+  n = fread(s->in + s->in_len, 1, CORPUS_IN - s->in_len, s->f);
+  s->in_len += n;
+  return n;
+}
+
+// Starts decompressing frame (whose start is known) at in and out
+static void StartFrame(struct corpus_stream *s, long long frame, long long in, long long out) {
+  s->frame = frame;
+  s->frame_in = in;
+  s->frame_out = out;
+  s->in_frame = 0;
+  s->eof = 0;
+  s->in_base = in;
+  s->in_pos = s->in_len = 0;
+  s->out_start = out;
+  s->out_len = 0;
+  if (fseeko(s->f, in, SEEK_SET) != 0) CorpusFail(s->index->path, strerror(errno));
+}
+
+// Begins the frame at frame_in; returns 0 at the end of the file
+static int BeginFrame(struct corpus_stream *s) {
+  struct corpus_index *x = s->index;
+  if (s->in_len - s->in_pos < 4) Refill(s);
+  if (Format(s->in + s->in_pos, s->in_len - s->in_pos) != x->format) {
+    // the end, or data after the last frame
+    if (s->frame == x->frames && !x->complete) x->complete = 1;
+    s->eof = 1;
+    return 0;
+  }
+  if (x->format == CORPUS_GZIP) inflateReset(&s->z);
+#ifdef PCWE_ZSTD
+  else ZSTD_DCtx_reset(s->zd, ZSTD_reset_session_only);
+#endif
+  s->in_frame = 1;
+  s->frame_size = 0;
+  return 1;
+}
+
+static void EndFrame(struct corpus_stream *s) {
+  struct corpus_index *x = s->index;
+  long long in = s->in_base + s->in_pos;
+  if (s->frame == x->frames && !x->complete) AddFrame(x, s->frame_in, in - s->frame_in, s->frame_size);
+  if (s->frame_size > 0) s->frame++;
+  s->frame_in = in;
+  s->frame_out += s->frame_size;
+  s->in_frame = 0;
+}
+
+// Decompresses into the free part of the window; returns 0 at the end of the file
+static int Decompress(struct corpus_stream *s) {
+  long long produced, consumed;
+  int ret, end;
+  if (!s->in_frame && !BeginFrame(s)) return 0;
+  if (s->in_pos == s->in_len && Refill(s) == 0) CorpusFail(s->index->path, "truncated frame");
+  if (s->index->format == CORPUS_GZIP) {
+    s->z.next_in = s->in + s->in_pos;
+    s->z.avail_in = s->in_len - s->in_pos;
+    s->z.next_out = s->out + s->out_len;
+    s->z.avail_out = CORPUS_OUT - s->out_len;
+    ret = inflate(&s->z, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) CorpusFail(s->index->path, "corrupt gzip data");
+    consumed = s->in_len - s->in_pos - s->z.avail_in;
+    produced = CORPUS_OUT - s->out_len - s->z.avail_out;
+    end = ret == Z_STREAM_END;
+  } else {
+#ifdef PCWE_ZSTD
+    ZSTD_inBuffer zin = {s->in + s->in_pos, s->in_len - s->in_pos, 0};
+    ZSTD_outBuffer zout = {s->out + s->out_len, CORPUS_OUT - s->out_len, 0};
+    size_t r = ZSTD_decompressStream(s->zd, &zout, &zin);
+    if (ZSTD_isError(r)) CorpusFail(s->index->path, ZSTD_getErrorName(r));
+    consumed = zin.pos;
+    produced = zout.pos;
+    end = r == 0;
+#else
+    consumed = produced = end = 0;
+#endif
+  }
+  s->in_pos += consumed;
+  s->out_len += produced;
+  s->frame_size += produced;
+  if (end) EndFrame(s);
+  else if (consumed == 0 && produced == 0 && Refill(s) == 0) CorpusFail(s->index->path, "truncated frame");
+  return 1;
+}
+
+// Moves the window to the text after it; returns 0 at the end of the file
+static int Fill(struct corpus_stream *s) {
+  s->out_start += s->out_len;
+  s->out_len = 0;
+  while (s->out_len == 0) if (s->eof || !Decompress(s)) return 0;
+  return 1;
+}
+
+// The known frame that holds offset, or -1
+static long long FindFrame(struct corpus_index *x, long long offset) {
+  long long lo = 0, hi = x->frames - 1, mid;
+  if (x->frames == 0 || offset >= x->out_end) return -1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (x->frame[mid].out <= offset) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Finds the frames after the known ones
+static void FindFrames(struct corpus_stream *s) {
+  struct corpus_index *x = s->index;
+  StartFrame(s, x->frames, x->in_end, x->out_end);
+  while (!x->complete && Fill(s));
+}
+
+static int Seek(struct corpus_stream *s, long long offset) {
+  long long f;
+  if (offset < 0) return -1;
+  if (offset >= s->out_start && offset <= s->out_start + s->out_len) {
+    s->pos = offset;
+    return 0;
+  }
+  if (offset < s->out_start || (s->frame < s->index->frames && FindFrame(s->index, offset) != s->frame)) {
+    if (offset >= s->index->out_end && !s->index->complete) FindFrames(s);
+    f = FindFrame(s->index, offset);
+    if (f < 0) {
+      StartFrame(s, s->index->frames, s->index->in_end, s->index->out_end);
+      s->eof = 1;
+      s->pos = offset;
+      return 0;
+    }
+    StartFrame(s, f, s->index->frame[f].in, s->index->frame[f].out);
+  }
+  while (offset > s->out_start + s->out_len && Fill(s));
+  s->pos = offset;
+  return 0;
+}
+
+static ssize_t StreamRead(void *cookie, char *buf, size_t size) {
+  struct corpus_stream *s = (struct corpus_stream *)cookie;
+  size_t done = 0;
+  long long n;
+  while (done < size) {
+    if (s->pos >= s->out_start + s->out_len) {
+      if (s->pos > s->out_start + s->out_len || !Fill(s)) break;
+    }
+    n = s->out_start + s->out_len - s->pos;
+    if (n > (long long)(size - done)) n = size - done;
+    memcpy(buf + done, s->out + (s->pos - s->out_start), n);
+    done += n;
+    s->pos += n;
+  }
+  return done;
+}
+
+static int StreamSeek(void *cookie, off64_t *offset, int whence) {
+  struct corpus_stream *s = (struct corpus_stream *)cookie;
+  long long to = *offset;
+  if (whence == SEEK_CUR) to += s->pos;
+  else if (whence == SEEK_END) {
+    if (!s->index->complete) FindFrames(s);
+    to += s->index->out_end;
+  }
+  if (Seek(s, to) != 0) return -1;
+  *offset = s->pos;
+  return 0;
+}
+
+static int StreamClose(void *cookie) {
+  struct corpus_stream *s = (struct corpus_stream *)cookie;
+  if (s->index->format == CORPUS_GZIP) inflateEnd(&s->z);
+#ifdef PCWE_ZSTD
+  else ZSTD_freeDCtx(s->zd);
+#endif
+  fclose(s->f);
+  free(s->in);
+  free(s->out);
+  free(s);
+  return 0;
+}
+
+FILE *CorpusOpen(const char *path) {
+  unsigned char magic[4];
+  long long n;
+  int format;
+  struct corpus_index *x;
+  struct corpus_stream *s;
+  cookie_io_functions_t io = {StreamRead, NULL, StreamSeek, StreamClose};
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  n = fread(magic, 1, sizeof(magic), f);
+  format = Format(magic, n);
+  if (format == 0) {
+    rewind(f);
+    return f;
+  }
+#ifndef PCWE_ZSTD
+  if (format == CORPUS_ZSTD) CorpusFail(path, "zstd input needs a build with make ZSTD=1");
+#endif
+  if ((x = FindIndex(path)) == NULL) x = NewIndex(path, format, f);
+  s = (struct corpus_stream *)calloc(1, sizeof(struct corpus_stream));
+  if (s == NULL || (s->in = (unsigned char *)malloc(CORPUS_IN)) == NULL ||
+      (s->out = (unsigned char *)malloc(CORPUS_OUT)) == NULL) CorpusFail(path, "memory allocation failed");
+  s->index = x;
+  s->f = f;
+  if (format == CORPUS_GZIP) {
+    if (inflateInit2(&s->z, 15 + 16) != Z_OK) CorpusFail(path, "inflateInit2 failed");
+  }
+#ifdef PCWE_ZSTD
+  else if ((s->zd = ZSTD_createDCtx()) == NULL) CorpusFail(path, "ZSTD_createDCtx failed");
+#endif
+  StartFrame(s, 0, 0, 0);
+  s->pos = 0;
+  return fopencookie(s, "rb", io);
+}
+
+long long CorpusFrames(const char *path) {
+  struct corpus_index *x = FindIndex(path);
+  return x == NULL ? -1 : x->frames;
+}
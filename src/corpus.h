@@ -0,0 +1,26 @@
+// Compressed training corpora.
+//
+// A corpus is read through a stdio stream whose offsets are those of the uncompressed
+// text, so that it is read, split between the threads and fseek-ed as a plain file.
+// Besides plain text, two formats are read:
+//   gzip  one or more gzip members (files compressed in parts and concatenated)
+//   zstd  one or more zstd frames, with or without the seek table of the seekable
+//         zstd format (built with make ZSTD=1)
+// A member or frame is decompressed on its own, so a seek only decompresses the frame
+// that holds the new offset, from its start. The frames of a corpus are found from
+// the zstd seek table or frame headers when it is first opened, or else while it is
+// first read through (or on the first seek past the frames found so far); this is
+// not thread safe, the first pass must end before other streams of it are used.
+
+#ifndef PCWE_CORPUS_H
+#define PCWE_CORPUS_H
+
+#include <stdio.h>
+
+// Opens path for reading; returns NULL if it cannot be opened
+FILE *CorpusOpen(const char *path);
+
+// Frames of the compressed corpus path found so far, or -1 if it was opened as plain text
+long long CorpusFrames(const char *path);
+
+#endif
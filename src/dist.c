@@ -0,0 +1,246 @@
+// Ring of the processes of a distributed training over TCP or Unix domain sockets.
+// See dist.h for the addresses.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "dist.h"
+
+#define DIST_TRIES 600             // connection attempts, 100 ms apart
+#define DIST_MAX_SEND (1 << 20)    // bytes of a single send or receive
+
+static int dist_rank, dist_size, listen_fd = -1, next_fd = -1, prev_fd = -1;
+static char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static float *dist_buf;            // a received part of DistAllreduce
+static long long dist_buf_size;
+
+static void DistFail(const char *what) {
+  fprintf(stderr, "dist: process %d: %s: %s\n", dist_rank, what, strerror(errno));
+  exit(1);
+}
+
+// Socket address of process rank; returns its length
+static socklen_t DistAddress(const char *addr, int rank, struct sockaddr_storage *sa, int *family) {
+  char host[256], *port, *p;
+  const char *s = addr;
+  struct addrinfo hints, *res;
+  struct sockaddr_un *un;
+  long long i, offset = rank;
+  socklen_t len;
+  memset(sa, 0, sizeof(*sa));
+  if (!strncmp(addr, "unix:", 5)) {
+    un = (struct sockaddr_un *)sa;
+    un->sun_family = AF_UNIX;
+    if (snprintf(un->sun_path, sizeof(un->sun_path), "%s.%d", addr + 5, rank) >= (int)sizeof(un->sun_path)) {
+      fprintf(stderr, "dist: Unix socket path too long: %s\n", addr + 5);
+      exit(1);
+    }
+    *family = AF_UNIX;
+    return sizeof(struct sockaddr_un);
+  }
+  // the rank-th address of a list, or the single address with the port offset by rank
+  if (strchr(addr, ',') != NULL) {
+    for (i = 0; i < rank && s != NULL; i++) if ((s = strchr(s, ',')) != NULL) s++;
+    if (s == NULL) {
+      fprintf(stderr, "dist: no address of process %d in %s\n", rank, addr);
+      exit(1);
+    }
+    offset = 0;
+  }
+  for (i = 0; s[i] != 0 && s[i] != ',' && i < (long long)sizeof(host) - 1; i++) host[i] = s[i];
+  host[i] = 0;
+  port = strrchr(host, ':');
+  if (port == NULL) {
+    fprintf(stderr, "dist: address without port: %s\n", host);
+    exit(1);
+  }
+  *port++ = 0;
+  i = strtol(port, &p, 10) + offset;
+  if (*p != 0 || i <= 0 || i > 65535) {
+    fprintf(stderr, "dist: bad port in %s\n", addr);
+    exit(1);
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) {
+    fprintf(stderr, "dist: cannot resolve %s\n", host);
+    exit(1);
+  }
+  memcpy(sa, res->ai_addr, res->ai_addrlen);
+  len = res->ai_addrlen;
+  *family = res->ai_family;
+  if (*family == AF_INET) ((struct sockaddr_in *)sa)->sin_port = htons(i);
+  else ((struct sockaddr_in6 *)sa)->sin6_port = htons(i);
+  freeaddrinfo(res);
+  return len;
+}
+
+static void DistSetOptions(int fd, int family) {
+  int one = 1;
+  if (family != AF_UNIX) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void SendAll(int fd, const void *buf, long long bytes) {
+  long long done = 0, n;
+  while (done < bytes) {
+    n = send(fd, (const char *)buf + done, bytes - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) DistFail("send");
+    done += n;
+  }
+}
+
+static void RecvAll(int fd, void *buf, long long bytes) {
+  long long done = 0, n;
+  while (done < bytes) {
+    n = recv(fd, (char *)buf + done, bytes - done, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) errno = ECONNRESET;
+    if (n <= 0) DistFail("receive");
+    done += n;
+  }
+}
+
+void DistInit(const char *addr, int rank, int size) {
+  struct sockaddr_storage sa;
+  socklen_t len;
+  int family, tries, one = 1, hello;
+  dist_rank = rank;
+  dist_size = size;
+  if (size < 2) return;
+  if (rank < 0 || rank >= size) {
+    fprintf(stderr, "dist: rank %d is not in 0..%d\n", rank, size - 1);
+    exit(1);
+  }
+  // listen first, so that the connection of the previous process is queued until it
+  // is accepted
+  len = DistAddress(addr, rank, &sa, &family);
+  if (family == AF_UNIX) {
+    strcpy(listen_path, ((struct sockaddr_un *)&sa)->sun_path);
+    unlink(listen_path);
+  }
+  listen_fd = socket(family, SOCK_STREAM, 0);
+  if (listen_fd < 0) DistFail("socket");
+  if (family != AF_UNIX) {
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // every interface, so that the other hosts can connect
+    if (family == AF_INET) ((struct sockaddr_in *)&sa)->sin_addr.s_addr = htonl(INADDR_ANY);
+    else ((struct sockaddr_in6 *)&sa)->sin6_addr = in6addr_any;
+  }
+  if (bind(listen_fd, (struct sockaddr *)&sa, len) < 0) DistFail("bind");
+  if (listen(listen_fd, 1) < 0) DistFail("listen");
+
+  len = DistAddress(addr, (rank + 1) % size, &sa, &family);
+  for (tries = 0; ; tries++) {
+    next_fd = socket(family, SOCK_STREAM, 0);
+    if (next_fd < 0) DistFail("socket");
+    if (connect(next_fd, (struct sockaddr *)&sa, len) == 0) break;
+    close(next_fd);
+    if (tries == DIST_TRIES) DistFail("connect to the next process");
+    usleep(100000);
+  }
+  DistSetOptions(next_fd, family);
+  SendAll(next_fd, &rank, sizeof(rank));
+
+  prev_fd = accept(listen_fd, NULL, NULL);
+  if (prev_fd < 0) DistFail("accept");
+  DistSetOptions(prev_fd, family);
+  RecvAll(prev_fd, &hello, sizeof(hello));
+  if (hello != (rank + size - 1) % size) {
+    fprintf(stderr, "dist: process %d: connection from process %d instead of %d\n", rank, hello, (rank + size - 1) % size);
+    exit(1);
+  }
+}
+
+void DistClose(void) {
+  if (next_fd >= 0) close(next_fd);
+  if (prev_fd >= 0) close(prev_fd);
+  if (listen_fd >= 0) close(listen_fd);
+  next_fd = prev_fd = listen_fd = -1;
+  if (listen_path[0] != 0) unlink(listen_path);
+  listen_path[0] = 0;
+  free(dist_buf);
+  dist_buf = NULL;
+  dist_buf_size = 0;
+}
+
+// Sends and receives at the same time, as every process of the ring sends to its next
+// process while that one sends too
+void DistExchange(const void *send_buf, long long send_bytes, void *recv_buf, long long recv_bytes) {
+  struct pollfd fds[2];
+  long long sent = 0, received = 0, n;
+  int nfds;
+  while (sent < send_bytes || received < recv_bytes) {
+    nfds = 0;
+    if (sent < send_bytes) {
+      fds[nfds].fd = next_fd;
+      fds[nfds++].events = POLLOUT;
+    }
+    if (received < recv_bytes) {
+      fds[nfds].fd = prev_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      DistFail("poll");
+    }
+    if (sent < send_bytes && fds[0].revents) {
+      n = send_bytes - sent < DIST_MAX_SEND ? send_bytes - sent : DIST_MAX_SEND;
+      n = send(next_fd, (const char *)send_buf + sent, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) DistFail("send");
+      if (n > 0) sent += n;
+    }
+    if (received < recv_bytes && fds[nfds - 1].revents) {
+      n = recv_bytes - received < DIST_MAX_SEND ? recv_bytes - received : DIST_MAX_SEND;
+      n = recv(prev_fd, (char *)recv_buf + received, n, MSG_DONTWAIT);
+      if (n == 0) {
+        errno = ECONNRESET;
+        DistFail("receive");
+      }
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) DistFail("receive");
+      if (n > 0) received += n;
+    }
+  }
+}
+
+void DistAllreduce(float *buf, long long n) {
+  long long s, c, send, recv, begin, size;
+  if (dist_size < 2) return;
+  if (dist_buf_size < n / dist_size + 1) {
+    free(dist_buf);
+    dist_buf_size = n / dist_size + 1;
+    dist_buf = (float *)malloc(dist_buf_size * sizeof(float));
+    if (dist_buf == NULL) {
+      fprintf(stderr, "dist: memory allocation failed\n");
+      exit(1);
+    }
+  }
+  // part i of buf is [n * i / size, n * (i + 1) / size); after step s of the reduction,
+  // part (rank - s - 1) holds the sum of s + 2 processes
+  for (s = 0; s < dist_size - 1; s++) {
+    send = (dist_rank - s + dist_size) % dist_size;
+    recv = (dist_rank - s - 1 + dist_size) % dist_size;
+    begin = n * recv / dist_size;
+    size = n * (recv + 1) / dist_size - begin;
+    DistExchange(&buf[n * send / dist_size], (n * (send + 1) / dist_size - n * send / dist_size) * sizeof(float),
+                 dist_buf, size * sizeof(float));
+    for (c = 0; c < size; c++) buf[begin + c] += dist_buf[c];
+  }
+  // process rank now holds the sum of part rank + 1, which is passed around the ring
+  for (s = 0; s < dist_size - 1; s++) {
+    send = (dist_rank + 1 - s + dist_size) % dist_size;
+    recv = (dist_rank - s + dist_size) % dist_size;
+    DistExchange(&buf[n * send / dist_size], (n * (send + 1) / dist_size - n * send / dist_size) * sizeof(float),
+                 &buf[n * recv / dist_size], (n * (recv + 1) / dist_size - n * recv / dist_size) * sizeof(float));
+  }
+}
@@ -0,0 +1,24 @@
+// Communication between the processes of a distributed training.
+//
+// The processes 0..size-1 form a ring: every process has a connection to the next
+// one and a connection from the previous one, over TCP or Unix domain sockets. An
+// address is either
+//   host:port        process r listens on port + r of host
+//   h0:p0,h1:p1,...  process r listens on the r-th address (one per process)
+//   unix:<path>      process r listens on the Unix socket <path>.r
+
+#ifndef PCWE_DIST_H
+#define PCWE_DIST_H
+
+// Connects the ring; waits up to a minute for the other processes to start
+void DistInit(const char *addr, int rank, int size);
+void DistClose(void);
+
+// Sends send_bytes to the next process and receives recv_bytes from the previous one
+void DistExchange(const void *send, long long send_bytes, void *recv, long long recv_bytes);
+
+// Replaces buf by the sum of the bufs of all processes (ring allreduce: every process
+// reduces 1/size of buf, then the reduced parts are passed around)
+void DistAllreduce(float *buf, long long n);
+
+#endif
@@ -0,0 +1,288 @@
+// Generates a synthetic Chinese training corpus for benchmarks.
+//
+// Words of 1-4 characters are built from the characters of char2comp.txt, and every
+// character gets a random pronunciation of pron_tone.txt. The corpus draws word
+// ranks from a Zipf distribution and breaks them into lines of 5-35 words; the
+// matching word2pron file lists the pronunciation of every word of the vocabulary.
+//
+// With -topics, word rank r belongs to topic r % topics, and half of the words of a
+// line are drawn from the topic of the line, so that the words of a topic share
+// contexts. The -sim file then lists pairs of frequent words scored 1 for the same
+// topic and 0 otherwise, which qeval -sim correlates with the cosines of the vectors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_STRING 100
+#define MAX_PRON 16
+
+#define SIM_PAIRS 2000
+#define SIM_WORDS 2000  // the pairs are drawn from the most frequent words
+
+char char2comp_file[MAX_STRING], pron_file[MAX_STRING], output_file[MAX_STRING], word2pron_file[MAX_STRING];
+char sim_file[MAX_STRING];
+long long num_words = 10000000, vocab_size = 100000, topics = 0;
+double zipf = 1.0;
+unsigned long long next_random = 1;
+
+char (*chars)[5], (*prons)[MAX_PRON];
+int *char_pron;
+long long char_size, pron_size;
+
+char **vocab;
+int **vocab_chars;   // character ids of every word, -1 terminated
+long long *vocab_hash, vocab_hash_size;
+double *cdf;
+
+unsigned long long Random() {
+  next_random = next_random * (unsigned long long)25214903917 + 11;
+  return next_random >> 16;
+}
+
+// Reads the first string of every line of char2comp.txt that is a single 3 or 4 byte
+// UTF-8 character
+void ReadChars() {
+  char line[10000], *p;
+  long long max_size = 1000, n;
+  FILE *fin = fopen(char2comp_file, "rb");
+  if (fin == NULL) {
+    fprintf(stderr, "ERROR: char2comp file not found!\n");
+    exit(1);
+  }
+  chars = malloc(max_size * sizeof(*chars));
+  while (fgets(line, sizeof(line), fin) != NULL) {
+    p = strtok(line, " \t\r\n");
+    if (p == NULL) continue;
+    n = strlen(p);
+    if ((n != 3 || ((unsigned char)p[0] & 0xF0) != 0xE0) && (n != 4 || ((unsigned char)p[0] & 0xF8) != 0xF0)) continue;
+    if (char_size == max_size) {
+      max_size *= 2;
+      chars = realloc(chars, max_size * sizeof(*chars));
+    }
+    strcpy(chars[char_size++], p);
+  }
+  fclose(fin);
+  if (char_size == 0) {
+    fprintf(stderr, "ERROR: no characters in %s\n", char2comp_file);
+    exit(1);
+  }
+}
+
+void ReadPronunciations() {
+  char word[MAX_PRON];
+  long long max_size = 1000, a;
+  FILE *fin = fopen(pron_file, "rb");
+  if (fin == NULL) {
+    fprintf(stderr, "ERROR: pronunciation file not found!\n");
+    exit(1);
+  }
+  prons = malloc(max_size * sizeof(*prons));
+  while (fscanf(fin, "%15s", word) == 1) {
+    if (pron_size == max_size) {
+      max_size *= 2;
+      prons = realloc(prons, max_size * sizeof(*prons));
+    }
+    strcpy(prons[pron_size++], word);
+  }
+  fclose(fin);
+  if (pron_size == 0) {
+    fprintf(stderr, "ERROR: no pronunciations in %s\n", pron_file);
+    exit(1);
+  }
+  char_pron = malloc(char_size * sizeof(int));
+  for (a = 0; a < char_size; a++) char_pron[a] = Random() % pron_size;
+}
+
+unsigned long long Hash(char *word) {
+  unsigned long long h = 14695981039346656037ULL;
+  while (*word) h = (h ^ (unsigned char)*word++) * 1099511628211ULL;
+  return h;
+}
+
+// Adds the word unless it exists already
+int AddWord(char *word, int *ids, long long size) {
+  long long h = Hash(word) & (vocab_hash_size - 1);
+  while (vocab_hash[h] != -1) {
+    if (!strcmp(vocab[vocab_hash[h]], word)) return 0;
+    h = (h + 1) & (vocab_hash_size - 1);
+  }
+  vocab_hash[h] = size;
+  vocab[size] = malloc(strlen(word) + 1);
+  strcpy(vocab[size], word);
+  vocab_chars[size] = malloc(5 * sizeof(int));
+  memcpy(vocab_chars[size], ids, 5 * sizeof(int));
+  return 1;
+}
+
+// Word lengths of 1, 2, 3 and 4 characters with the frequencies 25%, 55%, 12%, 8%
+void BuildVocab() {
+  long long a, size = 0, tries = 0, len;
+  int ids[5];
+  char word[MAX_STRING];
+  double sum = 0;
+  for (vocab_hash_size = 1; vocab_hash_size < vocab_size * 2; vocab_hash_size *= 2);
+  vocab_hash = malloc(vocab_hash_size * sizeof(long long));
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  vocab = malloc(vocab_size * sizeof(char *));
+  vocab_chars = malloc(vocab_size * sizeof(int *));
+  while (size < vocab_size) {
+    if (++tries > vocab_size * 100) {
+      fprintf(stderr, "ERROR: cannot build %lld distinct words from %lld characters\n", vocab_size, char_size);
+      exit(1);
+    }
+    a = Random() % 100;
+    len = a < 25 ? 1 : a < 80 ? 2 : a < 92 ? 3 : 4;
+    word[0] = 0;
+    for (a = 0; a < len; a++) {
+      ids[a] = Random() % char_size;
+      strcat(word, chars[ids[a]]);
+    }
+    ids[len] = -1;
+    size += AddWord(word, ids, size);
+  }
+  cdf = malloc(vocab_size * sizeof(double));
+  for (a = 0; a < vocab_size; a++) {
+    sum += pow(a + 1, -zipf);
+    cdf[a] = sum;
+  }
+  for (a = 0; a < vocab_size; a++) cdf[a] /= sum;
+}
+
+long long DrawWord() {
+  double u = (Random() & 0xFFFFFFFFFFFFULL) / (double)0x1000000000000ULL;
+  long long lo = 0, hi = vocab_size - 1, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < u) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// A word of the topic of a line: a rank drawn as by DrawWord, moved to the nearest
+// word of the topic
+long long DrawTopicWord(long long topic) {
+  long long r = DrawWord() / topics * topics + topic;
+  return r < vocab_size ? r : DrawWord();
+}
+
+void WriteCorpus() {
+  long long a = 0, b, len, topic = 0;
+  FILE *fo = fopen(output_file, "wb");
+  if (fo == NULL) {
+    fprintf(stderr, "Cannot open %s: permission denied\n", output_file);
+    exit(1);
+  }
+  while (a < num_words) {
+    len = 5 + Random() % 31;
+    if (len > num_words - a) len = num_words - a;
+    if (topics > 0) topic = Random() % topics;
+    for (b = 0; b < len; b++) {
+      if (b > 0) fputc(' ', fo);
+      fputs(vocab[topics > 0 && Random() % 2 ? DrawTopicWord(topic) : DrawWord()], fo);
+    }
+    fputc('\n', fo);
+    a += len;
+  }
+  fclose(fo);
+}
+
+void WriteWord2Pron() {
+  long long a, b;
+  FILE *fo = fopen(word2pron_file, "wb");
+  if (fo == NULL) {
+    fprintf(stderr, "Cannot open %s: permission denied\n", word2pron_file);
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) {
+    fprintf(fo, "%s ", vocab[a]);
+    for (b = 0; vocab_chars[a][b] != -1; b++)
+      fprintf(fo, b > 0 ? "_%s" : "%s", prons[char_pron[vocab_chars[a][b]]]);
+    fprintf(fo, "\n");
+  }
+  fclose(fo);
+}
+
+// Pairs of frequent words, half of them of the same topic
+void WriteSim() {
+  long long a, w1, w2, n = vocab_size < SIM_WORDS ? vocab_size : SIM_WORDS;
+  FILE *fo = fopen(sim_file, "wb");
+  if (fo == NULL) {
+    fprintf(stderr, "Cannot open %s: permission denied\n", sim_file);
+    exit(1);
+  }
+  for (a = 0; a < SIM_PAIRS; a++) {
+    w1 = Random() % n;
+    if (a % 2 == 0 && n > topics) w2 = (Random() % (n / topics)) * topics + w1 % topics;
+    else w2 = Random() % n;
+    if (w1 == w2) continue;
+    fprintf(fo, "%s\t%s\t%d\n", vocab[w1], vocab[w2], w1 % topics == w2 % topics);
+  }
+  fclose(fo);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i;
+  if (argc == 1) {
+    printf("Synthetic Chinese corpus generator\n\n");
+    printf("Options:\n");
+    printf("\t-char2comp <file>\n");
+    printf("\t\tThe characters of the words are taken from <file>\n");
+    printf("\t-pron <file>\n");
+    printf("\t\tThe pronunciations of the characters are taken from <file>\n");
+    printf("\t-output <file>\n");
+    printf("\t\tUse <file> to save the corpus\n");
+    printf("\t-word2pron <file>\n");
+    printf("\t\tUse <file> to save the words and their pronunciation\n");
+    printf("\t-words <int>\n");
+    printf("\t\tNumber of words of the corpus; default is 10000000\n");
+    printf("\t-vocab <int>\n");
+    printf("\t\tNumber of distinct words; default is 100000\n");
+    printf("\t-zipf <float>\n");
+    printf("\t\tExponent of the Zipf distribution of the words; default is 1.0\n");
+    printf("\t-topics <int>\n");
+    printf("\t\tNumber of topics of the words; default is 0 (none)\n");
+    printf("\t-sim <file>\n");
+    printf("\t\tUse <file> to save a word similarity set of the topics (requires -topics)\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tRandom seed; default is 1\n");
+    printf("\nExamples:\n");
+    printf("./gencorpus -char2comp ../subcharacter/char2comp.txt -pron ../subcharacter/pron_tone.txt -output corpus -word2pron word2pron -words 10000000\n\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-char2comp", argc, argv)) > 0) strcpy(char2comp_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-pron", argc, argv)) > 0) strcpy(pron_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-word2pron", argc, argv)) > 0) strcpy(word2pron_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-words", argc, argv)) > 0) num_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab", argc, argv)) > 0) vocab_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-zipf", argc, argv)) > 0) zipf = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-topics", argc, argv)) > 0) topics = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sim", argc, argv)) > 0) strcpy(sim_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) next_random = atoll(argv[i + 1]);
+  if (output_file[0] == 0 || word2pron_file[0] == 0 || vocab_size < 1 || topics < 0 || (sim_file[0] && topics == 0)) {
+    printf("Error: -output and -word2pron must be given, -vocab must be positive and -sim requires -topics\n");
+    return 1;
+  }
+  ReadChars();
+  ReadPronunciations();
+  BuildVocab();
+  WriteCorpus();
+  WriteWord2Pron();
+  if (sim_file[0] != 0) WriteSim();
+  return 0;
+}
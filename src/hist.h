@@ -0,0 +1,22 @@
+// Log-scale histograms of durations, 4 buckets per power of 2, shared by the profile of
+// pcwe (make PROFILE=1) and the latencies of pcwe-serve and pcwe-load.
+
+#ifndef PCWE_HIST_H
+#define PCWE_HIST_H
+
+#define HIST_BUCKETS 256
+
+static inline int HistBucket(unsigned long long x) {
+  int l;
+  if (x < 4) return x;
+  l = 63 - __builtin_clzll(x);
+  return (l - 1) * 4 + ((x >> (l - 2)) & 3);
+}
+
+// The upper end of a bucket
+static inline unsigned long long HistBucketEnd(int bucket) {
+  if (bucket < 4) return bucket + 1;
+  return (unsigned long long)(4 + bucket % 4 + 1) << (bucket / 4 - 1);
+}
+
+#endif
@@ -0,0 +1,302 @@
+// Homophone index of a vocabulary. See homophone.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "homophone.h"
+
+#define HOMOPHONE_MAGIC 0x48574350  // "PCWH"
+
+static struct homophone_index *sort_index;  // of the comparisons of qsort
+
+static void *HomophoneAlloc(size_t size) {
+  void *p = calloc(size ? size : 1, 1);
+  if (p == NULL) {
+    fprintf(stderr, "homophone: memory allocation failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+static char *CopyString(const char *s, long long n) {
+  char *c = (char *)HomophoneAlloc(n + 1);
+  memcpy(c, s, n);
+  return c;
+}
+
+// Length of a pronunciation without its tone, the digits at its end
+static long long SyllableLength(const char *s) {
+  long long n = strlen(s);
+  while (n > 0 && s[n - 1] >= '0' && s[n - 1] <= '9') n--;
+  return n;
+}
+
+// Compares name with the n bytes of s
+static int CompareN(const char *name, const char *s, long long n) {
+  int r = strncmp(name, s, n);
+  if (r != 0) return r;
+  return name[n] != 0;
+}
+
+// Compares the nx pronunciations of x with the ny of y, shorter keys first; a key is
+// turned into syllables if its toneless flag is set
+static int CompareKeys(struct homophone_index *h, const int *x, long long nx, int toneless_x,
+                       const int *y, long long ny, int toneless_y) {
+  long long i;
+  int a, b;
+  if (nx != ny) return nx < ny ? -1 : 1;
+  for (i = 0; i < nx; i++) {
+    a = toneless_x ? h->syllable[x[i]] : x[i];
+    b = toneless_y ? h->syllable[y[i]] : y[i];
+    if (a != b) return a < b ? -1 : 1;
+  }
+  return 0;
+}
+
+static int CompareWordKeys(struct homophone_index *h, long long a, long long b, int toneless) {
+  int r = CompareKeys(h, &h->key[h->key_start[a]], h->key_start[a + 1] - h->key_start[a], toneless,
+                      &h->key[h->key_start[b]], h->key_start[b + 1] - h->key_start[b], toneless);
+  if (r != 0) return r;
+  return a < b ? -1 : a > b;
+}
+
+static int ByTone(const void *a, const void *b) {
+  return CompareWordKeys(sort_index, *(const long long *)a, *(const long long *)b, 0);
+}
+
+static int BySyllable(const void *a, const void *b) {
+  return CompareWordKeys(sort_index, *(const long long *)a, *(const long long *)b, 1);
+}
+
+static int ByWord(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  int r = strcmp(sort_index->word[x], sort_index->word[y]);
+  if (r != 0) return r;
+  return x < y ? -1 : x > y;
+}
+
+static int ByPron(const void *a, const void *b) {
+  return strcmp(sort_index->pron[*(const int *)a], sort_index->pron[*(const int *)b]);
+}
+
+static int ByString(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// The syllables of the pronunciations, and the pronunciations in order of their strings
+static void PrepareProns(struct homophone_index *h) {
+  long long a, n = 0;
+  char **name = (char **)HomophoneAlloc(h->prons * sizeof(char *));
+  h->pron_order = (int *)HomophoneAlloc(h->prons * sizeof(int));
+  for (a = 0; a < h->prons; a++) h->pron_order[a] = a;
+  sort_index = h;
+  qsort(h->pron_order, h->prons, sizeof(int), ByPron);
+  for (a = 0; a < h->prons; a++) name[a] = CopyString(h->pron[a], SyllableLength(h->pron[a]));
+  qsort(name, h->prons, sizeof(char *), ByString);
+  for (a = 0; a < h->prons; a++) {
+    if (n > 0 && !strcmp(name[a], name[n - 1])) free(name[a]);
+    else name[n++] = name[a];
+  }
+  h->syllable_name = name;
+  h->syllables = n;
+  h->syllable = (int *)HomophoneAlloc(h->prons * sizeof(int));
+  for (a = 0; a < h->prons; a++) h->syllable[a] = HomophoneSyllable(h, h->pron[a]);
+}
+
+void HomophoneBuild(struct homophone_index *h, long long words, char **word, const long long *id,
+                    int **key, const int *length, long long prons, char **pron) {
+  long long a, n = 0;
+  memset(h, 0, sizeof(struct homophone_index));
+  h->words = words;
+  h->prons = prons;
+  for (a = 0; a < words; a++) n += length[a];
+  h->word = (char **)HomophoneAlloc(words * sizeof(char *));
+  h->id = (long long *)HomophoneAlloc(words * sizeof(long long));
+  h->key_start = (long long *)HomophoneAlloc((words + 1) * sizeof(long long));
+  h->key = (int *)HomophoneAlloc(n * sizeof(int));
+  for (a = n = 0; a < words; a++) {
+    h->word[a] = CopyString(word[a], strlen(word[a]));
+    h->id[a] = id[a];
+    h->key_start[a] = n;
+    memcpy(&h->key[n], key[a], length[a] * sizeof(int));
+    n += length[a];
+  }
+  h->key_start[words] = n;
+  h->pron = (char **)HomophoneAlloc(prons * sizeof(char *));
+  for (a = 0; a < prons; a++) h->pron[a] = CopyString(pron[a], strlen(pron[a]));
+  PrepareProns(h);
+  h->word_order = (long long *)HomophoneAlloc(words * sizeof(long long));
+  h->by_tone = (long long *)HomophoneAlloc(words * sizeof(long long));
+  h->by_syllable = (long long *)HomophoneAlloc(words * sizeof(long long));
+  for (a = 0; a < words; a++) h->word_order[a] = h->by_tone[a] = h->by_syllable[a] = a;
+  sort_index = h;
+  qsort(h->word_order, words, sizeof(long long), ByWord);
+  qsort(h->by_tone, words, sizeof(long long), ByTone);
+  qsort(h->by_syllable, words, sizeof(long long), BySyllable);
+}
+
+static void WriteString(const char *s, FILE *fo) {
+  int len = strlen(s);
+  fwrite(&len, sizeof(int), 1, fo);
+  fwrite(s, 1, len, fo);
+}
+
+// File layout: magic, words, prons, length of all keys, pronunciations and words
+// (length, bytes), ids, key starts, keys, then the word, key and syllable key orders
+int HomophoneSave(struct homophone_index *h, const char *file) {
+  long long a, header[3] = {h->words, h->prons, h->key_start[h->words]};
+  int magic = HOMOPHONE_MAGIC;
+  FILE *fo = fopen(file, "wb");
+  if (fo == NULL) return -1;
+  fwrite(&magic, sizeof(int), 1, fo);
+  fwrite(header, sizeof(long long), 3, fo);
+  for (a = 0; a < h->prons; a++) WriteString(h->pron[a], fo);
+  for (a = 0; a < h->words; a++) WriteString(h->word[a], fo);
+  fwrite(h->id, sizeof(long long), h->words, fo);
+  fwrite(h->key_start, sizeof(long long), h->words + 1, fo);
+  fwrite(h->key, sizeof(int), header[2], fo);
+  fwrite(h->word_order, sizeof(long long), h->words, fo);
+  fwrite(h->by_tone, sizeof(long long), h->words, fo);
+  fwrite(h->by_syllable, sizeof(long long), h->words, fo);
+  return fclose(fo);
+}
+
+static int ReadAll(void *p, size_t size, size_t n, FILE *fin) {
+  return fread(p, size, n, fin) == n;
+}
+
+static int ReadString(char **s, FILE *fin) {
+  int len;
+  if (!ReadAll(&len, sizeof(int), 1, fin) || len < 0) return 0;
+  *s = (char *)HomophoneAlloc(len + 1);
+  return ReadAll(*s, 1, len, fin);
+}
+
+// Every key start, key and order is in range
+static int Valid(struct homophone_index *h) {
+  long long a;
+  if (h->key_start[0] != 0) return 0;
+  for (a = 0; a < h->words; a++) if (h->key_start[a + 1] < h->key_start[a]) return 0;
+  for (a = 0; a < h->key_start[h->words]; a++) if (h->key[a] < 0 || h->key[a] >= h->prons) return 0;
+  for (a = 0; a < h->words; a++)
+    if (h->id[a] < 0 || h->word_order[a] < 0 || h->word_order[a] >= h->words || h->by_tone[a] < 0 ||
+        h->by_tone[a] >= h->words || h->by_syllable[a] < 0 || h->by_syllable[a] >= h->words) return 0;
+  return 1;
+}
+
+int HomophoneLoad(struct homophone_index *h, const char *file) {
+  long long a, header[3];
+  int magic = 0, ok;
+  FILE *fin = fopen(file, "rb");
+  memset(h, 0, sizeof(struct homophone_index));
+  if (fin == NULL) return -1;
+  ok = ReadAll(&magic, sizeof(int), 1, fin) && magic == HOMOPHONE_MAGIC && ReadAll(header, sizeof(long long), 3, fin) &&
+       header[0] >= 0 && header[1] >= 0 && header[2] >= 0;
+  if (!ok) {
+    fclose(fin);
+    return -1;
+  }
+  h->words = header[0];
+  h->prons = header[1];
+  h->pron = (char **)HomophoneAlloc(h->prons * sizeof(char *));
+  h->word = (char **)HomophoneAlloc(h->words * sizeof(char *));
+  for (a = 0; a < h->prons && ok; a++) ok = ReadString(&h->pron[a], fin);
+  for (a = 0; a < h->words && ok; a++) ok = ReadString(&h->word[a], fin);
+  h->id = (long long *)HomophoneAlloc(h->words * sizeof(long long));
+  h->key_start = (long long *)HomophoneAlloc((h->words + 1) * sizeof(long long));
+  h->key = (int *)HomophoneAlloc(header[2] * sizeof(int));
+  h->word_order = (long long *)HomophoneAlloc(h->words * sizeof(long long));
+  h->by_tone = (long long *)HomophoneAlloc(h->words * sizeof(long long));
+  h->by_syllable = (long long *)HomophoneAlloc(h->words * sizeof(long long));
+  ok = ok && ReadAll(h->id, sizeof(long long), h->words, fin) &&
+       ReadAll(h->key_start, sizeof(long long), h->words + 1, fin) && h->key_start[h->words] == header[2] &&
+       ReadAll(h->key, sizeof(int), header[2], fin) && ReadAll(h->word_order, sizeof(long long), h->words, fin) &&
+       ReadAll(h->by_tone, sizeof(long long), h->words, fin) && ReadAll(h->by_syllable, sizeof(long long), h->words, fin) &&
+       Valid(h);
+  fclose(fin);
+  if (!ok) {
+    HomophoneFree(h);
+    return -1;
+  }
+  PrepareProns(h);
+  return 0;
+}
+
+void HomophoneFree(struct homophone_index *h) {
+  long long a;
+  if (h->word != NULL) for (a = 0; a < h->words; a++) free(h->word[a]);
+  if (h->pron != NULL) for (a = 0; a < h->prons; a++) free(h->pron[a]);
+  if (h->syllable_name != NULL) for (a = 0; a < h->syllables; a++) free(h->syllable_name[a]);
+  free(h->word);
+  free(h->id);
+  free(h->key_start);
+  free(h->key);
+  free(h->pron);
+  free(h->syllable);
+  free(h->syllable_name);
+  free(h->pron_order);
+  free(h->word_order);
+  free(h->by_tone);
+  free(h->by_syllable);
+  memset(h, 0, sizeof(struct homophone_index));
+}
+
+long long HomophoneWord(struct homophone_index *h, const char *s) {
+  long long lo = 0, hi = h->words, mid;
+  int r;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    r = strcmp(h->word[h->word_order[mid]], s);
+    if (r == 0) return h->word_order[mid];
+    if (r < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return -1;
+}
+
+int HomophonePron(struct homophone_index *h, const char *s) {
+  long long lo = 0, hi = h->prons, mid;
+  int r;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    r = strcmp(h->pron[h->pron_order[mid]], s);
+    if (r == 0) return h->pron_order[mid];
+    if (r < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return -1;
+}
+
+int HomophoneSyllable(struct homophone_index *h, const char *s) {
+  long long lo = 0, hi = h->syllables, mid, n = SyllableLength(s);
+  int r;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    r = CompareN(h->syllable_name[mid], s, n);
+    if (r == 0) return mid;
+    if (r < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return -1;
+}
+
+long long HomophoneFind(struct homophone_index *h, const int *key, long long n, int toneless, long long *first) {
+  long long *order = toneless ? h->by_syllable : h->by_tone, lo = 0, hi = h->words, mid, begin;
+  // the first word whose key is not below key, then the first whose key is above it
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (CompareKeys(h, &h->key[h->key_start[order[mid]]], h->key_start[order[mid] + 1] - h->key_start[order[mid]],
+                    toneless, key, n, 0) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  begin = lo;
+  hi = h->words;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (CompareKeys(h, &h->key[h->key_start[order[mid]]], h->key_start[order[mid] + 1] - h->key_start[order[mid]],
+                    toneless, key, n, 0) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *first = begin;
+  return lo - begin;
+}
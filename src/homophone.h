@@ -0,0 +1,46 @@
+// Homophone index of a vocabulary.
+//
+// The key of a word is the sequence of the pronunciations of its characters, as rows
+// of the pronunciation table (-output-pron), e.g. zhong1 guo2. The words are kept in
+// two sorted-key arrays: in order of their keys, and in order of their keys with the
+// tones removed (zhong guo), so that the homophones of a key, or the words that differ
+// from it only in tones, are a range of an array found by binary search.
+
+#ifndef PCWE_HOMOPHONE_H
+#define PCWE_HOMOPHONE_H
+
+struct homophone_index {
+  long long words, prons, syllables;
+  char **word;            // the string of every word
+  long long *id;          // and its row in -output-word
+  long long *key_start;   // the key of word a is key[key_start[a] .. key_start[a + 1])
+  int *key;
+  char **pron;            // the string of every pronunciation
+  int *syllable;          // the pronunciation without its tone, e.g. zhong for zhong1
+  char **syllable_name;   // the string of every syllable, in order of the strings
+  int *pron_order;        // the pronunciations in order of their strings
+  long long *word_order;  // the words in order of their strings
+  long long *by_tone;     // the words in order of their keys (shorter keys first), then of a
+  long long *by_syllable; // the same with the tones removed from the keys
+};
+
+// Builds the index of words, whose keys are the length[a] pronunciations of key[a] (rows
+// of pron); the strings are copied
+void HomophoneBuild(struct homophone_index *h, long long words, char **word, const long long *id,
+                    int **key, const int *length, long long prons, char **pron);
+
+int HomophoneSave(struct homophone_index *h, const char *file);
+int HomophoneLoad(struct homophone_index *h, const char *file);
+void HomophoneFree(struct homophone_index *h);
+
+// The word, pronunciation or syllable of a string, or -1. The syllable of a string
+// with a tone is that of the string without it.
+long long HomophoneWord(struct homophone_index *h, const char *s);
+int HomophonePron(struct homophone_index *h, const char *s);
+int HomophoneSyllable(struct homophone_index *h, const char *s);
+
+// The words whose key is the n pronunciations (or, if toneless, the n syllables) of key:
+// by_tone[*first ..] (or by_syllable) up to the count returned
+long long HomophoneFind(struct homophone_index *h, const int *key, long long n, int toneless, long long *first);
+
+#endif
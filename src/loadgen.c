@@ -0,0 +1,205 @@
+// pcwe-load: load generator of pcwe-serve.
+//
+// Every connection sends its batches of requests for words drawn from the keys of a
+// vector file on a fixed schedule, so that all connections together send -qps requests
+// per second. The latency of a batch is counted from the time it was due, not from the
+// time it was sent, so a server that falls behind is not hidden by a client that waits:
+//
+//   ./pcwe-load -socket /tmp/pcwe.sock -words word_vec -qps 20000 -seconds 10
+//
+// At the end, the rate reached, the latency quantiles and the stats of the server are
+// printed.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "vecio.h"
+
+#define MAX_STRING 100
+
+char socket_path[MAX_STRING] = SERVE_SOCKET, words_file[MAX_STRING];
+int binary = 0, num_connections = 4, batch = 16, top_k = 10;
+double qps = 10000, seconds = 10, knn_share = 0.1, start;
+char **words;
+long long num_words, max_word;  // bytes of the longest word
+struct latency latency;
+unsigned long long sent, errors;
+
+// The keys of a vector file written by pcwe
+void ReadWords() {
+  struct vec_table v;
+  long long a;
+  if (VecRead(&v, words_file, binary ? VEC_BINARY : VEC_AUTO, 0) != 0) {
+    printf("Cannot read %s\n", words_file);
+    exit(1);
+  }
+  num_words = v.rows;
+  words = v.words;
+  for (a = 0; a < num_words; a++) if ((long long)strlen(words[a]) > max_word) max_word = strlen(words[a]);
+  if (num_words == 0) {
+    printf("No words in %s\n", words_file);
+    exit(1);
+  }
+}
+
+int Connect() {
+  struct sockaddr_un sa;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, socket_path, sizeof(sa.sun_path) - 1);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    fprintf(stderr, "Cannot connect to %s: %s\n", socket_path, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+// Sends a batch and reads its n answers into buf; returns the answers that are not errors
+long long Request(int fd, char *out, long long out_len, char **buf, long long *max, long long n) {
+  long long done = 0, len = 0, lines = 0, good = 0, r;
+  char *line;
+  while (done < out_len) {
+    r = send(fd, out + done, out_len - done, MSG_NOSIGNAL);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      fprintf(stderr, "send: %s\n", strerror(errno));
+      exit(1);
+    }
+    done += r;
+  }
+  while (lines < n) {
+    if (*max - len < 65536) {
+      *max = *max * 2 + 65536;
+      *buf = (char *)realloc(*buf, *max);
+      if (*buf == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+      }
+    }
+    r = recv(fd, *buf + len, *max - len - 1, 0);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) {
+      fprintf(stderr, "The server closed the connection\n");
+      exit(1);
+    }
+    for (line = *buf + len; line < *buf + len + r; line++) if (*line == '\n') lines++;
+    len += r;
+  }
+  (*buf)[len] = 0;
+  for (line = *buf; line < *buf + len; line = memchr(line, '\n', *buf + len - line) + 1)
+    if (strncmp(line, "error", 5)) good++;
+  return good;
+}
+
+void *ConnectionThread(void *id) {
+  long long a, out_len, max = 0, good;
+  double interval = batch * num_connections / qps, due = start + interval * (long long)id / num_connections, now;
+  unsigned long long next_random = (long long)id * 7919 + 1;
+  char *out = (char *)malloc(batch * (max_word + 32)), *buf = NULL, *word;
+  int fd = Connect();
+  if (out == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  while (due < start + seconds) {
+    now = Now();
+    if (due > now) usleep((due - now) * 1e6);
+    out_len = 0;
+    for (a = 0; a < batch; a++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      word = words[(next_random >> 16) % num_words];
+      if ((next_random >> 40) % 1000 < knn_share * 1000) out_len += sprintf(out + out_len, "knn %d %s\n", top_k, word);
+      else out_len += sprintf(out + out_len, "vec %s\n", word);
+    }
+    good = Request(fd, out, out_len, &buf, &max, batch);
+    LatencyAdd(&latency, Now() - due, batch);
+    __atomic_add_fetch(&sent, batch, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&errors, batch - good, __ATOMIC_RELAXED);
+    due += interval;
+  }
+  close(fd);
+  free(out);
+  free(buf);
+  return NULL;
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i, fd;
+  long long max = 0;
+  double elapsed;
+  char *buf = NULL;
+  pthread_t *pt;
+  if (argc == 1) {
+    printf("Load generator of pcwe-serve\n\n");
+    printf("Options:\n");
+    printf("\t-words <file>\n");
+    printf("\t\tVector file (-output-word) whose words are requested\n");
+    printf("\t-binary <int>\n");
+    printf("\t\tThe vector file is in binary mode; default is 0 (the format is detected)\n");
+    printf("\t-socket <file>\n");
+    printf("\t\tPath of the Unix domain socket of the server; default is %s\n", SERVE_SOCKET);
+    printf("\t-qps <float>\n");
+    printf("\t\tRequests per second of all connections; default is 10000\n");
+    printf("\t-seconds <float>\n");
+    printf("\t\tDuration of the run; default is 10\n");
+    printf("\t-connections <int>\n");
+    printf("\t\tConnections, one thread each; default is 4\n");
+    printf("\t-batch <int>\n");
+    printf("\t\tRequests sent at once by a connection; default is 16\n");
+    printf("\t-knn <float>\n");
+    printf("\t\tShare of knn requests, the others are vec requests; default is 0.1\n");
+    printf("\t-k <int>\n");
+    printf("\t\tNeighbours of a knn request; default is 10\n");
+    printf("\nExamples:\n");
+    printf("./pcwe-load -words word_vec -qps 20000 -seconds 10\n\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-words", argc, argv)) > 0) strcpy(words_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-socket", argc, argv)) > 0) strcpy(socket_path, argv[i + 1]);
+  if ((i = ArgPos((char *)"-qps", argc, argv)) > 0) qps = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seconds", argc, argv)) > 0) seconds = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-connections", argc, argv)) > 0) num_connections = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-batch", argc, argv)) > 0) batch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-knn", argc, argv)) > 0) knn_share = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-k", argc, argv)) > 0) top_k = atoi(argv[i + 1]);
+  if (words_file[0] == 0 || qps <= 0 || num_connections < 1 || batch < 1) {
+    printf("-words must be given, -qps, -connections and -batch must be positive\n");
+    return 1;
+  }
+  ReadWords();
+  pt = (pthread_t *)malloc(num_connections * sizeof(pthread_t));
+  start = Now() + 0.1;
+  for (i = 0; i < num_connections; i++) pthread_create(&pt[i], NULL, ConnectionThread, (void *)(long long)i);
+  for (i = 0; i < num_connections; i++) pthread_join(pt[i], NULL);
+  elapsed = Now() - start;
+  printf("Requests: %llu in %.2f s, %.0f per second (target %.0f), %llu errors\n", sent, elapsed, sent / elapsed, qps, errors);
+  printf("Latency: p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us\n", LatencyQuantile(&latency, 0.5),
+         LatencyQuantile(&latency, 0.9), LatencyQuantile(&latency, 0.99), latency.max * 1e-3);
+  fd = Connect();
+  Request(fd, "stats\n", 6, &buf, &max, 1);
+  printf("Server: %s", buf);
+  close(fd);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,208 @@
+// Microbenchmarks of the hot paths of pcwe.c, written as JSON.
+//
+// pcwe.c is compiled into this file, so the functions measured are the ones of the
+// trainer: ReadWord, SearchVocab, InitUnigramTable, the join_type 1 and 2 kernels
+// (JoinSum, JoinAverage) and the writer of the output files (WriteRow).
+
+#define PCWE_NO_MAIN
+#include "pcwe.c"
+
+#define MAX_TOKENS 2000000
+#define KERNEL_ROWS 4096
+
+char json_file[MAX_STRING], vector_file[MAX_STRING] = "microbench_vectors.tmp";
+FILE *json;
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void BenchReadWord() {
+  char word[MAX_STRING];
+  long long words = 0;
+  double t;
+  FILE *fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    fprintf(stderr, "no such file or directory: %s\n", train_file);
+    exit(1);
+  }
+  t = Now();
+  while (1) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    words++;
+  }
+  t = Now() - t;
+  fprintf(json, "  \"read_word\": {\"words\": %lld, \"seconds\": %.4f, \"words_per_sec\": %.0f, \"mb_per_sec\": %.2f},\n",
+          words, t, words / t, ftell(fin) / t / 1048576);
+  fclose(fin);
+}
+
+void BenchVocab() {
+  long long a, n = 0, found = 0, size = 0, max_size = MAX_TOKENS * 8LL;
+  char word[MAX_STRING], *buf = (char *)malloc(max_size), **token = (char **)malloc(MAX_TOKENS * sizeof(char *));
+  double t;
+  FILE *fin;
+  t = Now();
+  LearnVocabFromTrainFile();
+  t = Now() - t;
+  fprintf(json, "  \"learn_vocab\": {\"vocab_size\": %lld, \"train_words\": %lld, \"seconds\": %.4f},\n",
+          vocab_size, train_words, t);
+
+  // the first tokens of the corpus, looked up as they are and with a suffix (misses)
+  fin = fopen(train_file, "rb");
+  while (n < MAX_TOKENS) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    if (size + strlen(word) + 2 > max_size) break;
+    token[n++] = &buf[size];
+    strcpy(&buf[size], word);
+    size += strlen(word) + 2;
+  }
+  fclose(fin);
+  t = Now();
+  for (a = 0; a < n; a++) found += SearchVocab(token[a]) != -1;
+  t = Now() - t;
+  fprintf(json, "  \"search_vocab_hit\": {\"lookups\": %lld, \"found\": %lld, \"seconds\": %.4f, \"lookups_per_sec\": %.0f},\n",
+          n, found, t, n / t);
+  for (a = 0; a < n; a++) strcat(token[a], "#");
+  found = 0;
+  t = Now();
+  for (a = 0; a < n; a++) found += SearchVocab(token[a]) != -1;
+  t = Now() - t;
+  fprintf(json, "  \"search_vocab_miss\": {\"lookups\": %lld, \"found\": %lld, \"seconds\": %.4f, \"lookups_per_sec\": %.0f},\n",
+          n, found, t, n / t);
+  free(buf);
+  free(token);
+}
+
+void BenchUnigramTable() {
+  double t = Now();
+  InitUnigramTable();
+  t = Now() - t;
+  fprintf(json, "  \"init_unigram_table\": {\"entries\": %d, \"seconds\": %.4f},\n", table_size, t);
+}
+
+// Calls a join_type kernel as the training loop does: negative + 1 output rows per
+// target word, drawn from KERNEL_ROWS random rows
+void BenchKernel(int type) {
+  long long a, b, calls = 200000000LL / layer1_size, label;
+  real *neu[8], *rows, *neg_grad, check = 0;
+  double t;
+  unsigned long long r = 1;
+  for (a = 0; a < 8; a++) neu[a] = (real *)calloc(layer1_size, sizeof(real));
+  rows = (real *)malloc(KERNEL_ROWS * layer1_size * sizeof(real));
+  neg_grad = (real *)calloc(layer1_size, sizeof(real));
+  for (a = 0; a < KERNEL_ROWS * layer1_size; a++) {
+    r = r * (unsigned long long)25214903917 + 11;
+    rows[a] = ((r >> 16) % 1000 / 1000.0 - 0.5) / layer1_size * 20;
+  }
+  for (a = 0; a < 4; a++) memcpy(neu[a], &rows[(a + 1) * layer1_size], layer1_size * sizeof(real));
+  t = Now();
+  for (a = 0; a < calls; a++) {
+    if (a % (negative + 1) == 0) for (b = 4; b < 8; b++) memset(neu[b], 0, layer1_size * sizeof(real));
+    r = r * (unsigned long long)25214903917 + 11;
+    label = a % (negative + 1) == 0;
+    if (type == 1) JoinSum(neu[0], neu[1], neu[2], neu[3], neu[4], neu[5], neu[6], neu[7],
+                           &rows[(r >> 16) % KERNEL_ROWS * layer1_size], neg_grad, label);
+    else JoinAverage(neu[0], neu[1], neu[2], neu[3], neu[4], neu[5], neu[6], neu[7],
+                     &rows[(r >> 16) % KERNEL_ROWS * layer1_size], neg_grad, label);
+    check += neg_grad[a % layer1_size];
+  }
+  t = Now() - t;
+  fprintf(json, "  \"join_type_%d\": {\"calls\": %lld, \"seconds\": %.4f, \"calls_per_sec\": %.0f, \"ns_per_call\": %.1f, \"check\": %g},\n",
+          type, calls, t, calls / t, t / calls * 1e9, check);
+  for (a = 0; a < 8; a++) free(neu[a]);
+  free(rows);
+  free(neg_grad);
+}
+
+// Writes the word vectors as the output files are written, in text and binary mode
+void BenchWriter() {
+  long long a, b;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  double t;
+  FILE *fo;
+  a = posix_memalign((void **)&synword, 128, (long long)vocab_size * layer1_size * sizeof(weight));
+  if (synword == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_size * layer1_size; a++) synword[a] = ToWeight((rand() / (real)RAND_MAX - 0.5) / layer1_size);
+  for (b = 0; b < 2; b++) {
+    binary = b;
+    fo = fopen(vector_file, "wb");
+    if (fo == NULL) {
+      fprintf(stderr, "Cannot open %s: permission denied\n", vector_file);
+      exit(1);
+    }
+    t = Now();
+    fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
+    for (a = 0; a < vocab_size; a++) {
+      fprintf(fo, "%s ", vocab[a].word);
+      WriteRow(fo, synword, a, row);
+    }
+    fclose(fo);
+    t = Now() - t;
+    fo = fopen(vector_file, "rb");
+    fseek(fo, 0, SEEK_END);
+    fprintf(json, "  \"write_%s\": {\"rows\": %lld, \"seconds\": %.4f, \"rows_per_sec\": %.0f, \"mb_per_sec\": %.2f}%s\n",
+            b ? "binary" : "text", vocab_size, t, vocab_size / t, ftell(fo) / t / 1048576, b ? "" : ",");
+    fclose(fo);
+  }
+  remove(vector_file);
+  free(row);
+}
+
+int main(int argc, char **argv) {
+  int i;
+  setlocale(LC_ALL, "en_US.UTF-8");
+  if (argc == 1) {
+    printf("Microbenchmarks of PCWE\n\n");
+    printf("Options:\n");
+    printf("\t-train <file>\n");
+    printf("\t\tCorpus read by the benchmarks (e.g. written by gencorpus)\n");
+    printf("\t-size <int>\n");
+    printf("\t\tSize of the vectors; default is 200\n");
+    printf("\t-negative <int>\n");
+    printf("\t\tNegative samples per target word; default is 5\n");
+    printf("\t-min-count <int>\n");
+    printf("\t\tMinimal count of the words of the vocabulary; default is 5\n");
+    printf("\t-json <file>\n");
+    printf("\t\tWrite the results to <file>; default is the standard output\n");
+    printf("\t-output <file>\n");
+    printf("\t\tTemporary file of the writer benchmark; default is microbench_vectors.tmp\n");
+    printf("\nExamples:\n");
+    printf("./microbench -train corpus -size 200 -json micro.json\n\n");
+    return 0;
+  }
+  negative = 5;
+  if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-json", argc, argv)) > 0) strcpy(json_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(vector_file, argv[i + 1]);
+  json = json_file[0] ? fopen(json_file, "wb") : stdout;
+  if (json == NULL) {
+    fprintf(stderr, "Cannot open %s: permission denied\n", json_file);
+    return 1;
+  }
+  debug_mode = 0;
+  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
+  expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
+  for (i = 0; i <= EXP_TABLE_SIZE; i++) {
+    expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
+    expTable[i] = expTable[i] / (expTable[i] + 1);
+  }
+
+  fprintf(json, "{\n  \"size\": %lld, \"negative\": %d, \"storage\": \"%s\",\n", layer1_size, negative, STORAGE_NAME);
+  BenchReadWord();
+  BenchVocab();
+  BenchUnigramTable();
+  BenchKernel(1);
+  BenchKernel(2);
+  BenchWriter();
+  fprintf(json, "}\n");
+  if (json != stdout) fclose(json);
+  return 0;
+}
@@ -18,28 +18,61 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <locale.h>
 #include <wchar.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "quant.h"
+#include "dist.h"
+#include "corpus.h"
+#include "homophone.h"
+#include "hist.h"
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+#ifdef PCWE_PROFILE
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
 
-//Unicode range of Chinese characters
-#define MIN_CHINESE 0x4E00
-#define MAX_CHINESE 0x9FCB
+// Unicode ranges of Chinese characters: CJK Unified Ideographs, Extension A,
+// Extensions B-F, Compatibility Ideographs (and Supplement) and Extension G
+#define CHINESE_RANGES 6
+const int chinese_range[CHINESE_RANGES][2] = {
+  {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xF900, 0xFAFF},
+  {0x20000, 0x2EBEF}, {0x2F800, 0x2FA1F}, {0x30000, 0x3134F}};
 
-// number of chinese characters
-#define CHAR_SIZE (MAX_CHINESE - MIN_CHINESE + 1)
+// characters, components and pronunciations have compact ids: only those reachable
+// from the vocabulary get a row, numbered in order of first use by the sorted vocabulary
 #define COMP_SIZE 14000
 #define PRON_SIZE 2060
 
-// Maximum 30 * 0.7 = 21M words in the vocabulary
-const int vocab_hash_size = 30000000;
+// Maximum 21M words in the vocabulary, the infrequent words are removed beyond (ReduceVocab)
+#define VOCAB_MAX_WORDS 21000000
+#define VOCAB_HASH_MIN_SIZE 4096
 
 typedef float real;
 
+// Storage type of the embedding tables. The tables can be stored in 16 bits
+// (make STORAGE=bf16 or STORAGE=fp16) to halve their memory and bandwidth; the
+// neurons and gradients are always computed in real, and the updates of the
+// tables are stochastically rounded so that small updates are not lost.
+#if defined(STORAGE_BF16) || defined(STORAGE_FP16)
+typedef unsigned short weight;
+#else
+typedef real weight;
+#endif
+
 struct vocab_word {
   long long cn;
   char *word;
@@ -47,7 +80,8 @@ struct vocab_word {
       *pronunciation;
   /*
    * cn             :  the count of a word
-   * character[i]   : Unicode (the i-th character in the word) - MIN_CHINESE
+   * character[i]   : id of the i-th character in the word
+                      (its Unicode until BuildCharTable() assigns the compact ids)
    * character_size : the length of the word
             (not equal to the length of string due to UTF-8 encoding)
    * pronunciation[i]: index of i-th character's pronunciation.
@@ -75,9 +109,20 @@ char train_file[MAX_STRING], // training corpus file
      pron_file[MAX_STRING], // pron.txt, a list of pronunciation seperated by space
      word2pron_file[MAX_STRING]; // word2pron.txt each line consists of a Chinese word and its pronunciation
 char output_word[MAX_STRING], output_char[MAX_STRING], output_comp[MAX_STRING],
-  output_pron[MAX_STRING];
+  output_pron[MAX_STRING],
+  output_homophone[MAX_STRING]; // homophone index of the vocabulary (see homophone.h)
+char save_model_file[MAX_STRING], // full training state written after training
+     load_model_file[MAX_STRING]; // training state to continue from (incremental training)
 struct vocab_word *vocab;
-struct char_component char2comp[CHAR_SIZE];
+struct char_component *char2comp; // indexed by character id
+int *char_unicode; // char_unicode[i] : Unicode of character i
+
+// open addressing map from Unicode to character id, at most half full
+struct char_hash_entry {
+  int unicode, id;
+};
+struct char_hash_entry *char_hash;
+long long char_hash_size = 0;
 struct components *comp_array;
 struct pronunciation *pron_array;
 
@@ -86,23 +131,486 @@ int binary = 0, cbow = 0, debug_mode = 2, window = 5, min_count = 5, iter = 5,
 int join_type = 1;   // 1 :  individual context; 2: collective context
 int pos_type = 1;  // 1:  use the surrounding subcomponents 2: use the target subcomponents, 3 use both
 int average_sum = 1; // 1: use average operation to compose the context, 0, use sum to compose the context
-
-int *vocab_hash;
+int prefetch = 1;    // prefetch the rows of the next target word
+int adagrad = 0;     // per row adaptive learning rates
+int readers = 0;     // threads that read the sentences of the training threads
+int profile_every = 0; // -profile: time the stages of 1 of every profile_every target words (make PROFILE=1)
+int quantize = 0, pq_m = 0; // export int8 and product quantized tables; subspaces of the product quantization
+
+// open addressing map from word to vocabulary id, sized to the vocabulary and at most
+// half full; the fingerprint (high bits of the hash) rejects most probes without a strcmp
+struct vocab_hash_entry {
+  unsigned int fingerprint;
+  int id;  // -1: empty
+};
+struct vocab_hash_entry *vocab_hash;
+long long vocab_hash_size = 0;
 long long layer1_size = 200,
   vocab_max_size = 1000, vocab_size = 0,
-  comp_max_size = COMP_SIZE, comp_size = 0;
+  comp_max_size = COMP_SIZE, comp_size = 0, char_max_size = 0, char_size = 0;
 int pron_max_size = PRON_SIZE, pron_size = 0;
 long long train_words = 0, word_count_actual = 0, file_size = 0;
+long long total_words = 0; // sum of vocabulary counts, normalizer of the subsampling
+                           // (equals train_words unless continuing from a saved model)
+int running_threads = 0;   // training threads that have not finished
 real alpha = 0.025, starting_alpha, sample = 0;
-real *synword, // word vectors of all words: v(w) * N
-     *syn1neg, // word vectors of all {w}UNEG(w) in negative sampling, theta_u * |{w} U NEG(w)|
-              // implementation is that: synword = syn1 = syn1neg = vocab_size * layer1_size
-     *synchar, // vector of character
-     *syncomp, // vector of component
-     *synpron, // vector of pronunciation
-     *expTable;
+weight *synword, // word vectors of all words: v(w) * N
+       *syn1neg, // word vectors of all {w}UNEG(w) in negative sampling, theta_u * |{w} U NEG(w)|
+                 // implementation is that: synword = syn1 = syn1neg = vocab_size * layer1_size
+       *synchar, // vector of character
+       *syncomp, // vector of component
+       *synpron; // vector of pronunciation
+real *adaword, *adaneg, *adachar, *adacomp, *adapron; // -adagrad: accumulator of every row of the tables
+real *expTable;
 clock_t start;
 
+//********* Embedding storage ************
+
+#define ROW_CHUNK 64  // 16-bit rows are converted in chunks of ROW_CHUNK values on the stack
+
+#if defined(STORAGE_BF16) || defined(STORAGE_FP16)
+union real_bits {
+  real f;
+  unsigned int u;
+};
+
+// 16 random bits for the stochastic rounding of the i-th value of an update: a Weyl
+// sequence started at a hash of the seed, cheap enough to be vectorized with the update
+static inline unsigned int RoundingBits(unsigned int seed, unsigned int i) {
+  return (seed * 0x9E3779B9u + i * 0x61C88647u) >> 16;
+}
+#endif
+
+#ifdef STORAGE_BF16
+#define STORAGE_NAME "bf16"
+#define ROUND_NEAREST 0x8000
+
+static inline real ToReal(weight w) {
+  union real_bits x;
+  x.u = (unsigned int)w << 16;
+  return x.f;
+}
+
+// truncates f after adding r to the 16 bits dropped
+static inline weight ToWeightRounded(real f, unsigned int r) {
+  union real_bits x;
+  x.f = f;
+  return (x.u + (r & 0xFFFF)) >> 16;
+}
+
+static inline void WidenRow(real *dst, const weight *src, int n) {
+  int i;
+  for (i = 0; i < n; i++) dst[i] = ToReal(src[i]);
+}
+
+static inline void NarrowRow(weight *dst, const real *src, int n, unsigned int seed, int stochastic) {
+  int i;
+  if (stochastic) for (i = 0; i < n; i++) dst[i] = ToWeightRounded(src[i], RoundingBits(seed, i));
+  else for (i = 0; i < n; i++) dst[i] = ToWeightRounded(src[i], ROUND_NEAREST);
+}
+#endif
+
+#ifdef STORAGE_FP16
+#define STORAGE_NAME "fp16"
+#define ROUND_NEAREST 0x1000
+
+static inline real ToReal(weight w) {
+#ifdef __F16C__
+  return _cvtsh_ss(w);
+#else
+  union real_bits x;
+  unsigned int sign = (unsigned int)(w & 0x8000) << 16, e = (w >> 10) & 0x1F, m = w & 0x3FF;
+  if (e == 0) {   // zero or subnormal: m * 2^-24
+    x.f = m * (1.0f / 16777216.0f);
+    x.u |= sign;
+  } else if (e == 31) x.u = sign | 0x7F800000 | (m << 13);
+  else x.u = sign | ((e + 112) << 23) | (m << 13);
+  return x.f;
+#endif
+}
+
+// Below 2^-14 the halves are subnormal, multiples of 2^-24, and more than 13 bits of f are
+// dropped: f is rounded in units of 2^-24 instead, with r scaled to a unit
+#define HALF_SUBNORMAL(u) (((u) & 0x7F800000) < (113u << 23))
+
+static inline weight ToSubnormalRounded(real f, unsigned int r) {
+  real q = fabsf(f) * 16777216.0f + (r & 0x1FFF) * (1.0f / 8192.0f);
+  return (f < 0 ? 0x8000 : 0) | (weight)q;
+}
+
+// truncates f to half precision after adding r to the 13 mantissa bits dropped
+static inline weight ToWeightRounded(real f, unsigned int r) {
+  union real_bits x;
+  x.f = f;
+  if (HALF_SUBNORMAL(x.u)) return ToSubnormalRounded(f, r);
+  if ((x.u & 0x7F800000) != 0x7F800000) x.u += r & 0x1FFF;
+#ifdef __F16C__
+  return _cvtss_sh(x.f, _MM_FROUND_TO_ZERO);
+#else
+  {
+    unsigned int sign = (x.u >> 16) & 0x8000, m = x.u & 0x7FFFFF;
+    int e = (int)((x.u >> 23) & 0xFF) - 127 + 15;
+    if (((x.u >> 23) & 0xFF) == 0xFF) return sign | 0x7C00 | (m ? 0x200 : 0);
+    if (e >= 31) return sign | 0x7BFF;
+    if (e <= 0) {
+      if (e < -10) return sign;
+      return sign | ((m | 0x800000) >> (14 - e));
+    }
+    return sign | (e << 10) | (m >> 13);
+  }
+#endif
+}
+
+static inline void WidenRow(real *dst, const weight *src, int n) {
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+#endif
+  for (; i < n; i++) dst[i] = ToReal(src[i]);
+}
+
+static inline void NarrowRow(weight *dst, const real *src, int n, unsigned int seed, int stochastic) {
+  int i = 0;
+#ifdef __F16C__
+  union real_bits x[8];
+  int j, tiny;
+  for (; i + 8 <= n; i += 8) {
+    for (j = 0, tiny = 0; j < 8; j++) {
+      x[j].f = src[i + j];
+      if (HALF_SUBNORMAL(x[j].u)) tiny = 1;
+      else if ((x[j].u & 0x7F800000) != 0x7F800000)
+        x[j].u += (stochastic ? RoundingBits(seed, i + j) : ROUND_NEAREST) & 0x1FFF;
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(&x[0].f), _MM_FROUND_TO_ZERO));
+    if (tiny) for (j = 0; j < 8; j++) if (HALF_SUBNORMAL(x[j].u))
+      dst[i + j] = ToSubnormalRounded(src[i + j], stochastic ? RoundingBits(seed, i + j) : ROUND_NEAREST);
+  }
+#endif
+  for (; i < n; i++) dst[i] = ToWeightRounded(src[i], stochastic ? RoundingBits(seed, i) : ROUND_NEAREST);
+}
+#endif
+
+#if defined(STORAGE_BF16) || defined(STORAGE_FP16)
+static inline weight ToWeight(real f) {
+  return ToWeightRounded(f, ROUND_NEAREST);
+}
+
+// Returns the row as real values, converted into buf
+static inline real *LoadRow(weight *row, real *buf) {
+  WidenRow(buf, row, layer1_size);
+  return buf;
+}
+
+// Overwrites the row with src, rounded to nearest
+static inline void StoreRow(weight *row, real *src) {
+  NarrowRow(row, src, layer1_size, 0, 0);
+}
+
+// neu += row
+static inline void AccumulateRow(real *neu, weight *row) {
+  real buf[ROW_CHUNK];
+  int a, c, n;
+  for (a = 0; a < layer1_size; a += ROW_CHUNK) {
+    n = layer1_size - a < ROW_CHUNK ? layer1_size - a : ROW_CHUNK;
+    WidenRow(buf, row + a, n);
+    for (c = 0; c < n; c++) neu[a + c] += buf[c];
+  }
+}
+
+// row += grad, stochastically rounded with the random bits of seed
+static inline void UpdateRow(weight *row, real *grad, unsigned int seed) {
+  real buf[ROW_CHUNK];
+  int a, c, n;
+  for (a = 0; a < layer1_size; a += ROW_CHUNK) {
+    n = layer1_size - a < ROW_CHUNK ? layer1_size - a : ROW_CHUNK;
+    WidenRow(buf, row + a, n);
+    for (c = 0; c < n; c++) buf[c] += grad[a + c];
+    NarrowRow(row + a, buf, n, seed + a, 1);
+  }
+}
+#else
+#define STORAGE_NAME "float"
+
+static inline real ToReal(weight w) {
+  return w;
+}
+
+static inline weight ToWeight(real f) {
+  return f;
+}
+
+static inline real *LoadRow(weight *row, real *buf) {
+  return row;
+}
+
+static inline void StoreRow(weight *row, real *src) {
+  memcpy(row, src, layer1_size * sizeof(real));
+}
+
+static inline void AccumulateRow(real *neu, weight *row) {
+  long long c;
+  for (c = 0; c < layer1_size; c++) neu[c] += row[c];
+}
+
+static inline void UpdateRow(weight *row, real *grad, unsigned int seed) {
+  long long c;
+  for (c = 0; c < layer1_size; c++) row[c] += grad[c];
+}
+#endif
+
+// Starts loading the cache lines of a row that is read soon
+static inline void PrefetchRow(weight *row) {
+  long long c;
+  for (c = 0; c < layer1_size * (long long)sizeof(weight); c += 64) __builtin_prefetch((char *)row + c);
+}
+
+// Adagrad (-adagrad): the updates grad = alpha * g of a row are divided by sqrt(acc),
+// acc the sum of the mean of g * g over the updates of the row, so rare rows (e.g. the
+// rare components and pronunciations) take larger steps than frequent ones.
+// Returns the mean of g * g of an update
+static inline real GradSquare(real *grad) {
+  long long c;
+  real sum = 0;
+  for (c = 0; c < layer1_size; c++) sum += grad[c] * grad[c];
+  return sum / (layer1_size * alpha * alpha);
+}
+
+// row += count * grad
+static inline void UpdateRowCount(weight *row, real *grad, int count, real *buf, unsigned int seed) {
+  long long c;
+  if (count == 1) {
+    UpdateRow(row, grad, seed);
+    return;
+  }
+  for (c = 0; c < layer1_size; c++) buf[c] = grad[c] * count;
+  UpdateRow(row, buf, seed);
+}
+
+// count updates of row by grad, each scaled by the accumulator after adding its mean square
+static inline void AdagradRow(weight *row, real *acc, real *grad, real square, int count, real *buf, unsigned int seed) {
+  long long c;
+  int i;
+  real scale = 0;
+  if (square <= 0) return;
+  for (i = 0; i < count; i++) {
+    *acc += square;
+    scale += 1 / sqrt(*acc);
+  }
+#if defined(STORAGE_BF16) || defined(STORAGE_FP16)
+  for (c = 0; c < layer1_size; c++) buf[c] = grad[c] * scale;
+  UpdateRow(row, buf, seed);
+#else
+  for (c = 0; c < layer1_size; c++) row[c] += grad[c] * scale;
+#endif
+}
+
+// row of syn += grad, count times, scaled by the accumulator of the row when acc is not NULL
+static inline void ApplyUpdate(weight *syn, real *acc, long long row, real *grad, real square, int count,
+                               real *buf, unsigned int seed) {
+  if (acc != NULL) AdagradRow(&syn[row * layer1_size], &acc[row], grad, square, count, buf, seed);
+  else UpdateRowCount(&syn[row * layer1_size], grad, count, buf, seed);
+}
+
+//********* Deterministic training ************
+//
+// With -deterministic every random number is drawn from a Philox4x32-10 stream keyed
+// by the seed and indexed by (iteration, byte offset of the sentence), every thread
+// trains on whole lines, and the updates are not written to the shared tables while
+// the threads compute: each thread logs them for DET_BLOCK target words, then the
+// threads meet at a barrier and apply all logs in thread order. Each thread applies
+// the rows it owns (row % num_threads), so the reduction is parallel and its order
+// fixed, and the output is bit-identical across runs with the same -threads.
+
+#define DET_BLOCK 512
+
+struct philox {
+  unsigned int key[2], ctr[4], out[4];
+  int left;  // 32-bit values of out not returned yet
+};
+
+struct det_update {
+  weight *row;
+  long long owner, grad;  // grad: offset of the update in the grad buffer of the log
+  real *acc, square;      // -adagrad: accumulator of the row and mean square of the update
+  int count;              // times the update is applied
+};
+
+struct det_log {
+  struct det_update *update;
+  long long size, max_size;
+  real *grad;
+  long long grad_size, max_grad_size;
+  real *buf;              // a scaled update
+};
+
+unsigned long long seed = 0;  // -deterministic: 0 off, otherwise the seed
+struct philox init_rng;       // initial weights of InitNet
+struct det_log *det_logs;
+long long *det_words, *chunk_start;
+int *det_done, det_all_done = 0, det_waiting = 0;
+long long det_phase = 0;
+pthread_mutex_t det_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t det_cond = PTHREAD_COND_INITIALIZER;
+
+void PhiloxInit(struct philox *p, unsigned long long key, unsigned long long stream, unsigned int sub) {
+  p->key[0] = (unsigned int)key;
+  p->key[1] = (unsigned int)(key >> 32);
+  p->ctr[0] = 0;
+  p->ctr[1] = sub;
+  p->ctr[2] = (unsigned int)stream;
+  p->ctr[3] = (unsigned int)(stream >> 32);
+  p->left = 0;
+}
+
+// 64 random bits
+static inline unsigned long long PhiloxNext(struct philox *p) {
+  unsigned int k0, k1, c0, c1, c2, c3;
+  unsigned long long m0, m1;
+  int r;
+  if (p->left == 0) {
+    k0 = p->key[0];
+    k1 = p->key[1];
+    c0 = p->ctr[0];
+    c1 = p->ctr[1];
+    c2 = p->ctr[2];
+    c3 = p->ctr[3];
+    for (r = 0; r < 10; r++) {
+      m0 = (unsigned long long)0xD2511F53u * c0;
+      m1 = (unsigned long long)0xCD9E8D57u * c2;
+      c0 = (unsigned int)(m1 >> 32) ^ c1 ^ k0;
+      c1 = (unsigned int)m1;
+      c2 = (unsigned int)(m0 >> 32) ^ c3 ^ k1;
+      c3 = (unsigned int)m0;
+      k0 += 0x9E3779B9u;
+      k1 += 0xBB67AE85u;
+    }
+    p->out[0] = c0;
+    p->out[1] = c1;
+    p->out[2] = c2;
+    p->out[3] = c3;
+    p->ctr[0]++;
+    p->left = 4;
+  }
+  p->left -= 2;
+  return ((unsigned long long)p->out[p->left + 1] << 32) | p->out[p->left];
+}
+
+// The LCG of the training threads, or the Philox stream of the sentence with -deterministic
+static inline unsigned long long NextRandom(unsigned long long next_random, struct philox *rng) {
+  if (rng != NULL) return PhiloxNext(rng);
+  return next_random * (unsigned long long)25214903917 + 11;
+}
+
+// Uniform in [0, 1] for the initial weights
+real InitRandom() {
+  if (seed) return (PhiloxNext(&init_rng) >> 40) / (real)16777215;
+  return rand() / (real)RAND_MAX;
+}
+
+// Copies an update vector into the log, returns its offset
+long long DetGrad(struct det_log *log, real *grad) {
+  long long offset = log->grad_size;
+  if (log->grad_size + layer1_size > log->max_grad_size) {
+    log->max_grad_size = (log->grad_size + layer1_size) * 2;
+    log->grad = (real *)realloc(log->grad, log->max_grad_size * sizeof(real));
+    if (log->grad == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  memcpy(&log->grad[offset], grad, layer1_size * sizeof(real));
+  log->grad_size += layer1_size;
+  return offset;
+}
+
+// Logs row += count times the update vector at offset grad (scaled by the accumulator of
+// the row in acc)
+void DetUpdate(struct det_log *log, weight *syn, real *acc, long long row, long long grad, real square, int count) {
+  if (log->size == log->max_size) {
+    log->max_size = log->max_size * 2 + 1024;
+    log->update = (struct det_update *)realloc(log->update, log->max_size * sizeof(struct det_update));
+    if (log->update == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  log->update[log->size].row = &syn[row * layer1_size];
+  log->update[log->size].owner = row % num_threads;
+  log->update[log->size].grad = grad;
+  log->update[log->size].acc = acc != NULL ? &acc[row] : NULL;
+  log->update[log->size].square = square;
+  log->update[log->size].count = count;
+  log->size++;
+}
+
+void DetBarrier() {
+  long long phase;
+  pthread_mutex_lock(&det_mutex);
+  phase = det_phase;
+  if (++det_waiting == num_threads) {
+    det_waiting = 0;
+    det_phase++;
+    pthread_cond_broadcast(&det_cond);
+  } else while (phase == det_phase) pthread_cond_wait(&det_cond, &det_mutex);
+  pthread_mutex_unlock(&det_mutex);
+}
+
+// Ends a block: applies the logs of all threads, then sets alpha from the words
+// trained by all threads. Returns whether all threads have finished training.
+int DetSync(long long id, long long words, int done, long long block) {
+  long long a, t;
+  struct det_update *u;
+  det_words[id] += words;
+  det_done[id] = done;
+  if (det_logs[id].buf == NULL) det_logs[id].buf = (real *)malloc(layer1_size * sizeof(real));
+  DetBarrier();
+  for (t = 0; t < num_threads; t++) for (a = 0; a < det_logs[t].size; a++) {
+    u = &det_logs[t].update[a];
+    if (u->owner != id) continue;
+    if (u->acc != NULL)
+      AdagradRow(u->row, u->acc, &det_logs[t].grad[u->grad], u->square, u->count, det_logs[id].buf,
+                 (unsigned int)(block * num_threads + t) * 0x9E3779B9u + (unsigned int)a);
+    else UpdateRowCount(u->row, &det_logs[t].grad[u->grad], u->count, det_logs[id].buf,
+                        (unsigned int)(block * num_threads + t) * 0x9E3779B9u + (unsigned int)a);
+  }
+  if (id == 0) {
+    for (t = 0, a = 0; t < num_threads; t++) a += det_words[t];
+    alpha = starting_alpha * (1 - a / (real)(iter * train_words + 1));
+    if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+    if ((debug_mode > 1) && a - word_count_actual > 10000) {
+      clock_t now = clock();
+      printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
+         a / (real)(iter * train_words + 1) * 100,
+         a / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
+      fflush(stdout);
+      word_count_actual = a;
+    }
+    for (t = 0; t < num_threads; t++) if (!det_done[t]) break;
+    det_all_done = t == num_threads;
+  }
+  DetBarrier();
+  det_logs[id].size = 0;
+  det_logs[id].grad_size = 0;
+  return det_all_done;
+}
+
+// Splits the training file at line starts, thread i trains on [chunk_start[i], chunk_start[i + 1])
+void InitChunks() {
+  long long a;
+  int ch;
+  FILE *fin = CorpusOpen(train_file);
+  if (fin == NULL) {
+    fprintf(stderr, "no such file or directory: %s", train_file);
+    exit(1);
+  }
+  chunk_start = (long long *)malloc((num_threads + 1) * sizeof(long long));
+  chunk_start[0] = 0;
+  for (a = 1; a < num_threads; a++) {
+    fseek(fin, file_size / (long long)num_threads * a, SEEK_SET);
+    fseek(fin, -1, SEEK_CUR);  // a chunk starting right after a newline is kept
+    while ((ch = fgetc(fin)) != EOF && ch != '\n');
+    chunk_start[a] = ftell(fin);
+    if (chunk_start[a] < chunk_start[a - 1]) chunk_start[a] = chunk_start[a - 1];
+  }
+  chunk_start[num_threads] = file_size;
+  fclose(fin);
+}
+
 int negative = 0;
 const int table_size = 1e8;      //the unigram table for negative sampling
 int *table;
@@ -125,6 +633,36 @@ void InitUnigramTable() {
   }
 }
 
+// Subsampling: a word is kept when the low 16 bits of a random number are at most
+// keep[word], the keep probability (sqrt(cn / (sample * total_words)) + 1) *
+// (sample * total_words) / cn in 16-bit fixed point
+unsigned short *keep;
+
+void InitSubsampling() {
+  long long a;
+  real ran;
+  keep = (unsigned short *)malloc(vocab_size * sizeof(unsigned short));
+  if (keep == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_size; a++) {
+    ran = (sqrt(vocab[a].cn / (sample * total_words)) + 1) * (sample * total_words) / vocab[a].cn;
+    keep[a] = ran * 65536 >= 65535 ? 65535 : (unsigned short)(ran * 65536);
+  }
+}
+
+// Subsamples the n words of sen in place and returns the number of words kept; draws
+// one random number per word, in order
+static inline long long SubsampleWords(long long *sen, long long n, unsigned long long *next_random, struct philox *rng) {
+  long long a, kept = 0;
+  unsigned long long r = *next_random;
+  for (a = 0; a < n; a++) {
+    r = NextRandom(r, rng);
+    sen[kept] = sen[a];
+    kept += (r & 0xFFFF) <= keep[sen[a]];
+  }
+  *next_random = r;
+  return kept;
+}
+
  //********* Word ************
 
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
@@ -150,21 +688,89 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
+// 64-bit multiply, folding the high half of the product into the low half
+static inline unsigned long long HashMix(unsigned long long a, unsigned long long b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (unsigned long long)r ^ (unsigned long long)(r >> 64);
+#else
+  unsigned long long ha = a >> 32, hb = b >> 32, la = (unsigned int)a, lb = (unsigned int)b;
+  unsigned long long rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl, lo;
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static inline unsigned long long HashRead8(const char *p) {
+  unsigned long long v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline unsigned long long HashRead4(const char *p) {
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// Returns the 64-bit hash of a word of len bytes (wyhash)
+unsigned long long GetWordHash(const char *word, long long len) {
+  const unsigned long long s0 = 0xa0761d6478bd642fULL, s1 = 0xe7037ed1a0b428dbULL, s2 = 0x8ebc6af09c88c6e3ULL;
+  unsigned long long seed = s0, a, b;
+  const unsigned char *p = (const unsigned char *)word;
+  long long i = len;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (HashRead4(word) << 32) | HashRead4(word + ((len >> 3) << 2));
+      b = (HashRead4(word + len - 4) << 32) | HashRead4(word + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((unsigned long long)p[0] << 16) | ((unsigned long long)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else a = b = 0;
+  } else {
+    for (; i > 16; i -= 16, word += 16) seed = HashMix(HashRead8(word) ^ s1, HashRead8(word + 8) ^ seed);
+    a = HashRead8(word + i - 16);
+    b = HashRead8(word + i - 8);
+  }
+  return HashMix(s1 ^ len, HashMix(a ^ s1, b ^ seed ^ s2));
+}
+
+// Empties the hash and sizes it for words entries
+void ResetVocabHash(long long words) {
+  long long size = VOCAB_HASH_MIN_SIZE;
+  while (size < words * 2) size *= 2;
+  if (size != vocab_hash_size) {
+    free(vocab_hash);
+    vocab_hash = (struct vocab_hash_entry *)malloc(size * sizeof(struct vocab_hash_entry));
+    if (vocab_hash == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    vocab_hash_size = size;
+  }
+  memset(vocab_hash, 0xFF, vocab_hash_size * sizeof(struct vocab_hash_entry));
+}
+
+void InsertVocabHash(char *word, int id) {
+  unsigned long long hash = GetWordHash(word, strlen(word)), pos = hash & (vocab_hash_size - 1);
+  while (vocab_hash[pos].id != -1) pos = (pos + 1) & (vocab_hash_size - 1);
+  vocab_hash[pos].fingerprint = hash >> 32;
+  vocab_hash[pos].id = id;
+}
+
+// Re-inserts the words of the vocabulary from first on
+void RebuildVocabHash(long long first) {
+  long long a;
+  ResetVocabHash(vocab_size);
+  for (a = first; a < vocab_size; a++) if (vocab[a].word != NULL) InsertVocabHash(vocab[a].word, a);
 }
 
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
 int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
+  unsigned long long hash = GetWordHash(word, strlen(word)), pos = hash & (vocab_hash_size - 1);
+  unsigned int fingerprint = hash >> 32;
+  while (vocab_hash[pos].id != -1) {
+    if (vocab_hash[pos].fingerprint == fingerprint && !strcmp(word, vocab[vocab_hash[pos].id].word))
+      return vocab_hash[pos].id;
+    pos = (pos + 1) & (vocab_hash_size - 1);
   }
   return -1;
 }
@@ -177,13 +783,118 @@ int ReadWordIndex(FILE *fin) {
   return SearchVocab(word);
 }
 
+// Returns 1 if the Unicode is a Chinese character
+int IsChinese(int unicode) {
+  int i;
+  for (i = 0; i < CHINESE_RANGES; i++)
+    if (unicode >= chinese_range[i][0] && unicode <= chinese_range[i][1]) return 1;
+  return 0;
+}
+
+// Decodes a multibyte string to Unicode (joining UTF-16 surrogates of a 16-bit wchar_t);
+// returns the number of characters, or -1 if the string is not valid in the current locale
+int GetUnicode(char *str, int *unicode) {
+  wchar_t wstr[MAX_STRING];
+  size_t len = mbstowcs(wstr, str, MAX_STRING - 1), i;
+  int n = 0;
+  if (len == (size_t)-1) return -1;
+  for (i = 0; i < len; i++) {
+    if (wstr[i] >= 0xD800 && wstr[i] <= 0xDBFF && i + 1 < len && wstr[i + 1] >= 0xDC00 && wstr[i + 1] <= 0xDFFF) {
+      unicode[n++] = 0x10000 + (((int)wstr[i] - 0xD800) << 10) + ((int)wstr[i + 1] - 0xDC00);
+      i++;
+    } else unicode[n++] = wstr[i];
+  }
+  return n;
+}
+
+// Encodes a Unicode as UTF-8 into str (at least 5 bytes)
+void PutUnicode(int unicode, char *str) {
+  if (unicode < 0x80) *str++ = unicode;
+  else if (unicode < 0x800) {
+    *str++ = 0xC0 | (unicode >> 6);
+    *str++ = 0x80 | (unicode & 0x3F);
+  } else if (unicode < 0x10000) {
+    *str++ = 0xE0 | (unicode >> 12);
+    *str++ = 0x80 | ((unicode >> 6) & 0x3F);
+    *str++ = 0x80 | (unicode & 0x3F);
+  } else {
+    *str++ = 0xF0 | (unicode >> 18);
+    *str++ = 0x80 | ((unicode >> 12) & 0x3F);
+    *str++ = 0x80 | ((unicode >> 6) & 0x3F);
+    *str++ = 0x80 | (unicode & 0x3F);
+  }
+  *str = 0;
+}
+
+// Bump allocators of the vocabulary: the word strings and the character and
+// pronunciation arrays of all words are carved from large blocks, and released (or
+// compacted, when words are discarded) all at once
+#define ARENA_BLOCK (1 << 20)
+
+struct arena_block {
+  struct arena_block *next;
+  long long size, used;
+  long long data[];  // aligned for the int arrays
+};
+
+struct arena {
+  struct arena_block *head;
+};
+
+struct arena vocab_strings, vocab_arrays;
+
+void *ArenaAlloc(struct arena *ar, long long size) {
+  struct arena_block *b = ar->head;
+  if (b == NULL || b->used + size > b->size) {
+    long long block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+    b = (struct arena_block *)malloc(sizeof(struct arena_block) + block);
+    if (b == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    b->next = ar->head;
+    b->size = block;
+    b->used = 0;
+    ar->head = b;
+  }
+  b->used += size;
+  return (char *)b->data + b->used - size;
+}
+
+void ArenaFree(struct arena *ar) {
+  struct arena_block *b;
+  while ((b = ar->head) != NULL) {
+    ar->head = b->next;
+    free(b);
+  }
+}
+
+char *ArenaString(struct arena *ar, const char *str) {
+  long long len = strlen(str);
+  char *s;
+  if (len > MAX_STRING - 1) len = MAX_STRING - 1;
+  s = (char *)ArenaAlloc(ar, len + 1);
+  memcpy(s, str, len);
+  s[len] = 0;
+  return s;
+}
+
+// An array of n ints, copied from src unless it is NULL
+int *ArenaInts(struct arena *ar, const int *src, long long n) {
+  int *a = (int *)ArenaAlloc(ar, n * sizeof(int));
+  if (src != NULL) memcpy(a, src, n * sizeof(int));
+  else memset(a, 0, n * sizeof(int));
+  return a;
+}
+
+// Copies the strings and arrays of a word into new arenas
+void MoveWord(struct vocab_word *w, struct arena *strings, struct arena *arrays) {
+  w->word = ArenaString(strings, w->word);
+  if (w->character != NULL) w->character = ArenaInts(arrays, w->character, w->character_size);
+  if (w->pronunciation != NULL) w->pronunciation = ArenaInts(arrays, w->pronunciation, w->character_size);
+}
+
 // Adds a word to the vocabulary
 int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1, len, i;
-  wchar_t wstr[MAX_STRING];
-  if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
+  int len, i, unicode[MAX_STRING];
+  vocab[vocab_size].word = ArenaString(&vocab_strings, word);
   vocab[vocab_size].cn = 0;
   vocab[vocab_size].pronunciation = NULL;
   vocab_size++;
@@ -193,39 +904,113 @@ int AddWordToVocab(char *word) {
     vocab_max_size += 1000;
     vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
   }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
+  if (vocab_size * 2 > vocab_hash_size) RebuildVocabHash(0);
+  else InsertVocabHash(word, vocab_size - 1);
 
-  len = mbstowcs(wstr, word, MAX_STRING);
+  len = GetUnicode(word, unicode);
   for (i = 0; i < len; i++)
-    if (wstr[i] < MIN_CHINESE || wstr[i] > MAX_CHINESE) {
-      vocab[vocab_size - 1].character = 0;
-      vocab[vocab_size - 1].character_size = 0;
-      return vocab_size - 1;
-    }
-  vocab[vocab_size - 1].character = calloc(len, sizeof(int));
+    if (!IsChinese(unicode[i])) break;
+  if (len <= 0 || i < len) {
+    vocab[vocab_size - 1].character = 0;
+    vocab[vocab_size - 1].character_size = 0;
+    return vocab_size - 1;
+  }
+  vocab[vocab_size - 1].character = ArenaInts(&vocab_arrays, unicode, len);
   vocab[vocab_size - 1].character_size = len;
-  for (i = 0; i < len; i++)
-    vocab[vocab_size - 1].character[i] = wstr[i] - MIN_CHINESE;
 
   return vocab_size - 1;
 }
 
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+// Count and id of a word, the compact array sorted by SortVocab
+struct vocab_order {
+  long long cn;
+  int id;
+};
+
+// Sorting by word counts: a stable LSD radix sort of the bytes of max_cn - cn, so that
+// the counts are decreasing and equal counts keep the order of the vocabulary. Every
+// pass computes per thread histograms of a slice, then every thread scatters its
+// slice to the offsets of its histograms.
+#define RADIX_MIN_PARALLEL 65536
+
+struct radix_job {
+  struct vocab_order *src, *dst;
+  long long begin, end, max_cn, count[256];
+  int shift;
+};
+
+void *RadixHistogram(void *arg) {
+  struct radix_job *job = (struct radix_job *)arg;
+  long long a;
+  memset(job->count, 0, sizeof(job->count));
+  for (a = job->begin; a < job->end; a++) job->count[((job->max_cn - job->src[a].cn) >> job->shift) & 0xFF]++;
+  return NULL;
+}
+
+void *RadixScatter(void *arg) {
+  struct radix_job *job = (struct radix_job *)arg;
+  long long a;
+  for (a = job->begin; a < job->end; a++)
+    job->dst[job->count[((job->max_cn - job->src[a].cn) >> job->shift) & 0xFF]++] = job->src[a];
+  return NULL;
+}
+
+// Runs fn on every job, in threads when there are several
+void RadixRun(void *(*fn)(void *), struct radix_job *job, int threads) {
+  pthread_t *pt;
+  int t;
+  if (threads == 1) {
+    fn(&job[0]);
+    return;
+  }
+  pt = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  for (t = 0; t < threads; t++) pthread_create(&pt[t], NULL, fn, &job[t]);
+  for (t = 0; t < threads; t++) pthread_join(pt[t], NULL);
+  free(pt);
+}
+
+void SortVocabOrder(struct vocab_order *order, long long n) {
+  struct vocab_order *tmp, *src = order, *dst;
+  struct radix_job *job;
+  long long a, b, sum, max_cn = 0, min_cn = 0x7FFFFFFFFFFFFFFFLL;
+  int t, shift, threads = n >= RADIX_MIN_PARALLEL ? num_threads : 1;
+  if (n < 2) return;
+  for (a = 0; a < n; a++) {
+    if (order[a].cn > max_cn) max_cn = order[a].cn;
+    if (order[a].cn < min_cn) min_cn = order[a].cn;
+  }
+  tmp = (struct vocab_order *)malloc(n * sizeof(struct vocab_order));
+  job = (struct radix_job *)malloc(threads * sizeof(struct radix_job));
+  if (tmp == NULL || job == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  dst = tmp;
+  // the bytes above the largest key max_cn - min_cn are all 0
+  for (shift = 0; shift < 64 && ((unsigned long long)(max_cn - min_cn) >> shift) > 0; shift += 8) {
+    for (t = 0; t < threads; t++) {
+      job[t].src = src;
+      job[t].dst = dst;
+      job[t].begin = n * t / threads;
+      job[t].end = n * (t + 1) / threads;
+      job[t].max_cn = max_cn;
+      job[t].shift = shift;
+    }
+    RadixRun(RadixHistogram, job, threads);
+    for (b = 0, sum = 0; b < 256; b++) for (t = 0; t < threads; t++) {
+      a = job[t].count[b];
+      job[t].count[b] = sum;
+      sum += a;
+    }
+    RadixRun(RadixScatter, job, threads);
+    dst = src;
+    src = job[0].dst;
+  }
+  if (src != order) memcpy(order, src, n * sizeof(struct vocab_order));
+  free(tmp);
+  free(job);
 }
 
 void DestroyVocab(){
   int a;
-  for (a = 0; a < vocab_size; a++){
-    if (vocab[a].word != NULL)
-      free(vocab[a].word);
-    if (vocab[a].character != NULL)
-      free(vocab[a].character);
-  }
-  for (a = 0; a < CHAR_SIZE; a++){
+  for (a = 0; a < char_size; a++){
     if (char2comp[a].comp != NULL)
       free(char2comp[a].comp);
   }
@@ -238,74 +1023,214 @@ void DestroyVocab(){
       free(pron_array[a].pron_str);
     }
   }
-  free(vocab[vocab_size].word);
+  ArenaFree(&vocab_strings);
+  ArenaFree(&vocab_arrays);
   free(vocab);
+  free(char2comp);
+  free(char_unicode);
+  free(char_hash);
   free(comp_array);
   free(pron_array);
 }
 
 // Sorts the vocabulary by frequency using word counts
 void SortVocab() {
-  int a, size;
-  unsigned int hash;
+  long long a, n = 0, size = 1;
+  struct vocab_order *order = (struct vocab_order *)malloc(vocab_size * sizeof(struct vocab_order));
+  struct vocab_word *sorted = (struct vocab_word *)calloc(vocab_size + 1, sizeof(struct vocab_word));
+  struct arena strings = {NULL}, arrays = {NULL};
+  if (order == NULL || sorted == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  // Words occuring less than min_count times will be discarded from the vocab, before
+  // sorting; the others are copied in the order of frequency into new arenas
+  for (a = 1; a < vocab_size; a++) if (vocab[a].cn >= min_count) {
+    order[n].cn = vocab[a].cn;
+    order[n++].id = a;
+  }
   // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  size = vocab_size;
+  SortVocabOrder(order, n);
+  sorted[0] = vocab[0];
+  MoveWord(&sorted[0], &strings, &arrays);
   train_words = 0;
-  for (a = 1; a < size; a++) { // Skip </s>
-    // Words occuring less than min_count times will be discarded from the vocab
-    if (vocab[a].cn < min_count) {
-      vocab_size--;
-      if (vocab[a].character != NULL) free(vocab[a].character);
-      free(vocab[a].word);
-      vocab[a].word = NULL;
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
-    }
+  for (a = 0; a < n; a++) {
+    sorted[size] = vocab[order[a].id];
+    MoveWord(&sorted[size], &strings, &arrays);
+    train_words += sorted[size++].cn;
   }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-
+  ArenaFree(&vocab_strings);
+  ArenaFree(&vocab_arrays);
+  vocab_strings = strings;
+  vocab_arrays = arrays;
+  free(vocab);
+  free(order);
+  vocab_size = size;
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(sorted, vocab_max_size * sizeof(struct vocab_word));
+  // Hash will be re-computed, as after the sorting it is not actual; </s> is not
+  // searchable anymore, the training reads the lines as one stream of words
+  RebuildVocabHash(1);
 }
+
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab() {
   int a, b = 0;
-  unsigned int hash;
+  struct arena strings = {NULL}, arrays = {NULL};
   for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
     memcpy(vocab + b, vocab + a, sizeof(struct vocab_word));
+    MoveWord(&vocab[b], &strings, &arrays);
     b++;
-  } else {
-    if (vocab[a].character != NULL) free(vocab[a].character);
-    free(vocab[a].word);
   }
+  ArenaFree(&vocab_strings);
+  ArenaFree(&vocab_arrays);
+  vocab_strings = strings;
+  vocab_arrays = arrays;
   vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
-  }
+  // Hash will be re-computed, as it is not actual
+  RebuildVocabHash(0);
   fflush(stdout);
   min_reduce++;
 }
 
+//********* Model file ************
+// A model file keeps everything needed to continue training:
+//   header : MODEL_MAGIC, layer1_size, #words, #characters, #components, #pronunciations
+//   vocab  : (count, length, string) of every word
+//   chars  : Unicode of every character row
+//   comps, prons : (length, string) of every component / pronunciation row
+//   tables : synword, syn1neg, synchar, syncomp, synpron as float rows in the order above
+// Rows are matched by their strings when loading, so the id spaces may differ between runs.
+
+#define MODEL_MAGIC 0x45574350  // "PCWE"
+
+void ReadModelString(char *str, FILE *fin) {
+  int len = 0;
+  if (fread(&len, sizeof(int), 1, fin) != 1 || len < 0 || len >= MAX_STRING) {
+    fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+    exit(1);
+  }
+  if (fread(str, 1, len, fin) != (size_t)len) {
+    fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+    exit(1);
+  }
+  str[len] = 0;
+}
+
+void WriteModelString(char *str, FILE *fo) {
+  int len = strlen(str);
+  fwrite(&len, sizeof(int), 1, fo);
+  fwrite(str, 1, len, fo);
+}
+
+// Reads the header of a model file; the counts of its five tables are stored in size[]
+FILE *OpenModelFile(long long *size) {
+  int magic = 0;
+  long long dim = 0;
+  FILE *fin = fopen(load_model_file, "rb");
+  if (fin == NULL) {
+    fprintf(stderr, "ERROR: model file %s not found!\n", load_model_file);
+    exit(1);
+  }
+  if (fread(&magic, sizeof(int), 1, fin) != 1 || magic != MODEL_MAGIC) {
+    fprintf(stderr, "ERROR: %s is not a pcwe model file\n", load_model_file);
+    exit(1);
+  }
+  if (fread(&dim, sizeof(long long), 1, fin) != 1 || fread(size, sizeof(long long), 4, fin) != 4) {
+    fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+    exit(1);
+  }
+  if (dim != layer1_size) {
+    fprintf(stderr, "ERROR: model file has size %lld, but -size is %lld\n", dim, layer1_size);
+    exit(1);
+  }
+  return fin;
+}
+
+// Adds the words of a saved model and their counts to the vocabulary,
+// so the counts of the new training data are accumulated on top of them
+void LearnVocabFromModelFile() {
+  char word[MAX_STRING];
+  long long a, i, cn, size[4];
+  FILE *fin = OpenModelFile(size);
+  for (a = 0; a < size[0]; a++) {
+    if (fread(&cn, sizeof(long long), 1, fin) != 1) {
+      fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+      exit(1);
+    }
+    ReadModelString(word, fin);
+    i = SearchVocab(word);
+    if (i == -1) i = AddWordToVocab(word);
+    vocab[i].cn += cn;
+    if (vocab_size > VOCAB_MAX_WORDS) ReduceVocab();
+  }
+  fclose(fin);
+  if (debug_mode > 0) printf("Words in model file: %lld\n", size[0]);
+}
+
+// Count-min sketch of the words of the training file (-count-sketch). Words that are
+// not yet in the vocabulary are only added when their estimate reaches min_count;
+// the estimate is never below the true count, so every word with at least min_count
+// occurences is counted exactly, while rare words (most of the distinct words of a
+// large corpus) never enter the vocabulary and its hash.
+#define SKETCH_DEPTH 4
+
+long long count_sketch_mb = 0; // memory of the sketch in MB, 0 disables it
+unsigned int *sketch;
+long long sketch_width = 0;
+
+void SketchPositions(char *word, long long *pos) {
+  unsigned long long hash = GetWordHash(word, strlen(word)), h1 = hash & 0xFFFFFFFF, h2 = (hash >> 32) | 1;
+  long long i;
+  for (i = 0; i < SKETCH_DEPTH; i++) pos[i] = i * sketch_width + ((h1 + i * h2) & (sketch_width - 1));
+}
+
+// Conservative update: only the smallest counters are incremented
+void SketchAdd(char *word) {
+  long long pos[SKETCH_DEPTH], i;
+  unsigned int min = 0xFFFFFFFF;
+  SketchPositions(word, pos);
+  for (i = 0; i < SKETCH_DEPTH; i++) if (sketch[pos[i]] < min) min = sketch[pos[i]];
+  if (min == 0xFFFFFFFF) return;
+  for (i = 0; i < SKETCH_DEPTH; i++) if (sketch[pos[i]] == min) sketch[pos[i]]++;
+}
+
+unsigned int SketchCount(char *word) {
+  long long pos[SKETCH_DEPTH], i;
+  unsigned int min = 0xFFFFFFFF;
+  SketchPositions(word, pos);
+  for (i = 0; i < SKETCH_DEPTH; i++) if (sketch[pos[i]] < min) min = sketch[pos[i]];
+  return min;
+}
+
+// Counts the words of the training file into the sketch and rewinds it
+void LearnSketchFromTrainFile(FILE *fin) {
+  char word[MAX_STRING];
+  sketch_width = 1;
+  while (sketch_width * 2 * SKETCH_DEPTH * sizeof(unsigned int) <= count_sketch_mb * 1048576) sketch_width *= 2;
+  sketch = (unsigned int *)calloc(sketch_width * SKETCH_DEPTH, sizeof(unsigned int));
+  if (sketch == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  while (1) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    if (strcmp(word, " ") == 0) continue;
+    SketchAdd(word);
+  }
+  rewind(fin);
+  if (debug_mode > 0) printf("Count sketch: %d x %lld counters\n", SKETCH_DEPTH, sketch_width);
+}
+
 void LearnVocabFromTrainFile() {
   char word[MAX_STRING];
   FILE *fin;
-  long long a, i;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1; //initialize vocab_hash array
-  fin = fopen(train_file, "rb");
+  long long a, i, skipped = 0;
+  ResetVocabHash(0); //initialize vocab_hash array
+  fin = CorpusOpen(train_file);
   if (fin == NULL) {
     fprintf(stderr,"ERROR: training data file not found!\n");
     exit(1);
   }
   vocab_size = 0;
   AddWordToVocab((char *)"</s>");
+  if (load_model_file[0] != 0) LearnVocabFromModelFile();
+  if (count_sketch_mb > 0) LearnSketchFromTrainFile(fin);
   while (1) {
     ReadWord(word, fin);
     if (feof(fin)) break;
@@ -316,19 +1241,85 @@ void LearnVocabFromTrainFile() {
       fflush(stdout);
     }
     i = SearchVocab(word);
-    if (i == -1) {
+    if (i == -1 && sketch != NULL && SketchCount(word) < min_count) skipped++;
+    else if (i == -1) {
       a = AddWordToVocab(word);
       vocab[a].cn = 1;
     } else vocab[i].cn++;
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+    if (vocab_size > VOCAB_MAX_WORDS) ReduceVocab();
   }
   SortVocab();
+  total_words = train_words;
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
+    if (sketch != NULL) printf("Rare words skipped by the count sketch: %lld\n", skipped);
   }
   file_size = ftell(fin);
   fclose(fin);
+  if (debug_mode > 0 && CorpusFrames(train_file) >= 0)
+    printf("Compressed train file: %lld frames, %lld bytes of text\n", CorpusFrames(train_file), file_size);
+  free(sketch);
+  sketch = NULL;
+}
+
+//********* Character ************
+
+unsigned int GetCharHash(int unicode) {
+  return ((unsigned int)unicode * 2654435761u) & (char_hash_size - 1);
+}
+
+// Returns the id of a character, -1 if it is not used by the vocabulary
+int GetCharIndex(int unicode) {
+  unsigned int hash;
+  if (char_hash_size == 0) return -1;
+  hash = GetCharHash(unicode);
+  while (char_hash[hash].id != -1) {
+    if (char_hash[hash].unicode == unicode) return char_hash[hash].id;
+    hash = (hash + 1) & (char_hash_size - 1);
+  }
+  return -1;
+}
+
+// Adds a character to the character table, growing the map as needed, and returns its id
+int AddCharToTable(int unicode) {
+  long long a, old_size = char_hash_size;
+  unsigned int hash;
+  struct char_hash_entry *old_hash = char_hash;
+  if (char_size + 2 >= char_max_size) {
+    char_max_size += 1000;
+    char_unicode = (int *)realloc(char_unicode, char_max_size * sizeof(int));
+  }
+  if ((char_size + 1) * 2 > char_hash_size) {
+    char_hash_size = char_hash_size ? char_hash_size * 2 : 4096;
+    char_hash = (struct char_hash_entry *)malloc(char_hash_size * sizeof(struct char_hash_entry));
+    for (a = 0; a < char_hash_size; a++) char_hash[a].id = -1;
+    for (a = 0; a < old_size; a++) if (old_hash[a].id != -1) {
+      hash = GetCharHash(old_hash[a].unicode);
+      while (char_hash[hash].id != -1) hash = (hash + 1) & (char_hash_size - 1);
+      char_hash[hash] = old_hash[a];
+    }
+    free(old_hash);
+  }
+  hash = GetCharHash(unicode);
+  while (char_hash[hash].id != -1) hash = (hash + 1) & (char_hash_size - 1);
+  char_hash[hash].unicode = unicode;
+  char_hash[hash].id = char_size;
+  char_unicode[char_size] = unicode;
+  return char_size++;
+}
+
+// Assigns compact ids to the characters of the vocabulary, in order of first use
+void BuildCharTable() {
+  long long a, b;
+  int c;
+  for (a = 0; a < vocab_size; a++) for (b = 0; b < vocab[a].character_size; b++) {
+    c = GetCharIndex(vocab[a].character[b]);
+    if (c == -1) c = AddCharToTable(vocab[a].character[b]);
+    vocab[a].character[b] = c;
+  }
+  char2comp = (struct char_component *)calloc(char_size + 1, sizeof(struct char_component));
+  if (debug_mode > 0) printf("char_size = %lld\n", char_size);
 }
 
 //********* Component ************
@@ -383,19 +1374,21 @@ void LearnCharComponentsFromFile() {
     int num = (strlen(line) - 2) / 3 - 1;
     char *save_ptr;
     char *pch = strtok_r(line, " \n",&save_ptr);
-    wchar_t wstr[MAX_STRING];
-    unsigned int wlen = mbstowcs(wstr, pch, MAX_STRING);
-    int id = wstr[0] - MIN_CHINESE;
+    int unicode[MAX_STRING];
+    if (pch == NULL || GetUnicode(pch, unicode) <= 0) continue;
+    int id = GetCharIndex(unicode[0]);
+    if (id == -1) continue;   // the character is not used by the vocabulary
     char2comp[id].comp_size = num;
     char2comp[id].comp = calloc(char2comp[id].comp_size, sizeof(int));           //
     int tmp_cnt = 0;
     pch = strtok_r(NULL," \n",&save_ptr);
     while(pch != NULL){
       int pch_index = GetCompIndex(pch);
-      if(pch_index != -1)
+      if(pch_index != -1 && tmp_cnt < num)
         char2comp[id].comp[tmp_cnt++] = pch_index;
       pch = strtok_r(NULL," \n",&save_ptr);
     }
+    char2comp[id].comp_size = tmp_cnt;
   }
   if(line)
     free(line);
@@ -403,6 +1396,30 @@ void LearnCharComponentsFromFile() {
   printf("end learn char2component.\n");
 }
 
+// Keeps only the components of the characters in use, renumbered in order of first use
+void ReduceComponent() {
+  long long a, b, c, size = 0;
+  int *comp_index = (int *)malloc(comp_size * sizeof(int));
+  struct components *used = (struct components *)calloc(comp_size + 1, sizeof(struct components));
+  for (a = 0; a < comp_size; a++) comp_index[a] = -1;
+  for (a = 0; a < char_size; a++) for (b = 0; b < char2comp[a].comp_size; b++) {
+    c = char2comp[a].comp[b];
+    if (comp_index[c] == -1) {
+      used[size].comp_str = comp_array[c].comp_str;
+      comp_array[c].comp_str = NULL;
+      comp_index[c] = size++;
+    }
+    char2comp[a].comp[b] = comp_index[c];
+  }
+  for (a = 0; a < comp_size; a++) if (comp_array[a].comp_str != NULL) free(comp_array[a].comp_str);
+  free(comp_array);
+  free(comp_index);
+  comp_array = used;
+  comp_size = size;
+  comp_max_size = size + 1;
+  printf("comp_size in use = %lld\n", comp_size);
+}
+
 //********* Pronunciation ************
 void ReadPronunciation() {
   FILE *fin = fopen(pron_file, "rb");
@@ -432,136 +1449,1474 @@ void ReadPronunciation() {
   // printf("\n");
 }
 
-int GetPronIndex(char* pron) {
-  for (int i = 0; i < pron_size; i++) {
-    if(strcmp(pron, pron_array[i].pron_str) == 0)
-      return i;
+int GetPronIndex(char* pron) {
+  for (int i = 0; i < pron_size; i++) {
+    if(strcmp(pron, pron_array[i].pron_str) == 0)
+      return i;
+  }
+  return -1;
+}
+
+void LearnWord2PronFromFile() {
+  FILE *fin = fopen(word2pron_file, "rb");
+  if (fin == NULL) {
+    fprintf(stderr, "ERROR: word2pron file not found!\n");
+    exit(1);
+  }
+
+  char *line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, fin) != -1) {
+    char *save_ptr = NULL, *word = NULL, *pron = NULL;
+    word = strtok_r(line, " \t\n", &save_ptr);
+    long long word_index = -1;
+    if ((word_index = SearchVocab(word)) != -1) {
+      if (vocab[word_index].pronunciation == NULL)
+        vocab[word_index].pronunciation = ArenaInts(&vocab_arrays, NULL, vocab[word_index].character_size);
+      int i = 0;
+      while ((pron = strtok_r(NULL, " _\t\n", &save_ptr)) != NULL) {
+        int pron_idx = GetPronIndex(pron);
+        if (pron_idx != -1) {
+          if (i < vocab[word_index].character_size) vocab[word_index].pronunciation[i] = pron_idx;
+          i++;
+        } else {
+          printf("not exist pronunciation %s\n", pron);
+        }
+      }
+
+      if (i != vocab[word_index].character_size) {
+        printf("i = %d, ch_size = %d\n", i, vocab[word_index].character_size);
+        printf("word = %s\n", vocab[word_index].word);
+      }
+    }
+  }
+  if (line) free(line);
+  fclose(fin);
+  printf("pron_size = %d\n", pron_size);
+}
+
+
+// Keeps only the pronunciations of the vocabulary, renumbered in order of first use
+void ReducePronunciation() {
+  long long a, b, c;
+  int size = 0;
+  int *pron_index = (int *)malloc(pron_size * sizeof(int));
+  struct pronunciation *used = (struct pronunciation *)calloc(pron_size + 1, sizeof(struct pronunciation));
+  for (a = 0; a < pron_size; a++) pron_index[a] = -1;
+  for (a = 0; a < vocab_size; a++) if (vocab[a].pronunciation != NULL)
+    for (b = 0; b < vocab[a].character_size; b++) {
+      c = vocab[a].pronunciation[b];
+      if (pron_index[c] == -1) {
+        used[size].pron_str = pron_array[c].pron_str;
+        pron_array[c].pron_str = NULL;
+        pron_index[c] = size++;
+      }
+      vocab[a].pronunciation[b] = pron_index[c];
+    }
+  for (a = 0; a < pron_size; a++) if (pron_array[a].pron_str != NULL) free(pron_array[a].pron_str);
+  free(pron_array);
+  free(pron_index);
+  pron_array = used;
+  pron_size = size;
+  pron_max_size = size + 1;
+  printf("pron_size in use = %d\n", pron_size);
+}
+
+int CheckPron() {
+  int no_pron = 0;
+  for (int i = 0; i < vocab_size; ++i)
+  {
+    if (vocab[i].pronunciation == NULL && strcmp("</s>", vocab[i].word) != 0) {
+      printf("no pronunciation: %s\n", vocab[i].word);
+      no_pron = 1;
+    }
+  }
+  return no_pron;
+}
+
+//********* Out-of-core tables ************
+
+// With -table-dir, synword and syn1neg are mapped from files created in that directory
+// instead of being allocated, so that the vocabulary is bounded by the disk instead of
+// the memory. SortVocab puts the most frequent words first, so the first rows of the
+// tables are the ones used most. With -table-memory, a pager thread keeps the resident
+// part of every table within its half of the budget: the first half of its budget
+// (the hot rows) is never paged out, and the rest is paged out from the end of the
+// table, the rows of the rarest words first.
+#define PAGE_CHUNK (1LL << 20)   // bytes of a table checked and paged out at once, at most
+#define PAGER_INTERVAL 100000    // microseconds between two checks of the pager
+#define INIT_INTERVAL (8LL << 20)   // bytes of synword initialized between two checks
+
+char table_dir[MAX_STRING];
+long long table_memory = 0;      // -table-memory: MB of synword and syn1neg kept resident, 0 = no limit
+
+struct mapped_table {
+  weight *syn;
+  long long bytes;
+  long long *resident;           // resident bytes of every page_chunk, found by BudgetTables
+  int fd;
+} mapped[2];                     // synword, syn1neg
+long long resident_peak = 0, paged_out = 0;
+unsigned char *page_vec;         // mincore result of a chunk
+long long page_size;
+long long page_chunk = PAGE_CHUNK; // bytes of a table checked and paged out at once
+
+// Creates a file of rows * layer1_size weights in table_dir and maps it; the file is
+// unlinked at once, so it is removed when pcwe exits
+weight *MapTable(struct mapped_table *m, const char *name, long long rows) {
+  char path[MAX_STRING * 2];
+  snprintf(path, sizeof(path), "%s/pcwe-%s-XXXXXX", table_dir, name);
+  m->fd = mkstemp(path);
+  if (m->fd < 0) {
+    fprintf(stderr, "cannot create %s\n", path);
+    exit(1);
+  }
+  unlink(path);
+  m->bytes = rows * layer1_size * sizeof(weight);
+  // reserves the disk space (and zeroes the file), so that a full disk is an error here
+  // instead of a SIGBUS during the training
+  if (posix_fallocate(m->fd, 0, m->bytes) != 0) {
+    fprintf(stderr, "cannot allocate %lld MB in %s\n", m->bytes >> 20, table_dir);
+    exit(1);
+  }
+  m->syn = (weight *)mmap(NULL, m->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+  if (m->syn == MAP_FAILED) {
+    fprintf(stderr, "cannot map %lld MB of %s\n", m->bytes >> 20, table_dir);
+    exit(1);
+  }
+  madvise(m->syn, m->bytes, MADV_RANDOM);  // rows are not read in order, read ahead nothing
+  // a chunk is at most an eighth of the budget of a table, so that the budget is kept
+  // beyond the hot rows however small it is
+  page_size = sysconf(_SC_PAGESIZE);
+  if (table_memory > 0 && (table_memory << 20) / 2 / 8 < page_chunk)
+    page_chunk = ((table_memory << 20) / 2 / 8 + page_size - 1) / page_size * page_size;
+  m->resident = (long long *)calloc(m->bytes / page_chunk + 1, sizeof(long long));
+  return m->syn;
+}
+
+void UnmapTable(struct mapped_table *m) {
+  munmap(m->syn, m->bytes);
+  close(m->fd);
+  free(m->resident);
+}
+
+// Writes back and drops the pages of [begin, begin + bytes) of a table; dirty pages are
+// only dropped from the page cache once written back
+void PageOut(struct mapped_table *m, long long begin, long long bytes) {
+  char *p = (char *)m->syn + begin;
+  msync(p, bytes, MS_SYNC);
+  madvise(p, bytes, MADV_DONTNEED);
+  posix_fadvise(m->fd, begin, bytes, POSIX_FADV_DONTNEED);
+}
+
+// Counts the resident pages of the tables and pages out the chunks of the rarest words
+// until every table is within its half of -table-memory
+void BudgetTables() {
+  long long t, c, p, begin, bytes, total, resident = 0, budget = (table_memory << 20) / 2;
+  struct mapped_table *m;
+  if (page_vec == NULL) page_vec = (unsigned char *)malloc(page_chunk / page_size + 1);
+  for (t = 0; t < 2; t++) {
+    m = &mapped[t];
+    total = 0;
+    for (c = 0; c * page_chunk < m->bytes; c++) {
+      begin = c * page_chunk;
+      bytes = m->bytes - begin < page_chunk ? m->bytes - begin : page_chunk;
+      m->resident[c] = 0;
+      if (mincore((char *)m->syn + begin, bytes, page_vec) != 0) continue;
+      for (p = 0; p < (bytes + page_size - 1) / page_size; p++) m->resident[c] += page_vec[p] & 1;
+      m->resident[c] *= page_size;
+      total += m->resident[c];
+    }
+    resident += total;
+    if (table_memory == 0) continue;
+    for (c--; c >= 0 && total > budget; c--) {
+      begin = c * page_chunk;
+      if (begin < budget / 2) break;   // the hot rows
+      if (m->resident[c] == 0) continue;
+      PageOut(m, begin, m->bytes - begin < page_chunk ? m->bytes - begin : page_chunk);
+      total -= m->resident[c];
+      paged_out += m->resident[c];
+    }
+  }
+  if (resident > resident_peak) resident_peak = resident;
+}
+
+void *PagerThread(void *arg) {
+  while (__atomic_load_n(&running_threads, __ATOMIC_ACQUIRE) > 0) {
+    BudgetTables();
+    usleep(PAGER_INTERVAL);
+  }
+  return NULL;
+}
+
+void InitNet(){
+  long long a, b, interval;
+  if (table_dir[0] != 0) {
+    synword = MapTable(&mapped[0], "synword", vocab_size);
+    syn1neg = MapTable(&mapped[1], "syn1neg", vocab_size);
+    if (debug_mode > 0) printf("Word tables mapped in %s: %.1f MB each\n", table_dir, mapped[0].bytes / 1048576.0);
+  } else {
+    a = posix_memalign((void **)&synword, 128, (long long)vocab_size * layer1_size * sizeof(weight));
+    if (synword == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(weight));
+    if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  a = posix_memalign((void **)&synchar, 128, (long long)char_size * layer1_size * sizeof(weight));
+  if (synchar == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  a = posix_memalign((void **)&syncomp, 128, (long long)comp_size * layer1_size * sizeof(weight));
+  if (syncomp == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  a = posix_memalign((void **)&synpron, 128, (long long)pron_size * layer1_size * sizeof(weight));
+  if (synpron == NULL) {printf("Memory allocation failed\n"); exit(1);}
+
+
+  //Initialize the weights
+  if (table_dir[0] == 0) {
+    for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
+      syn1neg[a * layer1_size + b] = ToWeight(0);
+    for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
+      synword[a * layer1_size + b] = ToWeight((InitRandom() - 0.5) / layer1_size);
+  } else {
+    // row by row, so that every page of the file is written once (the values differ from
+    // those of the tables in memory); syn1neg is zeroed by posix_fallocate. Every check
+    // scans both tables, so they are a fixed number of bytes apart, not a few rows
+    interval = INIT_INTERVAL / (layer1_size * sizeof(weight)) + 1;
+    for (a = 0; a < vocab_size; a++) {
+      for (b = 0; b < layer1_size; b++) synword[a * layer1_size + b] = ToWeight((InitRandom() - 0.5) / layer1_size);
+      if (table_memory > 0 && (a + 1) % interval == 0) BudgetTables();
+    }
+  }
+  for (b = 0; b < layer1_size; b++) for (a = 0; a < char_size; a++)
+    synchar[a * layer1_size + b] = ToWeight((InitRandom() - 0.5) / layer1_size);
+  for (b = 0; b < layer1_size; b++) for (a = 0; a < comp_size; a++)
+    syncomp[a * layer1_size + b] = ToWeight((InitRandom() - 0.5) / layer1_size);
+  for (b = 0; b < layer1_size; b++) for (a = 0; a < pron_size; a++)
+   synpron[a * layer1_size + b] = ToWeight((InitRandom() - 0.5) / layer1_size);
+
+  if (adagrad) {
+    adaword = (real *)calloc(vocab_size, sizeof(real));
+    adaneg = (real *)calloc(vocab_size, sizeof(real));
+    adachar = (real *)calloc(char_size, sizeof(real));
+    adacomp = (real *)calloc(comp_size, sizeof(real));
+    adapron = (real *)calloc(pron_size, sizeof(real));
+    if (adaword == NULL || adaneg == NULL || adachar == NULL || adacomp == NULL || adapron == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+}
+
+void DestroyNet(){
+  if (table_dir[0] != 0 && synword != NULL) {
+    UnmapTable(&mapped[0]);
+    UnmapTable(&mapped[1]);
+    synword = syn1neg = NULL;
+    free(page_vec);
+  }
+  if (synword != NULL){
+    free(synword);
+  }
+  if (syn1neg != NULL){
+    free(syn1neg);
+  }
+  if (synchar != NULL){
+    free(synchar);
+  }
+  if (syncomp != NULL){
+    free(syncomp);
+  }
+  if (synpron != NULL) {
+    free(synpron);
+  }
+  free(adaword);
+  free(adaneg);
+  free(adachar);
+  free(adacomp);
+  free(adapron);
+}
+
+// Reads one table of a model file; row a is copied to row id[a] of syn, or skipped if id[a] == -1
+void ReadModelTable(weight *syn, long long *id, long long rows, FILE *fin) {
+  long long a;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  for (a = 0; a < rows; a++) {
+    if (fread(row, sizeof(real), layer1_size, fin) != (size_t)layer1_size) {
+      fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+      exit(1);
+    }
+    if (id[a] != -1) StoreRow(&syn[id[a] * layer1_size], row);
+  }
+  free(row);
+}
+
+// Initializes the vector of a word unseen by the saved model from its subcharacters:
+// the average of its character, component and pronunciation averages
+void InitWordFromSubwords(long long word) {
+  long long a, b, c, d, cnt[3] = {0, 0, 0};
+  real *neu = (real *)calloc(layer1_size * 4, sizeof(real));
+  for (a = 0; a < vocab[word].character_size; a++) {
+    c = vocab[word].character[a];
+    AccumulateRow(neu, &synchar[c * layer1_size]);
+    cnt[0]++;
+    for (d = 0; d < char2comp[c].comp_size; d++) {
+      AccumulateRow(&neu[layer1_size], &syncomp[char2comp[c].comp[d] * layer1_size]);
+      cnt[1]++;
+    }
+    c = vocab[word].pronunciation[a];
+    AccumulateRow(&neu[2 * layer1_size], &synpron[c * layer1_size]);
+    cnt[2]++;
+  }
+  d = (cnt[0] > 0) + (cnt[1] > 0) + (cnt[2] > 0);
+  if (d > 0) {
+    for (b = 0; b < layer1_size; b++) {
+      neu[3 * layer1_size + b] = 0;
+      for (a = 0; a < 3; a++) if (cnt[a] > 0)
+        neu[3 * layer1_size + b] += neu[a * layer1_size + b] / cnt[a] / d;
+    }
+    StoreRow(&synword[word * layer1_size], &neu[3 * layer1_size]);
+  }
+  free(neu);
+}
+
+// Loads the embeddings of a saved model into the initialized network (incremental training).
+// Words new to the model are initialized from their subcharacters, and only the words of
+// the training file are counted in train_words, while the subsampling uses the total counts.
+void LoadModel() {
+  char str[MAX_STRING];
+  long long a, i, cn, size[4], new_words;
+  long long *word_id, *char_id, *comp_id, *pron_id;
+  char *loaded = (char *)calloc(vocab_size, sizeof(char));
+  int code;
+  FILE *fin = OpenModelFile(size);
+  word_id = (long long *)malloc(size[0] * sizeof(long long));
+  char_id = (long long *)malloc(size[1] * sizeof(long long));
+  comp_id = (long long *)malloc(size[2] * sizeof(long long));
+  pron_id = (long long *)malloc(size[3] * sizeof(long long));
+  for (a = 0; a < size[0]; a++) {
+    if (fread(&cn, sizeof(long long), 1, fin) != 1) {
+      fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+      exit(1);
+    }
+    ReadModelString(str, fin);
+    word_id[a] = i = SearchVocab(str);
+    if (i == -1) continue;
+    loaded[i] = 1;
+    if (i > 0) train_words -= cn;
+  }
+  for (a = 0; a < size[1]; a++) {
+    if (fread(&code, sizeof(int), 1, fin) != 1) {
+      fprintf(stderr, "ERROR: corrupted model file %s\n", load_model_file);
+      exit(1);
+    }
+    char_id[a] = GetCharIndex(code);
+  }
+  for (a = 0; a < size[2]; a++) {
+    ReadModelString(str, fin);
+    comp_id[a] = GetCompIndex(str);
+  }
+  for (a = 0; a < size[3]; a++) {
+    ReadModelString(str, fin);
+    pron_id[a] = GetPronIndex(str);
+  }
+  ReadModelTable(synword, word_id, size[0], fin);
+  ReadModelTable(syn1neg, word_id, size[0], fin);
+  ReadModelTable(synchar, char_id, size[1], fin);
+  ReadModelTable(syncomp, comp_id, size[2], fin);
+  ReadModelTable(synpron, pron_id, size[3], fin);
+  fclose(fin);
+
+  new_words = 0;
+  for (a = 1; a < vocab_size; a++) if (!loaded[a]) {
+    InitWordFromSubwords(a);
+    new_words++;
+  }
+  if (debug_mode > 0) {
+    printf("New words: %lld\n", new_words);
+    printf("Words to train in train file: %lld\n", train_words);
+  }
+  free(loaded);
+  free(word_id);
+  free(char_id);
+  free(comp_id);
+  free(pron_id);
+}
+
+// Writes a table to a model file as float rows
+void WriteModelTable(weight *syn, long long rows, FILE *fo) {
+  long long a;
+  real *buf = (real *)malloc(layer1_size * sizeof(real));
+  for (a = 0; a < rows; a++)
+    fwrite(LoadRow(&syn[a * layer1_size], buf), sizeof(real), layer1_size, fo);
+  free(buf);
+}
+
+void SaveModel() {
+  long long a, size[4] = {vocab_size, char_size, comp_size, pron_size};
+  int magic = MODEL_MAGIC;
+  FILE *fo = fopen(save_model_file, "wb");
+  if (fo == NULL) {
+    fprintf(stderr, "Cannot open %s: permission denied\n", save_model_file);
+    exit(1);
+  }
+  fwrite(&magic, sizeof(int), 1, fo);
+  fwrite(&layer1_size, sizeof(long long), 1, fo);
+  fwrite(size, sizeof(long long), 4, fo);
+  for (a = 0; a < vocab_size; a++) {
+    fwrite(&vocab[a].cn, sizeof(long long), 1, fo);
+    WriteModelString(vocab[a].word, fo);
+  }
+  fwrite(char_unicode, sizeof(int), char_size, fo);
+  for (a = 0; a < comp_size; a++) WriteModelString(comp_array[a].comp_str, fo);
+  for (a = 0; a < pron_size; a++) WriteModelString(pron_array[a].pron_str, fo);
+  WriteModelTable(synword, vocab_size, fo);
+  WriteModelTable(syn1neg, vocab_size, fo);
+  WriteModelTable(synchar, char_size, fo);
+  WriteModelTable(syncomp, comp_size, fo);
+  WriteModelTable(synpron, pron_size, fo);
+  fclose(fo);
+}
+
+// (label - sigmoid(f)) * alpha, the gradient of the log-likelihood of a sample
+static inline real Gradient(real f, long long label) {
+  int idx;
+  if (f > MAX_EXP) return (label - 1) * alpha;
+  if (f < -MAX_EXP) return (label - 0) * alpha;
+  idx = (int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2));
+  if (idx < 0) idx = 0;
+  if (idx > EXP_TABLE_SIZE) idx = EXP_TABLE_SIZE;
+  return (label - expTable[idx]) * alpha;
+}
+
+// join_type 1: the word, character, component and pronunciation contexts have their
+// own loss with the output row neg. Accumulates the gradients of the contexts and
+// writes the update of neg to neg_grad.
+static inline void JoinSum(real *word, real *chr, real *comp, real *pron,
+                           real *word_grad, real *char_grad, real *comp_grad, real *pron_grad,
+                           real *neg, real *neg_grad, long long label) {
+  long long c;
+  real f1 = 0, f2 = 0, f3 = 0, f4 = 0, g1, g2, g3, g4;
+  for (c = 0; c < layer1_size; c++) {
+    f1 += word[c] * neg[c];
+    f2 += chr[c] * neg[c];
+    f3 += comp[c] * neg[c];
+    f4 += pron[c] * neg[c];
+  }
+  g1 = Gradient(f1, label);
+  g2 = Gradient(f2, label);
+  g3 = Gradient(f3, label);
+  g4 = Gradient(f4, label);
+  for (c = 0; c < layer1_size; c++) {
+    word_grad[c] += g1 * neg[c];
+    char_grad[c] += g2 * neg[c];
+    comp_grad[c] += g3 * neg[c];
+    pron_grad[c] += g4 * neg[c];
+  }
+  for (c = 0; c < layer1_size; c++)
+    neg_grad[c] = g1 * word[c] + g2 * chr[c] + g3 * comp[c] + g4 * pron[c];
+}
+
+// join_type 2: the sum of the four contexts has a single loss with the output row neg
+static inline void JoinAverage(real *word, real *chr, real *comp, real *pron,
+                               real *word_grad, real *char_grad, real *comp_grad, real *pron_grad,
+                               real *neg, real *neg_grad, long long label) {
+  long long c;
+  real f = 0, g;
+  for (c = 0; c < layer1_size; c++)
+    f += (word[c] + chr[c] + comp[c] + pron[c]) * neg[c];
+  g = Gradient(f, label);
+  for (c = 0; c < layer1_size; c++) {
+    word_grad[c] += g * neg[c];
+    comp_grad[c] += g * neg[c];
+    char_grad[c] += g * neg[c];
+    pron_grad[c] += g * neg[c];
+  }
+  for (c = 0; c < layer1_size; c++)
+    neg_grad[c] = g * (word[c] + chr[c] + comp[c] + pron[c]);
+}
+
+//********* Sweep ************
+
+// With -sweep, several configurations (join_type, pos_type, average_sum) are trained in
+// one pass over the training file. Every configuration has its own tables, initialized
+// alike, and every target word of the sentences, read and subsampled once, is trained by
+// all of them with the same window and negative samples. Without -sweep, the options are
+// the single configuration. The output files of a configuration of a sweep get the
+// suffix .j<join_type>p<pos_type>a<average_sum>.
+struct train_state;
+struct model {
+  int join_type, pos_type, average_sum;
+  weight *synword, *syn1neg, *synchar, *syncomp, *synpron;
+  real *adaword, *adaneg, *adachar, *adacomp, *adapron;
+  // the training step of the configuration (train_kernels)
+  void (*kernel)(struct train_state *, struct model *, long long *, long long, long long, long long, long long *);
+};
+
+char sweep[MAX_STRING];  // -sweep: join_type:pos_type:average_sum,...
+struct model *models;
+int model_count = 0;
+
+weight *CopyTable(weight *syn, long long rows) {
+  weight *copy;
+  if (posix_memalign((void **)&copy, 128, rows * layer1_size * sizeof(weight)) != 0) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(copy, syn, rows * layer1_size * sizeof(weight));
+  return copy;
+}
+
+real *NewAccumulators(long long rows) {
+  real *acc = (real *)calloc(rows, sizeof(real));
+  if (acc == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  return acc;
+}
+
+// Writes the output file name of m in a sweep, base with the suffix of m, to name;
+// returns 0 if it does not fit in MAX_STRING
+int SweepFileName(char *name, const char *base, struct model *m) {
+  return snprintf(name, MAX_STRING, "%s.j%dp%da%d", base, m->join_type, m->pos_type, m->average_sum) < MAX_STRING;
+}
+
+// Reads the configurations of -sweep; the first one gets the tables of InitNet (and
+// LoadModel), the others copies of them
+void InitModels() {
+  long long a, b;
+  char *s = sweep, name[MAX_STRING], *file[5] = {output_word, output_char, output_comp, output_pron, save_model_file};
+  int i;
+  struct model *m;
+  model_count = 1;
+  for (a = 0; sweep[a] != 0; a++) if (sweep[a] == ',') model_count++;
+  models = (struct model *)calloc(model_count, sizeof(struct model));
+  if (models == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < model_count; a++) {
+    m = &models[a];
+    if (sweep[0] == 0) {
+      m->join_type = join_type;
+      m->pos_type = pos_type;
+      m->average_sum = average_sum;
+    } else {
+      if (sscanf(s, "%d:%d:%d", &m->join_type, &m->pos_type, &m->average_sum) != 3 ||
+          m->join_type < 1 || m->join_type > 2 || m->pos_type < 1 || m->pos_type > 3) {
+        fprintf(stderr, "bad configuration of -sweep (join_type:pos_type:average_sum, join_type 1 or 2, pos_type 1, 2 or 3): %s\n", s);
+        exit(1);
+      }
+      // the outputs of a configuration are named after it
+      for (b = 0; b < a; b++) if (models[b].join_type == m->join_type && models[b].pos_type == m->pos_type &&
+                                  models[b].average_sum == m->average_sum) {
+        fprintf(stderr, "configuration given twice in -sweep: %d:%d:%d\n", m->join_type, m->pos_type, m->average_sum);
+        exit(1);
+      }
+      if (a + 1 < model_count) s = strchr(s, ',') + 1;
+      // checked before the training, as the files are only written after it
+      for (i = 0; i < 5; i++) if (model_count > 1 && file[i][0] != 0 && !SweepFileName(name, file[i], m)) {
+        fprintf(stderr, "output file name too long for -sweep (at most %d bytes with the suffix): %s\n", MAX_STRING - 1, file[i]);
+        exit(1);
+      }
+    }
+    if (a == 0) {
+      m->synword = synword;
+      m->syn1neg = syn1neg;
+      m->synchar = synchar;
+      m->syncomp = syncomp;
+      m->synpron = synpron;
+      m->adaword = adaword;
+      m->adaneg = adaneg;
+      m->adachar = adachar;
+      m->adacomp = adacomp;
+      m->adapron = adapron;
+      continue;
+    }
+    m->synword = CopyTable(synword, vocab_size);
+    m->syn1neg = CopyTable(syn1neg, vocab_size);
+    m->synchar = CopyTable(synchar, char_size);
+    m->syncomp = CopyTable(syncomp, comp_size);
+    m->synpron = CopyTable(synpron, pron_size);
+    if (adagrad) {
+      m->adaword = NewAccumulators(vocab_size);
+      m->adaneg = NewAccumulators(vocab_size);
+      m->adachar = NewAccumulators(char_size);
+      m->adacomp = NewAccumulators(comp_size);
+      m->adapron = NewAccumulators(pron_size);
+    }
+  }
+  if (model_count > 1 && debug_mode > 0) printf("Sweep of %d configurations\n", model_count);
+}
+
+// Makes the tables and options of m those of the functions that use the globals
+// (SaveVectors, SaveModel, QuantizeTables, DestroyNet), and gives the output files the
+// suffix of m in a sweep
+void SelectModel(struct model *m) {
+  static char base[5][MAX_STRING];
+  static int saved = 0;
+  char *file[5] = {output_word, output_char, output_comp, output_pron, save_model_file};
+  int i;
+  synword = m->synword;
+  syn1neg = m->syn1neg;
+  synchar = m->synchar;
+  syncomp = m->syncomp;
+  synpron = m->synpron;
+  adaword = m->adaword;
+  adaneg = m->adaneg;
+  adachar = m->adachar;
+  adacomp = m->adacomp;
+  adapron = m->adapron;
+  join_type = m->join_type;
+  pos_type = m->pos_type;
+  average_sum = m->average_sum;
+  if (model_count < 2) return;
+  for (i = 0; i < 5; i++) {
+    if (!saved) strcpy(base[i], file[i]);
+    if (base[i][0] != 0 && !SweepFileName(file[i], base[i], m)) {
+      fprintf(stderr, "output file name too long for -sweep: %s\n", base[i]);
+      exit(1);
+    }
+  }
+  saved = 1;
+}
+
+// Frees the tables of the sweep but those of the first configuration, which are left to DestroyNet
+void DestroyModels() {
+  long long a;
+  for (a = 1; a < model_count; a++) {
+    SelectModel(&models[a]);
+    DestroyNet();
+  }
+  SelectModel(&models[0]);
+  free(models);
+}
+
+//********* Hot rows ************
+
+// All threads update the few rows of the common characters, radicals and syllables, and
+// the cache lines of these rows move between the cores at every update. With
+// -hot-rows <n>, the n most used rows of each subword table, found from the vocabulary
+// counts, are hot: a thread adds its updates of them to its own delta buffers, and
+// merges the buffers into the tables every -hot-sync target words. With -adagrad, the
+// squared gradients of hot rows go to per-slot accumulator deltas as well. A thread reads
+// the tables without its pending updates.
+int hot_rows = 0, hot_sync = 64;
+
+struct hot_table {
+  int *slot;   // slot of every row in the delta buffers, or -1
+  int *row;    // row of every slot
+  int size;
+} hot[3];      // synchar, syncomp, synpron
+
+// The delta buffer of a thread for one table (of one configuration of -sweep)
+struct hot_buffer {
+  struct hot_table *table;
+  weight *syn;
+  real *acc;               // -adagrad: the accumulators of the table, or NULL
+  real *delta;
+  real *acc_delta;         // -adagrad: the squared gradients of every slot since the last merge
+  unsigned char *pending;  // the slots with updates since the last merge
+  int *dirty, dirty_count;
+};
+
+struct hot_order {
+  long long freq;
+  int row;
+};
+
+int HotCompare(const void *a, const void *b) {
+  const struct hot_order *x = (const struct hot_order *)a, *y = (const struct hot_order *)b;
+  if (x->freq != y->freq) return x->freq < y->freq ? 1 : -1;
+  return x->row - y->row;
+}
+
+// Makes the (at most hot_rows) rows of the largest freq hot; returns their share of all uses
+double FindHotRows(struct hot_table *h, long long *freq, long long rows) {
+  long long a, total = 0, used = 0;
+  struct hot_order *order = (struct hot_order *)malloc(rows * sizeof(struct hot_order));
+  h->slot = (int *)malloc(rows * sizeof(int));
+  h->row = (int *)malloc(hot_rows * sizeof(int));
+  if (order == NULL || h->slot == NULL || h->row == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < rows; a++) {
+    order[a].freq = freq[a];
+    order[a].row = a;
+    h->slot[a] = -1;
+    total += freq[a];
+  }
+  qsort(order, rows, sizeof(struct hot_order), HotCompare);
+  for (h->size = 0; h->size < hot_rows && h->size < rows && order[h->size].freq > 0; h->size++) {
+    h->slot[order[h->size].row] = h->size;
+    h->row[h->size] = order[h->size].row;
+    used += order[h->size].freq;
+  }
+  free(order);
+  return used / (total + 1e-9) * 100;
+}
+
+void InitHotRows() {
+  long long a, c, d, n = char_size, *freq;
+  double share[3];
+  if (comp_size > n) n = comp_size;
+  if (pron_size > n) n = pron_size;
+  freq = (long long *)malloc(n * sizeof(long long));
+  if (freq == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  memset(freq, 0, n * sizeof(long long));
+  for (a = 0; a < vocab_size; a++) for (c = 0; c < vocab[a].character_size; c++)
+    freq[vocab[a].character[c]] += vocab[a].cn;
+  share[0] = FindHotRows(&hot[0], freq, char_size);
+  memset(freq, 0, n * sizeof(long long));
+  for (a = 0; a < vocab_size; a++) for (c = 0; c < vocab[a].character_size; c++)
+    for (d = 0; d < char2comp[vocab[a].character[c]].comp_size; d++)
+      freq[char2comp[vocab[a].character[c]].comp[d]] += vocab[a].cn;
+  share[1] = FindHotRows(&hot[1], freq, comp_size);
+  memset(freq, 0, n * sizeof(long long));
+  for (a = 0; a < vocab_size; a++) for (c = 0; c < vocab[a].character_size; c++)
+    freq[vocab[a].pronunciation[c]] += vocab[a].cn;
+  share[2] = FindHotRows(&hot[2], freq, pron_size);
+  free(freq);
+  if (debug_mode > 0)
+    printf("Hot rows: %d characters (%.1f%% of the uses), %d components (%.1f%%), %d pronunciations (%.1f%%)\n",
+           hot[0].size, share[0], hot[1].size, share[1], hot[2].size, share[2]);
+}
+
+void DestroyHotRows() {
+  long long a;
+  for (a = 0; a < 3; a++) {
+    free(hot[a].slot);
+    free(hot[a].row);
+  }
+}
+
+void InitHotBuffer(struct hot_buffer *h, struct hot_table *table, weight *syn, real *acc) {
+  h->table = table;
+  h->syn = syn;
+  h->acc = acc;
+  h->delta = (real *)calloc((long long)table->size * layer1_size + 1, sizeof(real));
+  h->acc_delta = (real *)calloc(table->size + 1, sizeof(real));
+  h->pending = (unsigned char *)calloc(table->size + 1, 1);
+  h->dirty = (int *)malloc((table->size + 1) * sizeof(int));
+  h->dirty_count = 0;
+  if (h->delta == NULL || h->acc_delta == NULL || h->pending == NULL || h->dirty == NULL) {printf("Memory allocation failed\n"); exit(1);}
+}
+
+void DestroyHotBuffer(struct hot_buffer *h) {
+  free(h->delta);
+  free(h->acc_delta);
+  free(h->pending);
+  free(h->dirty);
+}
+
+// Adds the count updates of row (as ApplyUpdate) to the delta buffer h if the row is hot;
+// returns 0 if it is not. The step sizes of -adagrad use the shared accumulator plus the
+// pending squares of the thread, which only the thread writes.
+static inline int HotUpdate(struct hot_buffer *h, long long row, real *grad, real square, int count) {
+  long long c;
+  int slot, i;
+  real scale = count, sum, *delta;
+  if (h == NULL || (slot = h->table->slot[row]) < 0) return 0;
+  if (h->acc != NULL) {
+    if (square <= 0) return 1;
+    sum = h->acc[row] + h->acc_delta[slot];
+    for (i = 0, scale = 0; i < count; i++) {
+      sum += square;
+      scale += 1 / sqrt(sum);
+    }
+    h->acc_delta[slot] += square * count;
+  }
+  if (!h->pending[slot]) {
+    h->pending[slot] = 1;
+    h->dirty[h->dirty_count++] = slot;
+  }
+  delta = &h->delta[(long long)slot * layer1_size];
+  for (c = 0; c < layer1_size; c++) delta[c] += grad[c] * scale;
+  return 1;
+}
+
+// Adds the pending updates of h to its table and accumulators
+void MergeHot(struct hot_buffer *h, unsigned int *rounding) {
+  long long a, slot;
+  real *delta;
+  for (a = 0; a < h->dirty_count; a++) {
+    slot = h->dirty[a];
+    delta = &h->delta[slot * layer1_size];
+    UpdateRow(&h->syn[(long long)h->table->row[slot] * layer1_size], delta, (*rounding)++);
+    memset(delta, 0, layer1_size * sizeof(real));
+    if (h->acc != NULL) {
+      h->acc[h->table->row[slot]] += h->acc_delta[slot];
+      h->acc_delta[slot] = 0;
+    }
+    h->pending[slot] = 0;
+  }
+  h->dirty_count = 0;
+}
+
+//********* Distributed training ************
+
+// With -dist-size, every process trains on its part of the training file (the file is
+// split between the threads of all processes) and the processes average their tables
+// every dist_sync words. The averaging is a ring allreduce (dist.c): every process
+// reduces the sums of 1/dist_size of the rows, the shard it owns, and passes them on.
+// The training threads keep running while the tables are averaged: a row becomes the
+// average of the values sent plus the local updates made in the meantime.
+#define DIST_CHUNK (1 << 22)  // values averaged at once
+
+int dist_rank = 0, dist_size = 1;
+char dist_addr[MAX_STRING] = "127.0.0.1:7700";
+long long dist_sync = 1000000;
+
+// Offset in the training file of the part of thread id
+long long ThreadOffset(long long id) {
+  return file_size / ((long long)num_threads * dist_size) * (dist_rank * (long long)num_threads + id);
+}
+
+void AverageTable(weight *syn, long long rows, real *sent, real *sum, unsigned int *rounding) {
+  long long a, c, n, row;
+  real *v;
+  for (row = 0; row < rows; row += n) {
+    n = DIST_CHUNK / layer1_size;
+    if (n > rows - row) n = rows - row;
+    for (a = 0; a < n; a++) {
+      v = LoadRow(&syn[(row + a) * layer1_size], &sent[a * layer1_size]);
+      if (v != &sent[a * layer1_size]) memcpy(&sent[a * layer1_size], v, layer1_size * sizeof(real));
+    }
+    memcpy(sum, sent, n * layer1_size * sizeof(real));
+    DistAllreduce(sum, n * layer1_size);
+    for (c = 0; c < n * layer1_size; c++) sum[c] = sum[c] / dist_size - sent[c];
+    for (a = 0; a < n; a++) {
+      UpdateRow(&syn[(row + a) * layer1_size], &sum[a * layer1_size], *rounding);
+      *rounding += 0x9E3779B9u;
+    }
+  }
+}
+
+// Averages all embedding tables over the processes
+void AverageTables() {
+  long long n = DIST_CHUNK / layer1_size * layer1_size;
+  real *sent = (real *)malloc(n * sizeof(real)), *sum = (real *)malloc(n * sizeof(real));
+  static unsigned int rounding = 0;
+  struct model *m;
+  if (sent == NULL || sum == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (m = models; m < models + model_count; m++) {
+    AverageTable(m->synword, vocab_size, sent, sum, &rounding);
+    AverageTable(m->syn1neg, vocab_size, sent, sum, &rounding);
+    AverageTable(m->synchar, char_size, sent, sum, &rounding);
+    AverageTable(m->syncomp, comp_size, sent, sum, &rounding);
+    AverageTable(m->synpron, pron_size, sent, sum, &rounding);
   }
-  return -1;
+  free(sent);
+  free(sum);
 }
 
-void LearnWord2PronFromFile() {
-  FILE *fin = fopen(word2pron_file, "rb");
-  if (fin == NULL) {
-    fprintf(stderr, "ERROR: word2pron file not found!\n");
+// Connects the processes and checks that they built the same tables
+void InitDist() {
+  long long size[5] = {vocab_size, char_size, comp_size, pron_size, layer1_size}, prev[5];
+  if (debug_mode > 0) printf("Distributed training: process %d of %d, %s\n", dist_rank, dist_size, dist_addr);
+  DistInit(dist_addr, dist_rank, dist_size);
+  DistExchange(size, sizeof(size), prev, sizeof(prev));
+  if (memcmp(size, prev, sizeof(size))) {
+    fprintf(stderr, "process %d has other tables than process %d: same files and options are needed\n",
+            dist_rank, (dist_rank + dist_size - 1) % dist_size);
     exit(1);
   }
+  // every process trains on its part of the file
+  train_words /= dist_size;
+}
 
-  char *line = NULL;
-  size_t len = 0;
-  while (getline(&line, &len, fin) != -1) {
-    char *save_ptr = NULL, *word = NULL, *pron = NULL;
-    word = strtok_r(line, " \t\n", &save_ptr);
-    long long word_index = -1;
-    if ((word_index = SearchVocab(word)) != -1) {
-      vocab[word_index].pronunciation = (int*)calloc(vocab[word_index].character_size, sizeof(int));
-      int i = 0;
-      while ((pron = strtok_r(NULL, " _\t\n", &save_ptr)) != NULL) {
-        int pron_idx = GetPronIndex(pron);
-        if (pron_idx != -1) {
-          vocab[word_index].pronunciation[i++] = pron_idx;
-        } else {
-          printf("not exist pronunciation %s\n", pron);
-        }
-      }
+// Averages the tables every dist_sync words of the process while the training threads
+// run, and once more at the end; every process averages the same number of times
+void DistTrain(pthread_t *pt) {
+  long long a, rounds = dist_sync > 0 ? iter * train_words / dist_sync : 0;
+  for (a = 1; a <= rounds; a++) {
+    while (word_count_actual < a * dist_sync && __atomic_load_n(&running_threads, __ATOMIC_ACQUIRE) > 0) usleep(10000);
+    AverageTables();
+  }
+  for (a = 0; a < num_threads + readers; a++) pthread_join(pt[a], NULL);
+  AverageTables();
+}
 
-      if (i != vocab[word_index].character_size) {
-        printf("i = %d, ch_size = %d\n", i, vocab[word_index].character_size);
-        printf("word = %s\n", vocab[word_index].word);
+//********* Sentence pipeline ************
+
+// -readers: reader threads parse and subsample the sentences of the training threads
+// ahead of time. Every training thread has a single-producer single-consumer ring of
+// sentences, filled by reader (thread % readers) from the part of the file the thread
+// would read itself; the last sentence of every iteration is marked with epoch_end.
+#define RING_SIZE 64
+
+struct sentence_batch {
+  long long words;  // words read for the sentence, including the discarded ones
+  int length, epoch_end;
+  int id[MAX_SENTENCE_LENGTH];
+};
+
+struct sentence_ring {
+  // written by the reader
+  long long head;
+  struct sentence_batch *batch;
+  FILE *fi;
+  long long word_count, local_iter;
+  unsigned long long next_random;
+  // written by the training thread
+  long long tail __attribute__((aligned(64)));
+  double wait;  // seconds spent waiting for sentences
+} __attribute__((aligned(64)));
+
+struct sentence_ring *rings;
+double *reader_busy;  // seconds every reader spent reading, without waiting for full rings
+
+double Seconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Reads the next non-empty sentence of thread id into b, or the end of the iteration
+void ReadSentence(struct sentence_ring *r, struct sentence_batch *b, long long id) {
+  long long word, length = 0, first = 0, sen[MAX_SENTENCE_LENGTH], a;
+  b->words = r->word_count;
+  b->epoch_end = 0;
+  while (length == 0 && !b->epoch_end) {
+    first = 0;
+    while (1) {
+      word = ReadWordIndex(r->fi);
+      if (feof(r->fi)) break;
+      if (word == -1) continue;
+      r->word_count++;
+      if (word == 0) break;
+      sen[length++] = word;
+      if (length >= MAX_SENTENCE_LENGTH) {
+        if (sample > 0) length = first + SubsampleWords(&sen[first], length - first, &r->next_random, NULL);
+        first = length;
+        if (length >= MAX_SENTENCE_LENGTH) break;
       }
     }
+    if (sample > 0) length = first + SubsampleWords(&sen[first], length - first, &r->next_random, NULL);
+    b->epoch_end = feof(r->fi) || r->word_count > train_words / num_threads;
   }
-  if (line) free(line);
-  fclose(fin);
-  printf("pron_size = %d\n", pron_size);
+  b->words = r->word_count - b->words;
+  b->length = length;
+  for (a = 0; a < length; a++) b->id[a] = sen[a];
+  if (b->epoch_end) {
+    b->length = 0;
+    r->word_count = 0;
+    r->local_iter--;
+    fseek(r->fi, ThreadOffset(id), SEEK_SET);
+  }
+}
+
+void *ReaderThread(void *id) {
+  long long t;
+  int active = 1, progress;
+  struct sentence_ring *r;
+  double begin = Seconds(), wait = 0, now;
+  while (active) {
+    active = progress = 0;
+    for (t = (long long)id; t < num_threads; t += readers) {
+      r = &rings[t];
+      if (r->local_iter == 0) continue;
+      active = 1;
+      if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE) continue;
+      ReadSentence(r, &r->batch[r->head % RING_SIZE], t);
+      __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+      progress = 1;
+    }
+    if (active && !progress) {
+      now = Seconds();
+      sched_yield();
+      wait += Seconds() - now;
+    }
+  }
+  reader_busy[(long long)id] = Seconds() - begin - wait;
+  return NULL;
 }
 
+// Copies the next sentence of the ring to sen and adds the words read to words;
+// returns 1 at the end of an iteration
+int PopSentence(struct sentence_ring *r, long long *sen, long long *length, long long *words) {
+  struct sentence_batch *b;
+  long long a;
+  double begin;
+  if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+    begin = Seconds();
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) sched_yield();
+    r->wait += Seconds() - begin;
+  }
+  b = &r->batch[r->tail % RING_SIZE];
+  for (a = 0; a < b->length; a++) sen[a] = b->id[a];
+  *length = b->length;
+  *words += b->words;
+  a = b->epoch_end;
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+  return a;
+}
 
-int CheckPron() {
-  int no_pron = 0;
-  for (int i = 0; i < vocab_size; ++i)
-  {
-    if (vocab[i].pronunciation == NULL && strcmp("</s>", vocab[i].word) != 0) {
-      printf("no pronunciation: %s\n", vocab[i].word);
-      no_pron = 1;
+void InitReaders() {
+  long long a;
+  if (posix_memalign((void **)&rings, 64, num_threads * sizeof(struct sentence_ring))) rings = NULL;
+  reader_busy = (double *)calloc(readers, sizeof(double));
+  if (rings == NULL || reader_busy == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  memset(rings, 0, num_threads * sizeof(struct sentence_ring));
+  for (a = 0; a < num_threads; a++) {
+    rings[a].batch = (struct sentence_batch *)malloc(RING_SIZE * sizeof(struct sentence_batch));
+    if (rings[a].batch == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    rings[a].fi = CorpusOpen(train_file);
+    if (rings[a].fi == NULL) {
+      fprintf(stderr, "no such file or directory: %s", train_file);
+      exit(1);
     }
+    fseek(rings[a].fi, ThreadOffset(a), SEEK_SET);
+    rings[a].local_iter = iter;
+    rings[a].next_random = a;
   }
-  return no_pron;
 }
 
-void InitNet(){
-  long long a, b;
-  a = posix_memalign((void **)&synword, 128, (long long)vocab_size * layer1_size * sizeof(real));
-  if (synword == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-  if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  a = posix_memalign((void **)&synchar, 128, (long long)CHAR_SIZE * layer1_size * sizeof(real));
-  if (synchar == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  a = posix_memalign((void **)&syncomp, 128, (long long)comp_size * layer1_size * sizeof(real));
-  if (syncomp == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  a = posix_memalign((void **)&synpron, 128, (long long)pron_size * layer1_size * sizeof(real));
-  if (synpron == NULL) {printf("Memory allocation failed\n"); exit(1);}
+void DestroyReaders() {
+  long long a;
+  for (a = 0; a < num_threads; a++) {
+    fclose(rings[a].fi);
+    free(rings[a].batch);
+  }
+  free(rings);
+  free(reader_busy);
+}
 
+// Draws the window of a target word and, if it has context words, its negative samples
+static inline unsigned long long DrawTarget(unsigned long long next_random, struct philox *rng,
+                                            long long *b, long long *negs, int has_context) {
+  long long d;
+  next_random = NextRandom(next_random, rng);
+  *b = next_random % window;  //[0, window-1]
+  if (has_context) for (d = 1; d <= negative; d++) {
+    next_random = NextRandom(next_random, rng);
+    negs[d] = table[(next_random >> 16) % table_size];
+    if (negs[d] == 0) negs[d] = next_random % (vocab_size - 1) + 1;  // if sample "</s>", randomly resample
+  }
+  return next_random;
+}
 
-  //Initialize the weights
-  for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
-    syn1neg[a * layer1_size + b] = 0;
-  for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
-    synword[a * layer1_size + b] = (rand() / (real)RAND_MAX - 0.5) / layer1_size;
-  for (b = 0; b < layer1_size; b++) for (a = 0; a < CHAR_SIZE; a++)
-    synchar[a * layer1_size + b] = (rand() / (real)RAND_MAX - 0.5) / layer1_size;
-  for (b = 0; b < layer1_size; b++) for (a = 0; a < comp_size; a++)
-    syncomp[a * layer1_size + b] = (rand() / (real)RAND_MAX - 0.5) / layer1_size;
-  for (b = 0; b < layer1_size; b++) for (a = 0; a < pron_size; a++)
-   synpron[a * layer1_size + b] = (rand() / (real)RAND_MAX - 0.5) / layer1_size;
+// Prefetches the input rows of a context word in the tables of m: the word, its
+// characters, their components and the pronunciations
+static inline void PrefetchContext(struct model *m, long long word) {
+  long long c, d, char_id;
+  PrefetchRow(&m->synword[word * layer1_size]);
+  for (c = 0; c < vocab[word].character_size; c++) {
+    char_id = vocab[word].character[c];
+    PrefetchRow(&m->synchar[char_id * layer1_size]);
+    for (d = 0; d < char2comp[char_id].comp_size; d++) PrefetchRow(&m->syncomp[char2comp[char_id].comp[d] * layer1_size]);
+    if (m->pos_type == 1 || m->pos_type == 3) PrefetchRow(&m->synpron[vocab[word].pronunciation[c] * layer1_size]);
+  }
+}
 
+//********* Profiler ************
+
+// In builds with make PROFILE=1 (PCWE_PROFILE), -profile <n> times the stages of the
+// training of 1 of every n target words with the time stamp counter, and the reading of
+// every sentence. Every thread adds the times to its own struct profile; the stages,
+// their share of the training time and their percentiles are printed at the end of
+// training. Without PCWE_PROFILE, the PROFILE_ macros are empty.
+enum {STAGE_READ, STAGE_DRAW, STAGE_CONTEXT, STAGE_NEGATIVE, STAGE_WORD, STAGE_CHAR, STAGE_COMP, STAGE_PRON, STAGES};
+const char *stage_names[STAGES] = {"read", "draw", "context", "negative", "word", "char", "comp", "pron"};
+
+#ifdef PCWE_PROFILE
+#define PROFILE_BUCKETS HIST_BUCKETS  // of the ticks
+
+struct profile {
+  unsigned long long last;   // ticks at the end of the last stage
+  unsigned long long count[STAGES], ticks[STAGES];
+  unsigned long long hist[STAGES][PROFILE_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct profile *profiles;    // one per training thread
+
+static inline unsigned long long Ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
-void DestroyNet(){
-  if (synword != NULL){
-    free(synword);
+// Ends a stage: the time since the last one is added to stage
+static inline void ProfileMark(struct profile *p, int stage) {
+  unsigned long long now = Ticks(), ticks = now - p->last;
+  p->last = now;
+  p->count[stage]++;
+  p->ticks[stage] += ticks;
+  p->hist[stage][HistBucket(ticks)]++;
+}
+
+// Prints the stages of all threads; ticks is the number of ticks of the training time
+void ProfileReport(double seconds, unsigned long long ticks) {
+  long long a, s, b;
+  unsigned long long count, sum, hist[PROFILE_BUCKETS], seen, p50, p99;
+  double ns = seconds * 1e9 / ticks, total = 0, stage;
+  printf("Profile of 1 of every %d target words, %d threads (%.2f ticks/ns):\n", profile_every, num_threads, 1 / ns);
+  printf("  %-9s %7s %12s %10s %10s\n", "stage", "share", "ns/sample", "p50 ns", "p99 ns");
+  for (s = 0; s < STAGES; s++) {
+    count = sum = 0;
+    memset(hist, 0, sizeof(hist));
+    for (a = 0; a < num_threads; a++) {
+      count += profiles[a].count[s];
+      sum += profiles[a].ticks[s];
+      for (b = 0; b < PROFILE_BUCKETS; b++) hist[b] += profiles[a].hist[s][b];
+    }
+    if (count == 0) continue;
+    p50 = p99 = 0;
+    for (b = 0, seen = 0; b < PROFILE_BUCKETS; b++) {
+      seen += hist[b];
+      if (p50 == 0 && seen * 2 >= count) p50 = HistBucketEnd(b);
+      if (p99 == 0 && seen * 100 >= count * 99) p99 = HistBucketEnd(b);
+    }
+    // the sampled stages stand for profile_every target words each
+    stage = sum * ns * (s == STAGE_READ ? 1 : profile_every);
+    total += stage;
+    printf("  %-9s %6.1f%% %12.0f %10.0f %10.0f\n", stage_names[s], stage / (seconds * 1e9 * num_threads) * 100,
+           sum * ns / count, p50 * ns, p99 * ns);
   }
-  if (syn1neg != NULL){
-    free(syn1neg);
+  printf("  %-9s %6.1f%%\n", "other", 100 - total / (seconds * 1e9 * num_threads) * 100);
+}
+
+// starts timing the training of a target word, if it is sampled
+#define PROFILE_TARGET(s) do { \
+    (s)->profiling = (s)->profile != NULL && ++(s)->profile_count >= profile_every; \
+    if ((s)->profiling) { (s)->profile_count = 0; (s)->profile->last = Ticks(); } \
+  } while (0)
+#define PROFILE_MARK(s, stage) do { if ((s)->profiling) ProfileMark((s)->profile, stage); } while (0)
+// times a stage of every call (the reading of a sentence)
+#define PROFILE_BEGIN(s) do { if ((s)->profile != NULL) (s)->profile->last = Ticks(); } while (0)
+#define PROFILE_END(s, stage) do { if ((s)->profile != NULL) ProfileMark((s)->profile, stage); } while (0)
+#else
+#define PROFILE_TARGET(s)
+#define PROFILE_MARK(s, stage)
+#define PROFILE_BEGIN(s)
+#define PROFILE_END(s, stage)
+#endif
+
+// Adds id to the distinct ids of a window, or counts it again
+static inline void AddSubword(long long id, long long *list, int *mult, int *pos, int *size) {
+  if (pos[id] >= 0) {
+    mult[pos[id]]++;
+    return;
   }
-  if (synchar != NULL){
-    free(synchar);
+  pos[id] = *size;
+  list[*size] = id;
+  mult[(*size)++] = 1;
+}
+
+// Buffers of a training thread, used by the training step of its target words
+struct train_state {
+  real *neuword, *neuword_grad, *neuchar, *neuchar_grad, *neucomp, *neucomp_grad, *neupron, *neupron_grad;
+  real *neuneg;       // syn1neg row of the target / negative sample
+  real *neuneg_grad;  // and its update
+  real *neuada;       // -adagrad: a scaled update
+  long long *char_id_list, *comp_id_list, *pron_id_list;  // the distinct subwords of the window
+  int *char_mult, *comp_mult, *pron_mult;                  // and their occurrences
+  int *char_pos, *comp_pos, *pron_pos;  // position of a subword in its list, or -1
+  struct det_log *dlog;   // -deterministic: the update log of the thread
+  unsigned int rounding;  // seeds the stochastic rounding of 16-bit tables
+  struct hot_buffer *hot;  // -hot-rows: the delta buffers of synchar, syncomp and synpron of every configuration
+#ifdef PCWE_PROFILE
+  struct profile *profile;  // -profile: the profile of the thread, or NULL
+  int profile_count, profiling;
+#endif
+};
+
+// Trains the cbow model of m on the target word at sentence_position, with the window b
+// and the negative samples negs. join, pos and avg are join_type, pos_type and
+// average_sum of m (avg = average_sum == 1); TrainTarget is only called with constants
+// by the kernels below, so that every combination is compiled without the branches on them.
+static inline __attribute__((always_inline))
+void TrainTarget(struct train_state *s, struct model *m, long long *sen, long long sentence_length,
+                 long long sentence_position, long long b, long long *negs, const int join, const int pos, const int avg) {
+  long long a, c, d, char_id, comp_id, pron_id, word = sen[sentence_position], last_word, l2, target, label, grad = 0;
+  int cw = 0, char_list_cnt = 0, comp_list_cnt = 0, pron_list_cnt = 0;
+  int char_unique = 0, comp_unique = 0, pron_unique = 0;
+  real *neuword = s->neuword, *neuword_grad = s->neuword_grad, *neuchar = s->neuchar, *neuchar_grad = s->neuchar_grad;
+  real *neucomp = s->neucomp, *neucomp_grad = s->neucomp_grad, *neupron = s->neupron, *neupron_grad = s->neupron_grad;
+  real *neuneg = s->neuneg, *neuneg_grad = s->neuneg_grad, *neuada = s->neuada, square = 0, *neg;
+  long long *char_id_list = s->char_id_list, *comp_id_list = s->comp_id_list, *pron_id_list = s->pron_id_list;
+  int *char_mult = s->char_mult, *comp_mult = s->comp_mult, *pron_mult = s->pron_mult;
+  struct det_log *dlog = s->dlog;
+  unsigned int rounding = s->rounding;
+  // the tables of m, in place of the globals
+  weight *synword = m->synword, *syn1neg = m->syn1neg, *synchar = m->synchar, *syncomp = m->syncomp, *synpron = m->synpron;
+  real *adaword = m->adaword, *adaneg = m->adaneg, *adachar = m->adachar, *adacomp = m->adacomp, *adapron = m->adapron;
+  // -hot-rows: the delta buffers of the configuration
+  struct hot_buffer *hotchar = NULL, *hotcomp = NULL, *hotpron = NULL;
+  if (s->hot != NULL) {
+    hotchar = &s->hot[(m - models) * 3];
+    hotcomp = hotchar + 1;
+    hotpron = hotchar + 2;
   }
-  if (syncomp != NULL){
-    free(syncomp);
+
+  // before forward backward propagation, initialize the neurons and gradients to 0
+  for (c = 0; c < layer1_size; c++) neuword[c] = 0;
+  for (c = 0; c < layer1_size; c++) neuword_grad[c] = 0;
+  for (c = 0; c < layer1_size; c++) neuchar[c] = 0;
+  for (c = 0; c < layer1_size; c++) neuchar_grad[c] = 0;
+  for (c = 0; c < layer1_size; c++) neucomp[c] = 0;
+  for (c = 0; c < layer1_size; c++) neucomp_grad[c] = 0;
+  for (c = 0; c < layer1_size; c++) neupron[c] = 0;
+  for (c = 0; c < layer1_size; c++) neupron_grad[c] = 0;
+
+  // in -> hidden         get contex sum vector
+  for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+    c = sentence_position - window + a;
+    if (c < 0) continue;
+    if (c >= sentence_length) continue;
+    last_word = sen[c];
+    if (last_word == -1) continue;
+
+    // context word sum
+    AccumulateRow(neuword, &synword[last_word * layer1_size]);
+
+    for (c = 0; c < vocab[last_word].character_size; c++) {
+      // context character sum
+      char_id = vocab[last_word].character[c];
+      AddSubword(char_id, char_id_list, char_mult, s->char_pos, &char_unique);
+      char_list_cnt++;
+      AccumulateRow(neuchar, &synchar[char_id * layer1_size]);
+
+      //use the surrounding characters' component information
+      for (d = 0; d < char2comp[char_id].comp_size; d++) {
+        comp_id = char2comp[char_id].comp[d];
+        AddSubword(comp_id, comp_id_list, comp_mult, s->comp_pos, &comp_unique);
+        comp_list_cnt++;
+        AccumulateRow(neucomp, &syncomp[comp_id * layer1_size]);
+      }
+    }
+    // printf("end use character and component.\n");
+    // fprintf(flog, "end use character and component.\n");
+
+    // context pronunciation sum
+    if (pos == 1 || pos == 3) {
+      for (d = 0; d < vocab[last_word].character_size; d++) {
+        pron_id = vocab[last_word].pronunciation[d];
+        AddSubword(pron_id, pron_id_list, pron_mult, s->pron_pos, &pron_unique);
+        pron_list_cnt++;
+        AccumulateRow(neupron, &synpron[pron_id * layer1_size]);
+      }
+    }
+    // printf("end use pronunciation.\n");
+    // fprintf(flog, "end use pronunciation.\n");
+
+    cw++;
   }
-  if (synpron != NULL) {
-    free(synpron);
+
+  // use the target character's pronunciation information
+  if (pos == 2 || pos == 3) {
+    last_word = sen[sentence_position];
+    for (d = 0; d < vocab[last_word].character_size; d++) {
+      pron_id = vocab[last_word].pronunciation[d];
+      AddSubword(pron_id, pron_id_list, pron_mult, s->pron_pos, &pron_unique);
+      pron_list_cnt++;
+      AccumulateRow(neupron, &synpron[pron_id * layer1_size]);
+    }
+  }
+  // printf("end use target pronunciation\n");
+   //fprintf(flog, "end use target pronunciation.\n");
+
+  if (cw) {
+    if (avg) {       // the context is represented by the average of the surrounding vectors
+      for (c = 0; c < layer1_size; c++) neuword[c] /= cw;
+      if (char_list_cnt > 0) for (c = 0; c < layer1_size; c++) neuchar[c] /= char_list_cnt;
+      if (comp_list_cnt > 0) for (c = 0; c < layer1_size; c++) neucomp[c] /= comp_list_cnt;
+      if (pron_list_cnt > 0) for (c = 0; c < layer1_size; c++) neupron[c] /= pron_list_cnt;
+    }
+    PROFILE_MARK(s, STAGE_CONTEXT);
+
+    // ******* NEGATIVE SAMPLING *******
+    if (negative > 0) for (d = 0; d < negative + 1; d++) {
+      // printf("begin negative sampling.\n");
+      if (d == 0) {
+        target = word;
+        label = 1;
+      }
+      else {
+        target = negs[d];
+        if (target == word) continue;
+        label = 0;
+      }
+      l2 = target * layer1_size;
+      neg = LoadRow(&syn1neg[l2], neuneg);
+
+      // back propagate      output  -->   hidden
+      if (join == 1)         // sum loss composition model
+        JoinSum(neuword, neuchar, neucomp, neupron, neuword_grad, neuchar_grad, neucomp_grad, neupron_grad,
+                neg, neuneg_grad, label);
+      else                   // average context composition model
+        JoinAverage(neuword, neuchar, neucomp, neupron, neuword_grad, neuchar_grad, neucomp_grad, neupron_grad,
+                    neg, neuneg_grad, label);
+      square = adagrad ? GradSquare(neuneg_grad) : 0;
+      if (dlog != NULL) DetUpdate(dlog, syn1neg, adaneg, target, DetGrad(dlog, neuneg_grad), square, 1);
+      else ApplyUpdate(syn1neg, adaneg, target, neuneg_grad, square, 1, neuada, rounding++);
+    } // end for negative
+    PROFILE_MARK(s, STAGE_NEGATIVE);
+
+
+    // printf("begin back propagation.\n");
+    // back propagate   hidden -> input
+    // the gradients of an average are shared by its elements
+    if (avg) {
+      real scale_word = 1.0 / cw,
+           scale_char = char_list_cnt > 0 ? 1.0 / char_list_cnt : 0,
+           scale_comp = comp_list_cnt > 0 ? 1.0 / comp_list_cnt : 0,
+           scale_pron = pron_list_cnt > 0 ? 1.0 / pron_list_cnt : 0;
+      for (c = 0; c < layer1_size; c++) {
+        neuword_grad[c] *= scale_word;
+        neuchar_grad[c] *= scale_char;
+        neucomp_grad[c] *= scale_comp;
+        neupron_grad[c] *= scale_pron;
+      }
+    }
+
+    // update word embedding
+    if (dlog != NULL) grad = DetGrad(dlog, neuword_grad);
+    square = adagrad ? GradSquare(neuword_grad) : 0;
+    for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+      c = sentence_position - window + a;
+      if (c < 0) continue;
+      if (c >= sentence_length) continue;
+      last_word = sen[c];
+      if (last_word == -1) continue;
+      if (dlog != NULL) DetUpdate(dlog, synword, adaword, last_word, grad, square, 1);
+      else ApplyUpdate(synword, adaword, last_word, neuword_grad, square, 1, neuada, rounding++);
+    }
+    // printf("update word.\n");
+    //fprintf(flog, "update word.\n");
+    PROFILE_MARK(s, STAGE_WORD);
+
+    // update character embedding, once for every distinct character of the window
+    if (dlog != NULL && char_list_cnt > 0) grad = DetGrad(dlog, neuchar_grad);
+    square = adagrad && char_list_cnt > 0 ? GradSquare(neuchar_grad) : 0;
+    for (a = 0; a < char_unique; a++){
+      char_id = char_id_list[a];
+      if (dlog != NULL) DetUpdate(dlog, synchar, adachar, char_id, grad, square, char_mult[a]);
+      else if (!HotUpdate(hotchar, char_id, neuchar_grad, square, char_mult[a]))
+        ApplyUpdate(synchar, adachar, char_id, neuchar_grad, square, char_mult[a], neuada, rounding++);
+    }
+    // printf("update character\n");
+    //fprintf(flog, "update character.\n");
+    PROFILE_MARK(s, STAGE_CHAR);
+
+    // update component embedding
+    if (dlog != NULL && comp_list_cnt > 0) grad = DetGrad(dlog, neucomp_grad);
+    square = adagrad && comp_list_cnt > 0 ? GradSquare(neucomp_grad) : 0;
+    for (a = 0; a < comp_unique; a++) {
+      comp_id = comp_id_list[a];
+      if (dlog != NULL) DetUpdate(dlog, syncomp, adacomp, comp_id, grad, square, comp_mult[a]);
+      else if (!HotUpdate(hotcomp, comp_id, neucomp_grad, square, comp_mult[a]))
+        ApplyUpdate(syncomp, adacomp, comp_id, neucomp_grad, square, comp_mult[a], neuada, rounding++);
+    }
+    // printf("update component.\n");
+    //fprintf(flog, "update component.\n");
+    PROFILE_MARK(s, STAGE_COMP);
+
+    // update pronunciation embedding
+    if (dlog != NULL && pron_list_cnt > 0) grad = DetGrad(dlog, neupron_grad);
+    square = adagrad && pron_list_cnt > 0 ? GradSquare(neupron_grad) : 0;
+    for (a = 0; a < pron_unique; a++) {
+      pron_id = pron_id_list[a];
+      if (dlog != NULL) DetUpdate(dlog, synpron, adapron, pron_id, grad, square, pron_mult[a]);
+      else if (!HotUpdate(hotpron, pron_id, neupron_grad, square, pron_mult[a]))
+        ApplyUpdate(synpron, adapron, pron_id, neupron_grad, square, pron_mult[a], neuada, rounding++);
+    }
+    // printf("update pronunciation\n");
+    //fprintf(flog, "update pronunciation.\n");
+    PROFILE_MARK(s, STAGE_PRON);
   }
+  for (a = 0; a < char_unique; a++) s->char_pos[char_id_list[a]] = -1;
+  for (a = 0; a < comp_unique; a++) s->comp_pos[comp_id_list[a]] = -1;
+  for (a = 0; a < pron_unique; a++) s->pron_pos[pron_id_list[a]] = -1;
+  s->rounding = rounding;
 }
 
+// The training step specialized for every join_type, pos_type and average_sum
+typedef void (*train_step)(struct train_state *, struct model *, long long *, long long, long long, long long, long long *);
+
+#define TRAIN_KERNEL(join, pos, avg) \
+  static void TrainTarget##join##pos##avg(struct train_state *s, struct model *m, long long *sen, \
+                                          long long sentence_length, long long sentence_position, long long b, \
+                                          long long *negs) { \
+    TrainTarget(s, m, sen, sentence_length, sentence_position, b, negs, join, pos, avg); \
+  }
+TRAIN_KERNEL(1, 1, 0) TRAIN_KERNEL(1, 1, 1) TRAIN_KERNEL(1, 2, 0) TRAIN_KERNEL(1, 2, 1) TRAIN_KERNEL(1, 3, 0) TRAIN_KERNEL(1, 3, 1)
+TRAIN_KERNEL(2, 1, 0) TRAIN_KERNEL(2, 1, 1) TRAIN_KERNEL(2, 2, 0) TRAIN_KERNEL(2, 2, 1) TRAIN_KERNEL(2, 3, 0) TRAIN_KERNEL(2, 3, 1)
+
+// indexed by [join_type - 1][pos_type - 1][average_sum == 1]
+train_step train_kernels[2][3][2] = {
+  {{TrainTarget110, TrainTarget111}, {TrainTarget120, TrainTarget121}, {TrainTarget130, TrainTarget131}},
+  {{TrainTarget210, TrainTarget211}, {TrainTarget220, TrainTarget221}, {TrainTarget230, TrainTarget231}},
+};
+
 void *TrainModelThread(void *id) {
-  long long a, b, c, d, e;
-
-  long long char_id, comp_id, pron_id, word, last_word, sentence_length = 0, sentence_position = 0;
-  long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-  long long l1, l2,  target, label, local_iter = iter;
-  long long *char_id_list = calloc(MAX_SENTENCE_LENGTH, sizeof(long long));
-  long long *comp_id_list = calloc(MAX_SENTENCE_LENGTH, sizeof(long long));
-  long long *pron_id_list = calloc(MAX_SENTENCE_LENGTH, sizeof(long long));
-  int char_list_cnt = 0, comp_list_cnt = 0, pron_list_cnt = 0;
+  long long a, b, c, d;
+
+  long long word, sentence_length = 0, sentence_position = 0;
+  long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1], first;
+  long long local_iter = iter;
   unsigned long long next_random = (long long)id;
   clock_t now;
-  real *neuword = (real *)calloc(layer1_size, sizeof(real));
-  real *neuword_grad = (real *)calloc(layer1_size,sizeof(real));
-  real *neuchar = (real *)calloc(layer1_size,sizeof(real));
-  real *neuchar_grad = (real *)calloc(layer1_size,sizeof(real));
-  real *neucomp = (real *)calloc(layer1_size,sizeof(real));
-  real *neucomp_grad = (real *)calloc(layer1_size,sizeof(real));
-  real *neupron = (real *)calloc(layer1_size, sizeof(real));
-  real *neupron_grad = (real *)calloc(layer1_size, sizeof(real));
-
-  FILE *fi = fopen(train_file, "rb");
-  if (fi == NULL){
+  // -deterministic: the random stream of the sentence, the update log, and the end of the lines of the thread
+  struct philox sentence_rng, *rng = NULL;
+  struct det_log *dlog = NULL;
+  long long sentence_start = 0, chunk_end = 0, block_words = 0, block = 0;
+  int done = 0;
+  // the window and negative samples of the current and of the next target word
+  long long b_next = 0, *negs = calloc(negative + 1, sizeof(long long)), *negs_next = calloc(negative + 1, sizeof(long long)), *swap;
+  int ahead = 0;
+  // -readers: the ring of the thread
+  struct sentence_ring *ring = readers > 0 ? &rings[(long long)id] : NULL;
+  int epoch_end = 0;
+  // -hot-rows: target words since the last merge of the delta buffers
+  long long hot_words = 0;
+  struct train_state state;
+  struct model *m;
+  state.neuword = (real *)calloc(layer1_size, sizeof(real));
+  state.neuword_grad = (real *)calloc(layer1_size, sizeof(real));
+  state.neuchar = (real *)calloc(layer1_size, sizeof(real));
+  state.neuchar_grad = (real *)calloc(layer1_size, sizeof(real));
+  state.neucomp = (real *)calloc(layer1_size, sizeof(real));
+  state.neucomp_grad = (real *)calloc(layer1_size, sizeof(real));
+  state.neupron = (real *)calloc(layer1_size, sizeof(real));
+  state.neupron_grad = (real *)calloc(layer1_size, sizeof(real));
+  state.neuneg = (real *)calloc(layer1_size, sizeof(real));
+  state.neuneg_grad = (real *)calloc(layer1_size, sizeof(real));
+  state.neuada = (real *)calloc(layer1_size, sizeof(real));
+  state.char_id_list = calloc(MAX_SENTENCE_LENGTH, sizeof(long long));
+  state.comp_id_list = calloc(MAX_SENTENCE_LENGTH, sizeof(long long));
+  state.pron_id_list = calloc(MAX_SENTENCE_LENGTH, sizeof(long long));
+  state.char_mult = calloc(MAX_SENTENCE_LENGTH, sizeof(int));
+  state.comp_mult = calloc(MAX_SENTENCE_LENGTH, sizeof(int));
+  state.pron_mult = calloc(MAX_SENTENCE_LENGTH, sizeof(int));
+  state.char_pos = malloc(char_size * sizeof(int));
+  state.comp_pos = malloc(comp_size * sizeof(int));
+  state.pron_pos = malloc(pron_size * sizeof(int));
+  for (a = 0; a < char_size; a++) state.char_pos[a] = -1;
+  for (a = 0; a < comp_size; a++) state.comp_pos[a] = -1;
+  for (a = 0; a < pron_size; a++) state.pron_pos[a] = -1;
+  state.dlog = NULL;
+  state.rounding = (unsigned int)(long long)id * 0x9E3779B9u;
+  state.hot = NULL;
+  if (hot_rows > 0) {
+    state.hot = (struct hot_buffer *)malloc(model_count * 3 * sizeof(struct hot_buffer));
+    if (state.hot == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    for (a = 0; a < model_count; a++) {
+      InitHotBuffer(&state.hot[a * 3], &hot[0], models[a].synchar, models[a].adachar);
+      InitHotBuffer(&state.hot[a * 3 + 1], &hot[1], models[a].syncomp, models[a].adacomp);
+      InitHotBuffer(&state.hot[a * 3 + 2], &hot[2], models[a].synpron, models[a].adapron);
+    }
+  }
+#ifdef PCWE_PROFILE
+  state.profile = profile_every > 0 ? &profiles[(long long)id] : NULL;
+  state.profile_count = state.profiling = 0;
+#endif
+
+  FILE *fi = ring != NULL ? NULL : CorpusOpen(train_file);
+  if (ring == NULL && fi == NULL){
     fprintf(stderr, "no such file or directory: %s", train_file);
     exit(1);
   }
-  fseek(fi,file_size / (long long) num_threads * (long long)id, SEEK_SET);
+  if (seed) {
+    rng = &sentence_rng;
+    dlog = state.dlog = &det_logs[(long long)id];
+    chunk_end = chunk_start[(long long)id + 1];
+    fseek(fi, chunk_start[(long long)id], SEEK_SET);
+  } else if (ring == NULL) fseek(fi, ThreadOffset((long long)id), SEEK_SET);
 
 
   //FILE *flog = fopen("./log", "wb");
@@ -571,7 +2926,14 @@ void *TrainModelThread(void *id) {
 
   while (1) {
     //decay learning rate and print training progress
-    if(word_count - last_word_count > 10000){
+    if (dlog != NULL) {
+      if (block_words >= DET_BLOCK || done) {
+        if (DetSync((long long)id, word_count - last_word_count, done, block++)) break;
+        last_word_count = word_count;
+        block_words = 0;
+        if (done) continue;
+      }
+    } else if(word_count - last_word_count > 10000){
       word_count_actual += word_count - last_word_count;
       last_word_count = word_count;
       if ((debug_mode > 1)) {
@@ -585,350 +2947,208 @@ void *TrainModelThread(void *id) {
       if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
     }
     // read a word sentence
-    if (sentence_length == 0){
-      while (1){
+    if (sentence_length == 0 && ring != NULL) {
+      PROFILE_BEGIN(&state);
+      epoch_end = PopSentence(ring, sen, &sentence_length, &word_count);
+      sentence_position = 0;
+      ahead = 0;
+      PROFILE_END(&state, STAGE_READ);
+    } else if (sentence_length == 0){
+      PROFILE_BEGIN(&state);
+      if (rng != NULL) {
+        sentence_start = ftell(fi);
+        PhiloxInit(rng, seed, sentence_start, iter - local_iter);
+      }
+      first = 0;
+      while (dlog == NULL || sentence_start < chunk_end){
         word = ReadWordIndex(fi);
         if (feof(fi)) break;
         if (word == -1) continue;
         word_count++;
         if (word == 0) break;
-        // the subsampling randomly discards frequent words while keeping the ranking same
-        if (sample > 0) {
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
-          next_random = next_random * (unsigned long long) 25214903917 + 11;
-          if (ran < (next_random & 0xFFFF) / (real)65536) continue;
-        }
         sen[sentence_length] = word;
         sentence_length++;
-        if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+        // the subsampling randomly discards frequent words while keeping the ranking same;
+        // it runs on the words read since the last pass, and the sentence is full once
+        // MAX_SENTENCE_LENGTH words are kept
+        if (sentence_length >= MAX_SENTENCE_LENGTH) {
+          if (sample > 0) sentence_length = first + SubsampleWords(&sen[first], sentence_length - first, &next_random, rng);
+          first = sentence_length;
+          if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+        }
       }
+      if (sample > 0) sentence_length = first + SubsampleWords(&sen[first], sentence_length - first, &next_random, rng);
       sentence_position = 0;
+      ahead = 0;
+      PROFILE_END(&state, STAGE_READ);
     }
     //if (feof(fi)) break;
     //if (word_count > train_words / num_threads) break;
-    if (feof(fi) || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
+    if (ring != NULL ? epoch_end : feof(fi) || (dlog != NULL ? sentence_start >= chunk_end : word_count > train_words / num_threads)) {
+      if (dlog != NULL) det_words[(long long)id] += word_count - last_word_count;
+      else word_count_actual += word_count - last_word_count;
       local_iter--;
-      if (local_iter == 0) break;
+      if (local_iter == 0) {
+        if (dlog == NULL) break;
+        last_word_count = word_count;   // counted above, not again by DetSync
+        done = 1;   // takes part in the remaining blocks of the other threads
+        continue;
+      }
       word_count = 0;
       last_word_count = 0;
       sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+      epoch_end = 0;
+      if (dlog != NULL) fseek(fi, chunk_start[(long long)id], SEEK_SET);
+      else if (ring == NULL) fseek(fi, ThreadOffset((long long)id), SEEK_SET);
       continue;
     }
 
     word = sen[sentence_position];
     if (word == -1) continue;
-
-    // train the cbow model
-    // before forward backward propagation, initialize the neurons and gradients to 0
-    for (c = 0; c < layer1_size; c++) neuword[c] = 0;
-    for (c = 0; c < layer1_size; c++) neuword_grad[c] = 0;
-    for (c = 0; c < layer1_size; c++) neuchar[c] = 0;
-    for (c = 0; c < layer1_size; c++) neuchar_grad[c] = 0;
-    for (c = 0; c < layer1_size; c++) neucomp[c] = 0;
-    for (c = 0; c < layer1_size; c++) neucomp_grad[c] = 0;
-    for (c = 0; c < layer1_size; c++) neupron[c] = 0;
-    for (c = 0; c < layer1_size; c++) neupron_grad[c] = 0;
-
-
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    b = next_random % window;  //[0, window-1]
-
-    char_list_cnt = 0;
-    comp_list_cnt = 0;
-    pron_list_cnt = 0;
-    int cw = 0;
-
-    // in -> hidden         get contex sum vector
-    for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-      c = sentence_position - window + a;
-      if (c < 0) continue;
-      if (c >= sentence_length) continue;
-      last_word = sen[c];
-      if (last_word == -1) continue;
-
-      // context word sum
-      for (c = 0; c < layer1_size; c++)
-        neuword[c] += synword[c + last_word * layer1_size];
-
-      for (c = 0; c < vocab[last_word].character_size; c++) {
-        // context character sum
-        char_id = vocab[last_word].character[c];
-        char_id_list[char_list_cnt++] = char_id;
-        for (d = 0; d < layer1_size; d++)
-          neuchar[d] += synchar[d + char_id * layer1_size];
-
-        //use the surrounding characters' component information
-        for (d = 0; d < char2comp[char_id].comp_size; d++) {
-          comp_id = char2comp[char_id].comp[d];
-          comp_id_list[comp_list_cnt++] = comp_id;
-          for (e = 0; e < layer1_size; e++)
-            neucomp[e] += syncomp[e + comp_id * layer1_size];
-        }
-      }
-      // printf("end use character and component.\n");
-      // fprintf(flog, "end use character and component.\n");
-
-      // context pronunciation sum
-      if (pos_type == 1 || pos_type == 3) {
-        for (d = 0; d < vocab[last_word].character_size; d++) {
-          pron_id = vocab[last_word].pronunciation[d];
-          pron_id_list[pron_list_cnt++] = pron_id;
-          for (c = 0; c < layer1_size;  c++)
-            neupron[c] += synpron[c + pron_id * layer1_size];
+    PROFILE_TARGET(&state);
+
+    // the random numbers of the next target word of the sentence are drawn while this
+    // one trains (in the same order as without drawing ahead), so that its rows and
+    // those of its negative samples can be prefetched
+    if (ahead) {
+      b = b_next;
+      swap = negs;
+      negs = negs_next;
+      negs_next = swap;
+    } else next_random = DrawTarget(next_random, rng, &b, negs, sentence_length > 1);
+    ahead = sentence_position + 1 < sentence_length;
+    if (ahead) {
+      next_random = DrawTarget(next_random, rng, &b_next, negs_next, 1);
+      if (prefetch) {
+        // context words that are not read for this target, and the output rows
+        for (m = models; m < models + model_count; m++) {
+          for (a = b_next; a < window * 2 + 1 - b_next; a++) if (a != window) {
+            c = sentence_position + 1 - window + a;
+            if (c < 0 || c >= sentence_length) continue;
+            if (c == sentence_position || c < sentence_position - window + b || c > sentence_position + window - b)
+              PrefetchContext(m, sen[c]);
+          }
+          PrefetchRow(&m->syn1neg[sen[sentence_position + 1] * layer1_size]);
+          for (d = 1; d <= negative; d++) PrefetchRow(&m->syn1neg[negs_next[d] * layer1_size]);
         }
       }
-      // printf("end use pronunciation.\n");
-      // fprintf(flog, "end use pronunciation.\n");
-
-      cw++;
-    }
-
-    // use the target character's pronunciation information
-    if (pos_type == 2 || pos_type == 3) {
-      last_word = sen[sentence_position];
-      for (d = 0; d < vocab[last_word].character_size; d++) {
-        pron_id = vocab[last_word].pronunciation[d];
-        pron_id_list[pron_list_cnt++] = pron_id;
-        for (c = 0; c < layer1_size;  c++)
-          neupron[c] += synpron[c + pron_id * layer1_size];
-      }
     }
-    // printf("end use target pronunciation\n");
-     //fprintf(flog, "end use target pronunciation.\n");
-
-    if (cw) {
-      if (average_sum == 1) {       // the context is represented by the average of the surrounding vectors
-        for (c = 0; c < layer1_size; c++) {
-          neuword[c] /= cw;
-          if (char_list_cnt > 0)
-            neuchar[c] /= char_list_cnt;
-          if (comp_list_cnt > 0)
-            neucomp[c] /= comp_list_cnt;
-          if (pron_list_cnt > 0)
-            neupron[c] /= pron_list_cnt;
-        }
-      }
-
-      // ******* NEGATIVE SAMPLING *******
-      if (negative > 0) for (d = 0; d < negative + 1; d++) {
-        // printf("begin negative sampling.\n");
-        if (d == 0) {
-          target = word;
-          label = 1;
-        }
-        else {
-          next_random = next_random * (unsigned long long)25214903917 + 11;
-          target = table[(next_random >> 16) % table_size];
-          if (target == 0) target = next_random % (vocab_size - 1) + 1;  // if sample "</s>", randomly resample
-          if (target == word) continue;
-          label = 0;
-        }
-        l2 = target * layer1_size;
-
-        // back propagate      output  -->   hidden
-        if (join_type == 1) {    // sum loss composition model
-          real f1 = 0, f2 = 0, f3 = 0, f4 = 0, g1 = 0, g2 = 0, g3 = 0, g4 = 0;
-          for (c = 0; c < layer1_size; c++) {
-            f1 += neuword[c] * syn1neg[c + l2];
-            f2 += neuchar[c] * syn1neg[c + l2];
-            f3 += neucomp[c] * syn1neg[c + l2];
-            f4 += neupron[c] * syn1neg[c + l2];
-          }
-          if (f1 > MAX_EXP)
-            g1 = (label - 1) * alpha;
-          else if (f1 < -MAX_EXP)
-            g1 = (label - 0) * alpha;
-          else {
-            int idx = (int)((f1 + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2));
-            if (idx < 0) idx = 0;
-            if (idx > EXP_TABLE_SIZE) idx = EXP_TABLE_SIZE;
-            g1 = (label - expTable[idx]) * alpha;
-          }
-          if (f2 > MAX_EXP)
-            g2 = (label - 1) * alpha;
-          else if (f2 < -MAX_EXP)
-            g2 = (label - 0) * alpha;
-          else{
-            int idx = (int)((f2 + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2));
-            if (idx < 0) idx = 0;
-            if (idx > EXP_TABLE_SIZE) idx = EXP_TABLE_SIZE;
-            g2 = (label - expTable[idx]) * alpha;
-          }
-          if (f3 > MAX_EXP)
-            g3 = (label - 1) * alpha;
-          else if (f3 < -MAX_EXP)
-            g3 = (label - 0) * alpha;
-          else {
-            int idx = (int)((f3 + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2));
-            if (idx < 0) idx = 0;
-            if (idx > EXP_TABLE_SIZE) idx = EXP_TABLE_SIZE;
-            g3 = (label - expTable[idx]) * alpha;
-          }
-          if (f4 > MAX_EXP)
-            g4 = (label - 1) * alpha;
-          else if (f4 < -MAX_EXP)
-            g4 = (label - 0) * alpha;
-          else {
-            int idx = (int)((f4 + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2));
-            if (idx < 0) idx = 0;
-            if (idx > EXP_TABLE_SIZE) idx = EXP_TABLE_SIZE;
-            g4 = (label - expTable[idx]) * alpha;
-          }
-
-
-          // compute the gradients of neurons
-          for (c = 0; c < layer1_size; c++) {
-            neuword_grad[c] += g1 * syn1neg[c + l2];
-            neuchar_grad[c] += g2 * syn1neg[c + l2];
-            neucomp_grad[c] += g3 * syn1neg[c + l2];
-            neupron_grad[c] += g4 * syn1neg[c + l2];
-          }
-
-          //update syn1neg
-          for (c = 0; c < layer1_size; c++)
-            syn1neg[c + l2] += g1 * neuword[c] + g2 * neuchar[c] + g3 * neucomp[c] + g4 * neupron[c];
-        }
-        else if (join_type == 2) { // average context composition model
-          real f = 0, g = 0;
-
-          for (c = 0; c < layer1_size; c++)
-            f += (neuword[c] + neuchar[c] + neucomp[c] + neupron[c]) * syn1neg[c + l2];
-
-          if (f > MAX_EXP)
-            g = (label - 1) * alpha;
-          else if (f < -MAX_EXP)
-            g = (label - 0) * alpha;
-          else {
-            int idx = (int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2));
-            if (idx < 0) idx = 0;
-            if (idx > EXP_TABLE_SIZE) idx = EXP_TABLE_SIZE;
-            g = (label - expTable[idx]) * alpha;
-          }
 
-          for (c = 0; c < layer1_size; c++) {
-            neuword_grad[c] += g * syn1neg[c + l2];
-            neucomp_grad[c] += g * syn1neg[c + l2];
-            neuchar_grad[c] += g * syn1neg[c + l2];
-            neupron_grad[c] += g * syn1neg[c + l2];
-          }
+    PROFILE_MARK(&state, STAGE_DRAW);
 
-          for (c = 0; c < layer1_size; c++)
-            syn1neg[c + l2] += g * (neuword[c] + neuchar[c] + neucomp[c] + neupron[c]);
-        } // end joint-type-2
-      } // end for negative
-
-
-      // printf("begin back propagation.\n");
-      // back propagate   hidden -> input
-      // update word embedding
-      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-        c = sentence_position - window + a;
-        if (c < 0) continue;
-        if (c >= sentence_length) continue;
-        last_word = sen[c];
-        if (last_word == -1) continue;
-        for (c = 0; c < layer1_size; c++){
-          if (average_sum == 1)
-            synword[c + last_word * layer1_size] += neuword_grad[c] / cw;
-          else
-            synword[c + last_word * layer1_size] += neuword_grad[c];
-        }
-      }
-      // printf("update word.\n");
-      //fprintf(flog, "update word.\n");
-
-      // update character embedding
-      for (a = 0; a < char_list_cnt; a++){
-        char_id = char_id_list[a];
-        for (c = 0; c < layer1_size; c++){
-          if (average_sum == 1)
-            synchar[c + char_id * layer1_size] += neuchar_grad[c] / char_list_cnt;
-          else
-            synchar[c + char_id * layer1_size] += neuchar_grad[c];
-        }
-      }
-      // printf("update character\n");
-      //fprintf(flog, "update character.\n");
-
-      // update component embedding
-      for (a = 0; a < comp_list_cnt; a++) {
-        comp_id = comp_id_list[a];
-        for (c = 0; c < layer1_size; c++){
-          if (average_sum == 1)
-            syncomp[c + comp_id * layer1_size] += neucomp_grad[c] / comp_list_cnt;
-          else
-            syncomp[c + comp_id * layer1_size] += neucomp_grad[c];
-        }
-      }
-      // printf("update component.\n");
-      //fprintf(flog, "update component.\n");
-
-      // update pronunciation embedding
-      for (a = 0; a < pron_list_cnt; a++) {
-        pron_id = pron_id_list[a];
-        for (c = 0; c < layer1_size; c++) {
-          if (average_sum == 1)
-            synpron[c + pron_id * layer1_size] += neupron_grad[c] / pron_list_cnt;
-          else
-            synpron[c + pron_id * layer1_size] += neupron_grad[c];
-        }
-      }
-      // printf("update pronunciation\n");
-      //fprintf(flog, "update pronunciation.\n");
-    } // end if (cw)
+    // train the cbow model of every configuration
+    for (m = models; m < models + model_count; m++)
+      m->kernel(&state, m, sen, sentence_length, sentence_position, b, negs);
+    if (state.hot != NULL && ++hot_words >= hot_sync) {
+      for (a = 0; a < model_count * 3; a++) MergeHot(&state.hot[a], &state.rounding);
+      hot_words = 0;
+    }
 
     sentence_position++;
+    block_words++;
     if (sentence_position >= sentence_length){
       sentence_length = 0;
       continue;
     }
   } // end while(1)
 
-  fclose(fi);
+  if (state.hot != NULL) {
+    for (a = 0; a < model_count * 3; a++) {
+      MergeHot(&state.hot[a], &state.rounding);
+      DestroyHotBuffer(&state.hot[a]);
+    }
+    free(state.hot);
+  }
+  if (fi != NULL) fclose(fi);
   //fclose(flog);
-  free(neuword);
-  free(neuword_grad);
-  free(neuchar);
-  free(neuchar_grad);
-  free(neucomp);
-  free(neucomp_grad);
-  free(neupron);
-  free(neupron_grad);
-  free(char_id_list);
-  free(comp_id_list);
-  free(pron_id_list);
+  free(state.neuword);
+  free(state.neuword_grad);
+  free(state.neuchar);
+  free(state.neuchar_grad);
+  free(state.neucomp);
+  free(state.neucomp_grad);
+  free(state.neupron);
+  free(state.neupron_grad);
+  free(state.neuneg);
+  free(state.neuneg_grad);
+  free(state.neuada);
+  free(state.char_id_list);
+  free(state.comp_id_list);
+  free(state.pron_id_list);
+  free(state.char_mult);
+  free(state.comp_mult);
+  free(state.pron_mult);
+  free(state.char_pos);
+  free(state.comp_pos);
+  free(state.pron_pos);
+  free(negs);
+  free(negs_next);
+  __atomic_sub_fetch(&running_threads, 1, __ATOMIC_RELEASE);
   pthread_exit(NULL);
 }
 
 
-void TrainModel(){
-  long a, b, c, d;
-  FILE *fo;
-  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-  if (pt == NULL){
-    fprintf(stderr, "cannot allocate memory for threads\n");
-    exit(1);
-  }
-  printf("Starting training using file %s \n", train_file);
-  starting_alpha = alpha;
-  LearnVocabFromTrainFile();
-  ReadComponent();
-  LearnCharComponentsFromFile();
-  ReadPronunciation();
-  LearnWord2PronFromFile();
-  if (CheckPron()) {
-    exit(1);
+// Writes row a of syn to an output file, as text or binary (-binary)
+void WriteRow(FILE *fo, weight *syn, long long a, real *row) {
+  long long b;
+  if (binary)
+    fwrite(LoadRow(&syn[a * layer1_size], row), sizeof(real), layer1_size, fo);
+  else
+    for (b = 0; b < layer1_size; b++) fprintf(fo, "%lf ", ToReal(syn[a * layer1_size + b]));
+  fprintf(fo, "\n");
+}
+
+// Writes the int8 (<file>.q8) and product quantized (<file>.pq) versions of a table
+void QuantizeTable(weight *syn, long long rows, char **words, char *file) {
+  char name[MAX_STRING + 8];
+  long long a;
+  real *vec = (real *)syn;
+  struct quant_table q;
+  if (file[0] == 0 || rows == 0) return;
+  if (sizeof(weight) != sizeof(real)) {
+    vec = (real *)malloc(rows * layer1_size * sizeof(real));
+    if (vec == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    for (a = 0; a < rows; a++) LoadRow(&syn[a * layer1_size], &vec[a * layer1_size]); // widens into vec
   }
+  QuantInt8(&q, vec, rows, layer1_size, words);
+  sprintf(name, "%s.q8", file);
+  if (QuantSave(&q, name)) fprintf(stderr, "Cannot open %s: permission denied\n", name);
+  QuantFree(&q);
+  QuantPq(&q, vec, rows, layer1_size, words, pq_m > 0 ? pq_m : (layer1_size + 1) / 2, 25);
+  sprintf(name, "%s.pq", file);
+  if (QuantSave(&q, name)) fprintf(stderr, "Cannot open %s: permission denied\n", name);
+  QuantFree(&q);
+  if (vec != (real *)syn) free(vec);
+}
 
-  InitNet();
-  if (negative > 0) InitUnigramTable();
-  start = clock();
-  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+void QuantizeTables() {
+  long long a, size = vocab_size;
+  char **words, *chars;
+  if (char_size > size) size = char_size;
+  if (comp_size > size) size = comp_size;
+  if (pron_size > size) size = pron_size;
+  words = (char **)malloc((size + 1) * sizeof(char *));
+  chars = (char *)malloc((char_size + 1) * 5);
+  for (a = 0; a < vocab_size; a++) words[a] = vocab[a].word;
+  QuantizeTable(synword, vocab_size, words, output_word);
+  for (a = 0; a < char_size; a++) {
+    words[a] = &chars[a * 5];
+    PutUnicode(char_unicode[a], words[a]);
+  }
+  QuantizeTable(synchar, char_size, words, output_char);
+  for (a = 0; a < comp_size; a++) words[a] = comp_array[a].comp_str;
+  QuantizeTable(syncomp, comp_size, words, output_comp);
+  for (a = 0; a < pron_size; a++) words[a] = pron_array[a].pron_str;
+  QuantizeTable(synpron, pron_size, words, output_pron);
+  free(chars);
+  free(words);
+}
 
-  // save the word vectors
+// Writes the word, character, component and pronunciation vectors
+void SaveVectors() {
+  long a;
+  FILE *fo;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
   fo = fopen(output_word, "wb");
   if (fo == NULL) {
     fprintf(stderr, "Cannot open %s: permission denied\n", output_word);
@@ -938,11 +3158,7 @@ void TrainModel(){
   for (a = 0; a < vocab_size; a++) {
     if (vocab[a].word != NULL)
       fprintf(fo, "%s ", vocab[a].word);
-    if (binary)
-      for (b = 0; b < layer1_size; b++) fwrite(&synword[a * layer1_size + b], sizeof(real), 1, fo);
-    else
-      for (b = 0; b < layer1_size; b++) fprintf(fo, "%lf ", synword[a * layer1_size + b]);
-    fprintf(fo, "\n");
+    WriteRow(fo, synword, a, row);
   }
   fclose(fo);
   wchar_t ch[10];
@@ -951,16 +3167,12 @@ void TrainModel(){
     if (fo == NULL){
       fprintf(stderr, "Cannot open %s: permission denied\n", output_char);
     }
-    fprintf(fo, "%lld %lld\n", CHAR_SIZE, layer1_size);
-    for (a = 0; a < CHAR_SIZE; a++){
-      ch[0] = MIN_CHINESE + a;
+    fprintf(fo, "%lld %lld\n", char_size, layer1_size);
+    for (a = 0; a < char_size; a++){
+      ch[0] = char_unicode[a];
       ch[1] = 0;
       fprintf(fo, "%ls\t", ch);
-      if (binary)
-        for (b = 0; b < layer1_size; b++) fwrite(&synchar[a * layer1_size + b], sizeof(real), 1, fo);
-      else
-        for (b = 0; b < layer1_size; b++) fprintf(fo, "%lf ", synchar[a * layer1_size + b]);
-      fprintf(fo, "\n");
+      WriteRow(fo, synchar, a, row);
     }
     fclose(fo);
   }
@@ -972,11 +3184,7 @@ void TrainModel(){
     fprintf(fo, "%lld %lld\n", comp_size, layer1_size);
     for(a = 0; a < comp_size; a++){
       fprintf(fo, "%s ", comp_array[a].comp_str);
-      if (binary)
-        for (b = 0; b < layer1_size; b++) fwrite(&syncomp[a * layer1_size + b], sizeof(real), 1, fo);
-      else
-        for (b = 0; b < layer1_size; b++) fprintf(fo, "%lf ", syncomp[a * layer1_size + b]);
-      fprintf(fo, "\n");
+      WriteRow(fo, syncomp, a, row);
     }
     fclose(fo);
   }
@@ -989,16 +3197,175 @@ void TrainModel(){
   fprintf(fo, "%d %lld\n", pron_size, layer1_size);
   for (a = 0; a < pron_size; a++) {
     fprintf(fo, "%s ", pron_array[a].pron_str);
-    if (binary)
-      for (b = 0; b < layer1_size; b++) fwrite(&synpron[a * layer1_size + b], sizeof(real), 1, fo);
-    else
-      for (b = 0; b < layer1_size; b++) fprintf(fo, "%lf ", synpron[a * layer1_size + b]);
-    fprintf(fo, "\n");
+    WriteRow(fo, synpron, a, row);
   }
   fclose(fo);
+  free(row);
+}
+
+// Writes the homophone index of the words with a pronunciation; the pronunciations are
+// the rows of -output-pron, the words those of -output-word
+void SaveHomophones() {
+  long long a, n = 0;
+  struct homophone_index h;
+  char **words = (char **)malloc((vocab_size + 1) * sizeof(char *)), **prons = (char **)malloc((pron_size + 1) * sizeof(char *));
+  long long *ids = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+  int **keys = (int **)malloc((vocab_size + 1) * sizeof(int *)), *lengths = (int *)malloc((vocab_size + 1) * sizeof(int));
+  for (a = 0; a < vocab_size; a++) if (vocab[a].pronunciation != NULL && vocab[a].character_size > 0) {
+    words[n] = vocab[a].word;
+    ids[n] = a;
+    keys[n] = vocab[a].pronunciation;
+    lengths[n++] = vocab[a].character_size;
+  }
+  for (a = 0; a < pron_size; a++) prons[a] = pron_array[a].pron_str;
+  HomophoneBuild(&h, n, words, ids, keys, lengths, pron_size, prons);
+  if (HomophoneSave(&h, output_homophone) != 0) {
+    fprintf(stderr, "Cannot write %s\n", output_homophone);
+    exit(1);
+  }
+  if (debug_mode > 0) printf("Homophone index: %lld words, %lld syllables\n", h.words, h.syllables);
+  HomophoneFree(&h);
+  free(words);
+  free(prons);
+  free(ids);
+  free(keys);
+  free(lengths);
+}
+
+void TrainModel(){
+  long a;
+  pthread_t pager;
+#ifdef PCWE_PROFILE
+  unsigned long long ticks;
+#endif
+  struct timeval begin, end;
+  double seconds, busy = 0, wait = 0;
+  pthread_t *pt = (pthread_t *)malloc((num_threads + readers) * sizeof(pthread_t));
+  if (pt == NULL){
+    fprintf(stderr, "cannot allocate memory for threads\n");
+    exit(1);
+  }
+  printf("Starting training using file %s \n", train_file);
+  if (debug_mode > 0) printf("Embedding storage: %s\n", STORAGE_NAME);
+  starting_alpha = alpha;
+  LearnVocabFromTrainFile();
+  // every thread decompresses its part from the start of the frame it begins in
+  if (CorpusFrames(train_file) >= 0 && CorpusFrames(train_file) < (long long)num_threads * dist_size)
+    printf("Warning: %lld frames in %s for %lld threads, compress it in more parts to decompress them in parallel\n",
+           CorpusFrames(train_file), train_file, (long long)num_threads * dist_size);
+  BuildCharTable();
+  ReadComponent();
+  LearnCharComponentsFromFile();
+  ReduceComponent();
+  ReadPronunciation();
+  LearnWord2PronFromFile();
+  if (CheckPron()) {
+    exit(1);
+  }
+  ReducePronunciation();
 
+  if (dist_size > 1) {
+    if (seed) printf("-deterministic is not used with -dist-size\n");
+    seed = 0;
+    InitDist();
+  }
+  if (seed) {
+    if (debug_mode > 0) printf("Deterministic training, seed %llu\n", seed);
+    PhiloxInit(&init_rng, seed, 0, 0xFFFFFFFFu);
+    InitChunks();
+    det_logs = (struct det_log *)calloc(num_threads, sizeof(struct det_log));
+    det_words = (long long *)calloc(num_threads, sizeof(long long));
+    det_done = (int *)calloc(num_threads, sizeof(int));
+    if (readers > 0) printf("-readers is not used with -deterministic\n");
+    readers = 0;
+    if (hot_rows > 0) printf("-hot-rows is not used with -deterministic\n");
+    hot_rows = 0;
+  }
+  if (sweep[0] != 0 && table_dir[0] != 0) {
+    printf("-table-dir is not used with -sweep\n");
+    table_dir[0] = 0;
+  }
+  InitNet();
+  if (load_model_file[0] != 0) LoadModel();
+  if (negative > 0) InitUnigramTable();
+  if (sample > 0) InitSubsampling();
+  InitModels();
+  for (a = 0; a < model_count; a++)
+    models[a].kernel = train_kernels[models[a].join_type - 1][models[a].pos_type - 1][models[a].average_sum == 1];
+  if (hot_rows > 0) InitHotRows();
+  start = clock();
+  if (readers > 0) InitReaders();
+#ifdef PCWE_PROFILE
+  if (profile_every > 0) {
+    if (posix_memalign((void **)&profiles, 64, num_threads * sizeof(struct profile)) != 0) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    memset(profiles, 0, num_threads * sizeof(struct profile));
+  }
+  ticks = Ticks();
+#else
+  if (profile_every > 0) printf("-profile is not used without make PROFILE=1\n");
+#endif
+  gettimeofday(&begin, NULL);
+  for (a = 0; a < readers; a++) pthread_create(&pt[num_threads + a], NULL, ReaderThread, (void *)a);
+  running_threads = num_threads;
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+  if (table_dir[0] != 0) pthread_create(&pager, NULL, PagerThread, NULL);
+  if (dist_size > 1) DistTrain(pt);
+  else for (a = 0; a < num_threads + readers; a++) pthread_join(pt[a], NULL);
+  if (table_dir[0] != 0) pthread_join(pager, NULL);
+  gettimeofday(&end, NULL);
+  seconds = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1e6;
+  if (debug_mode > 0)
+    printf("\nTraining time: %.2f s, %.2fk words/sec\n", seconds, iter * train_words / (seconds + 1e-9) / 1000);
+#ifdef PCWE_PROFILE
+  ticks = Ticks() - ticks;
+  if (profile_every > 0) {
+    ProfileReport(seconds, ticks);
+    free(profiles);
+  }
+#endif
+  if (table_dir[0] != 0 && debug_mode > 0) {
+    if (table_memory > 0) printf("Word tables: at most %.1f MB resident of a budget of %lld MB, %.1f MB paged out\n",
+                                 resident_peak / 1048576.0, table_memory, paged_out / 1048576.0);
+    else printf("Word tables: at most %.1f MB resident\n", resident_peak / 1048576.0);
+  }
+  if (readers > 0) {
+    // utilization of the two stages, to balance -readers and -threads
+    for (a = 0; a < readers; a++) busy += reader_busy[a];
+    for (a = 0; a < num_threads; a++) wait += rings[a].wait;
+    if (debug_mode > 0)
+      printf("Readers busy: %.1f%%, training threads waiting for sentences: %.1f%%\n",
+             busy / (readers * seconds + 1e-9) * 100, wait / (num_threads * seconds + 1e-9) * 100);
+    DestroyReaders();
+  }
 
+  // the tables of all processes are the same
+  if (dist_rank == 0) for (a = 0; a < model_count; a++) {
+    SelectModel(&models[a]);
+    SaveVectors();
+    if (save_model_file[0] != 0) SaveModel();
+    if (quantize) QuantizeTables();
+  }
+  if (dist_rank == 0 && output_homophone[0] != 0) SaveHomophones();
+  DestroyModels();
+  if (hot_rows > 0) DestroyHotRows();
+  if (dist_size > 1) DistClose();
+
+  if (seed) {
+    for (a = 0; a < num_threads; a++) {
+      free(det_logs[a].update);
+      free(det_logs[a].grad);
+      free(det_logs[a].buf);
+    }
+    free(det_logs);
+    free(det_words);
+    free(det_done);
+    free(chunk_start);
+  }
   free(table);
+  free(keep);
   free(pt);
   DestroyVocab();
 }
@@ -1015,6 +3382,7 @@ int ArgPos(char *str, int argc, char **argv) {
   return -1;
 }
 
+#ifndef PCWE_NO_MAIN
 int main(int argc, char **argv) {
   int i;
   setlocale(LC_ALL, "en_US.UTF-8");
@@ -1023,7 +3391,7 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; it may be compressed with gzip or zstd, in several members or frames\n");
     printf("\t-comp <file>\n");
     printf("\t\tUse component list from <file>\n");
     printf("\t-char2comp <file>\n");
@@ -1035,6 +3403,11 @@ int main(int argc, char **argv) {
     printf("\t\tObtain words and their pronunciation from <file>\n");
     printf("\t-vocab <file>\n");
     printf("\t\tSave vocabulary to file\n");
+    printf("\t-save-model <file>\n");
+    printf("\t\tSave the vocabulary counts and all embeddings to <file> to continue training later\n");
+    printf("\t-load-model <file>\n");
+    printf("\t\tContinue training the model saved in <file> on the new data of -train (incremental training);\n");
+    printf("\t\tnew words are initialized from their characters, components and pronunciations\n");
     printf("\t-output-word <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-output-char <file>\n");
@@ -1043,6 +3416,46 @@ int main(int argc, char **argv) {
     printf("\t\tUse <file> to save the resulting component vectors / word clusters\n");
     printf("\t-output-pron <file>\n");
     printf("\t\tUse <file> to save the resulting pronunciation vectors / word clusters\n");
+    printf("\t-output-homophone <file>\n");
+    printf("\t\tAlso save the homophone index of the vocabulary to <file>, for the homophone requests of pcwe-serve\n");
+    printf("\t-dist-size <int>\n");
+    printf("\t\tTrain with <int> processes, each on its part of the training file; default is 1\n");
+    printf("\t-dist-rank <int>\n");
+    printf("\t\tNumber of this process, 0 to -dist-size - 1; process 0 saves the vectors\n");
+    printf("\t-dist-addr <address>\n");
+    printf("\t\tProcess r listens on port + r of <host:port>, on the r-th of <host:port,host:port,...>\n");
+    printf("\t\tor on the Unix socket <path>.r of <unix:path>; default is 127.0.0.1:7700\n");
+    printf("\t-dist-sync <int>\n");
+    printf("\t\tAverage the tables of the processes every <int> words of a process; default is 1000000\n");
+    printf("\t-hot-rows <int>\n");
+    printf("\t\tEvery thread adds its updates of the <int> most used character, component and pronunciation rows\n");
+    printf("\t\tto its own buffers, merged into the tables every -hot-sync target words; default is 0 (off)\n");
+    printf("\t-hot-sync <int>\n");
+    printf("\t\tTarget words between two merges of the buffers of -hot-rows; default is 64\n");
+    printf("\t-profile <int>\n");
+    printf("\t\tTime the stages of the training of 1 of every <int> target words and print them at the end of\n");
+    printf("\t\ttraining; default is 0 (off); needs a build with make PROFILE=1\n");
+    printf("\t-prefetch <int>\n");
+    printf("\t\tPrefetch the embedding rows of the next target word and its negative samples; default is 1\n");
+    printf("\t-readers <int>\n");
+    printf("\t\tParse and subsample the sentences in <int> reader threads ahead of the training threads; default is 0\n");
+    printf("\t\t(the training threads read the file themselves)\n");
+    printf("\t-count-sketch <int>\n");
+    printf("\t\tCount the training file into a count-min sketch of <int> MB first and only add words to the vocabulary\n");
+    printf("\t\tonce they may reach -min-count; the vocabulary is unchanged but needs far less memory; default is 0 (off)\n");
+    printf("\t-table-dir <dir>\n");
+    printf("\t\tMap the word and negative sampling tables from files in <dir> instead of memory, for vocabularies\n");
+    printf("\t\tlarger than the memory\n");
+    printf("\t-table-memory <int>\n");
+    printf("\t\tWith -table-dir, keep at most <int> MB of the two tables resident, the rows of the frequent words\n");
+    printf("\t\tfirst; default is 0 (no limit, paged by the kernel)\n");
+    printf("\t-deterministic <int>\n");
+    printf("\t\tReproducible training seeded with <int>: the output is bit-identical across runs with the same -threads;\n");
+    printf("\t\tdefault is 0 (off, Hogwild updates)\n");
+    printf("\t-quantize <int>\n");
+    printf("\t\tAlso save int8 (<file>.q8) and product quantized (<file>.pq) versions of every output file; default is 0 (off)\n");
+    printf("\t-pq-m <int>\n");
+    printf("\t\tNumber of subvectors of the product quantization; default is half of -size\n");
     printf("\t-size <int>\n");
     printf("\t\tSet size of word vectors; default is 100\n");
     printf("\t-window <int>\n");
@@ -1058,6 +3471,8 @@ int main(int argc, char **argv) {
     printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
     printf("\t-alpha <float>\n");
     printf("\t\tSet the starting learning rate; default is 0.025\n");
+    printf("\t-adagrad <int>\n");
+    printf("\t\tScale the updates of every row by its Adagrad accumulator; default is 0 (off). Use a larger -alpha, e.g. 0.1\n");
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\t-binary <int>\n");
@@ -1068,6 +3483,10 @@ int main(int argc, char **argv) {
     printf("\t\t The type of pronunciation's positon (default = 1: use the components of surrounding words, 2: use the components of the target word, 3: use both)\n");
     printf("\t-average-sum <int>\n");
     printf("\t\tCompose way of context. (default = 1: average, 2: sum)\n");
+    printf("\t-sweep <list>\n");
+    printf("\t\tTrain the configurations <join-type>:<pos-type>:<average-sum>,... of <list> in one pass over the\n");
+    printf("\t\ttraining file, with the same sentences and negative samples; their output files get the suffix\n");
+    printf("\t\t.j<join-type>p<pos-type>a<average-sum>\n");
     printf("\nExamples:\n");
     printf("./word2vec -train data.txt -output-word word.txt -output-char char.txt -output-comp comp.txt -output-pron pron.txt -debug 2 -size 200 -window 5 -sample 1e-4 -negative 5 -hs 0 -binary 0 -cbow 1\n\n");
     return 0;
@@ -1078,6 +3497,7 @@ int main(int argc, char **argv) {
   output_char[0] = 0;
   output_comp[0] = 0;
   output_pron[0] = 0;
+  output_homophone[0] = 0;
 
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
@@ -1088,6 +3508,25 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-output-char", argc, argv)) > 0) strcpy(output_char, argv[i + 1]);
   if ((i = ArgPos((char *)"-output-comp", argc, argv)) > 0) strcpy(output_comp, argv[i + 1]);
   if ((i = ArgPos((char *)"-output-pron", argc, argv)) > 0) strcpy(output_pron, argv[i + 1]);
+  if ((i = ArgPos((char *)"-output-homophone", argc, argv)) > 0) strcpy(output_homophone, argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-model", argc, argv)) > 0) strcpy(save_model_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-load-model", argc, argv)) > 0) strcpy(load_model_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-dist-rank", argc, argv)) > 0) dist_rank = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-dist-size", argc, argv)) > 0) dist_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-dist-addr", argc, argv)) > 0) strcpy(dist_addr, argv[i + 1]);
+  if ((i = ArgPos((char *)"-dist-sync", argc, argv)) > 0) dist_sync = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-table-dir", argc, argv)) > 0) strcpy(table_dir, argv[i + 1]);
+  if ((i = ArgPos((char *)"-table-memory", argc, argv)) > 0) table_memory = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-adagrad", argc, argv)) > 0) adagrad = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-rows", argc, argv)) > 0) hot_rows = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-sync", argc, argv)) > 0) hot_sync = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-profile", argc, argv)) > 0) profile_every = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-prefetch", argc, argv)) > 0) prefetch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-readers", argc, argv)) > 0) readers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-count-sketch", argc, argv)) > 0) count_sketch_mb = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-deterministic", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+  if ((i = ArgPos((char *)"-quantize", argc, argv)) > 0) quantize = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-pq-m", argc, argv)) > 0) pq_m = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-comp", argc, argv)) > 0) strcpy(comp_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-char2comp", argc, argv)) > 0) strcpy(char2comp_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-pron", argc, argv)) > 0) strcpy(pron_file, argv[i + 1]);
@@ -1101,6 +3540,7 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-join-type", argc, argv)) > 0) join_type = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-pos-type", argc, argv)) > 0) pos_type = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-average-sum", argc, argv)) > 0) average_sum = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sweep", argc, argv)) > 0) strcpy(sweep, argv[i + 1]);
 
   if (output_word[0] == 0) {
     printf("Error: no output word filename\n");
@@ -1118,11 +3558,18 @@ int main(int argc, char **argv) {
     printf("Error: no output pronunciation filename\n");
     return 0;
   }
+  if (join_type < 1 || join_type > 2) {
+    printf("Error: -join-type must be 1 or 2\n");
+    return 0;
+  }
+  if (pos_type < 1 || pos_type > 3) {
+    printf("Error: -pos-type must be 1, 2 or 3\n");
+    return 0;
+  }
 
   vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
   comp_array = (struct components *)calloc(comp_max_size, sizeof(struct components));
   pron_array = (struct pronunciation *)calloc(pron_max_size, sizeof(struct pronunciation));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
   if (expTable == NULL) {
     fprintf(stderr, "out of memory\n");
@@ -1138,3 +3585,4 @@ int main(int argc, char **argv) {
   free(expTable);
   return 0;
 }
+#endif
@@ -0,0 +1,327 @@
+// Reports the accuracy lost by the quantized tables written with -quantize.
+//
+// The float vectors, the int8 (.q8) and the product quantized (.pq) tables are
+// compared on the word similarity and word analogy sets of evaluation/, and on
+// the recall of the exact nearest neighbours of sampled query words:
+//
+//   ./qeval -vec word.txt -sim ../evaluation/240.txt -sim ../evaluation/297.txt
+//           -analogy ../evaluation/analogy.txt
+//
+// Scores of the quantized tables are computed on the codes (QuantScore).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "quant.h"
+#include "vecio.h"
+
+#define MAX_STRING 100
+#define MAX_PAIRS 100000
+
+char vec_file[MAX_STRING], q8_file[MAX_STRING + 4], pq_file[MAX_STRING + 4];
+char analogy_file[MAX_STRING];
+int binary = 0, top_k = 10, num_queries = 1000;
+
+long long words, size;
+struct vec_table float_vectors;
+char **vocab;
+float *vec;       // unit rows of the float vectors
+
+struct table {
+  char *name;
+  struct quant_table q;  // unused for the float vectors
+  int quantized;
+} tables[3];
+int num_tables;
+
+long long SearchWord(char *word) {
+  long long a;
+  for (a = 0; a < words; a++) if (!strcmp(vocab[a], word)) return a;
+  return -1;
+}
+
+void ReadVectors() {
+  long long a, b;
+  float len;
+  if (VecRead(&float_vectors, vec_file, binary ? VEC_BINARY : VEC_AUTO, 0) != 0) {
+    printf("Cannot read %s\n", vec_file);
+    exit(1);
+  }
+  words = float_vectors.rows;
+  size = float_vectors.dim;
+  vocab = float_vectors.words;
+  vec = float_vectors.vec;
+  for (a = 0; a < words; a++) {
+    len = 0;
+    for (b = 0; b < size; b++) len += vec[a * size + b] * vec[a * size + b];
+    len = sqrtf(len);
+    if (len > 0) for (b = 0; b < size; b++) vec[a * size + b] /= len;
+  }
+}
+
+void LoadTable(char *name, char *file) {
+  struct table *t = &tables[num_tables];
+  long long a;
+  if (QuantLoad(&t->q, file)) {
+    printf("Cannot read %s, skipped\n", file);
+    return;
+  }
+  if (t->q.rows != words || t->q.dim != size) {
+    printf("%s does not match %s, skipped\n", file, vec_file);
+    QuantFree(&t->q);
+    return;
+  }
+  if (t->q.words != NULL)
+    for (a = 0; a < words; a++) if (strcmp(t->q.words[a], vocab[a])) {
+      printf("%s does not match %s, skipped\n", file, vec_file);
+      QuantFree(&t->q);
+      return;
+    }
+  t->name = name;
+  t->quantized = 1;
+  num_tables++;
+}
+
+// Unit vector of a row in a table
+void GetRow(struct table *t, long long row, float *out) {
+  if (t->quantized) QuantDecode(&t->q, row, out);
+  else memcpy(out, &vec[row * size], size * sizeof(float));
+}
+
+// Cosine of a unit query with every row of a table
+void Score(struct table *t, float *query, float *score) {
+  long long a, b;
+  float s;
+  if (t->quantized) {
+    QuantScore(&t->q, query, score);
+    return;
+  }
+  for (a = 0; a < words; a++) {
+    s = 0;
+    for (b = 0; b < size; b++) s += query[b] * vec[a * size + b];
+    score[a] = s;
+  }
+}
+
+// The k best rows by score, best first
+void TopK(float *score, long long k, long long *best) {
+  long long a, b, n = 0;
+  for (a = 0; a < words; a++) {
+    if (n == k && score[a] <= score[best[n - 1]]) continue;
+    if (n < k) n++;
+    for (b = n - 1; b > 0 && score[best[b - 1]] < score[a]; b--) best[b] = best[b - 1];
+    best[b] = a;
+  }
+}
+
+// Ranks with ties averaged, as used by Spearman's correlation
+void Rank(float *x, long long n, float *rank) {
+  long long a, b, c, *order = (long long *)malloc(n * sizeof(long long));
+  for (a = 0; a < n; a++) {
+    for (b = a; b > 0 && x[order[b - 1]] > x[a]; b--) order[b] = order[b - 1];
+    order[b] = a;
+  }
+  for (a = 0; a < n; a = b) {
+    for (b = a + 1; b < n && x[order[b]] == x[order[a]]; b++);
+    for (c = a; c < b; c++) rank[order[c]] = (a + b - 1) / 2.0;
+  }
+  free(order);
+}
+
+float Spearman(float *x, float *y, long long n) {
+  long long a;
+  float *rx = (float *)malloc(n * sizeof(float)), *ry = (float *)malloc(n * sizeof(float));
+  double mx = 0, my = 0, sxy = 0, sxx = 0, syy = 0;
+  Rank(x, n, rx);
+  Rank(y, n, ry);
+  for (a = 0; a < n; a++) {
+    mx += rx[a];
+    my += ry[a];
+  }
+  mx /= n;
+  my /= n;
+  for (a = 0; a < n; a++) {
+    sxy += (rx[a] - mx) * (ry[a] - my);
+    sxx += (rx[a] - mx) * (rx[a] - mx);
+    syy += (ry[a] - my) * (ry[a] - my);
+  }
+  free(rx);
+  free(ry);
+  if (sxx == 0 || syy == 0) return 0;
+  return sxy / sqrt(sxx * syy);
+}
+
+void EvaluateSimilarity(char *file) {
+  long long a, b, n = 0, total = 0, (*pair)[2] = malloc(MAX_PAIRS * sizeof(*pair));
+  float *human = (float *)malloc(MAX_PAIRS * sizeof(float)), *cosine = (float *)malloc(MAX_PAIRS * sizeof(float));
+  float *x = (float *)malloc(size * sizeof(float)), *y = (float *)malloc(size * sizeof(float));
+  char w1[MAX_STRING], w2[MAX_STRING];
+  float h;
+  int t;
+  FILE *f = fopen(file, "rb");
+  if (f == NULL) {
+    printf("Input file not found: %s\n", file);
+    exit(1);
+  }
+  while (fscanf(f, "%99s %99s %f", w1, w2, &h) == 3 && n < MAX_PAIRS) {
+    total++;
+    pair[n][0] = SearchWord(w1);
+    pair[n][1] = SearchWord(w2);
+    if (pair[n][0] < 0 || pair[n][1] < 0) continue;
+    human[n++] = h;
+  }
+  fclose(f);
+  printf("%s: %lld of %lld pairs in vocabulary\n", file, n, total);
+  for (t = 0; t < num_tables; t++) {
+    for (a = 0; a < n; a++) {
+      GetRow(&tables[t], pair[a][0], x);
+      GetRow(&tables[t], pair[a][1], y);
+      cosine[a] = 0;
+      for (b = 0; b < size; b++) cosine[a] += x[b] * y[b];
+    }
+    printf("  %-6s spearman %.4f\n", tables[t].name, n > 1 ? Spearman(human, cosine, n) : 0);
+  }
+  free(pair);
+  free(human);
+  free(cosine);
+  free(x);
+  free(y);
+}
+
+void EvaluateAnalogy(char *file) {
+  long long a, b, n = 0, total = 0, id[4], best, *correct = (long long *)calloc(num_tables, sizeof(long long));
+  float *x = (float *)malloc(size * sizeof(float)), *query = (float *)malloc(size * sizeof(float));
+  float *score = (float *)malloc(words * sizeof(float)), len;
+  char w[4][MAX_STRING];
+  int t;
+  FILE *f = fopen(file, "rb");
+  if (f == NULL) {
+    printf("Input file not found: %s\n", file);
+    exit(1);
+  }
+  while (fscanf(f, "%99s", w[0]) == 1) {
+    if (!strcmp(w[0], ":")) {
+      if (fscanf(f, "%*s") != 0) break;
+      continue;
+    }
+    if (fscanf(f, "%99s %99s %99s", w[1], w[2], w[3]) != 3) break;
+    total++;
+    for (a = 0; a < 4; a++) if ((id[a] = SearchWord(w[a])) < 0) break;
+    if (a < 4) continue;
+    n++;
+    // 3CosAdd: the nearest row of b - a + c, excluding the question words
+    for (t = 0; t < num_tables; t++) {
+      for (b = 0; b < size; b++) query[b] = 0;
+      for (a = 0; a < 3; a++) {
+        GetRow(&tables[t], id[a], x);
+        for (b = 0; b < size; b++) query[b] += a == 0 ? -x[b] : x[b];
+      }
+      len = 0;
+      for (b = 0; b < size; b++) len += query[b] * query[b];
+      len = sqrtf(len);
+      if (len > 0) for (b = 0; b < size; b++) query[b] /= len;
+      Score(&tables[t], query, score);
+      score[id[0]] = score[id[1]] = score[id[2]] = -2;
+      best = 0;
+      for (a = 1; a < words; a++) if (score[a] > score[best]) best = a;
+      if (best == id[3]) correct[t]++;
+    }
+  }
+  fclose(f);
+  printf("%s: %lld of %lld questions in vocabulary\n", file, n, total);
+  for (t = 0; t < num_tables; t++)
+    printf("  %-6s accuracy %.4f\n", tables[t].name, n > 0 ? (float)correct[t] / n : 0);
+  free(correct);
+  free(x);
+  free(query);
+  free(score);
+}
+
+// Recall of the exact top k neighbours of sampled words by the quantized scores
+void EvaluateRecall() {
+  long long a, b, c, n = num_queries < words ? num_queries : words, row;
+  long long *exact = (long long *)malloc(top_k * sizeof(long long)), *approx = (long long *)malloc(top_k * sizeof(long long));
+  float *score = (float *)malloc(words * sizeof(float));
+  double found;
+  int t;
+  if (top_k > words) top_k = words;
+  printf("Recall@%d of the exact neighbours of %lld words\n", top_k, n);
+  for (t = 1; t < num_tables; t++) {
+    found = 0;
+    for (a = 0; a < n; a++) {
+      row = a * words / n;  // spread the queries over the frequency ranks
+      Score(&tables[0], &vec[row * size], score);
+      TopK(score, top_k, exact);
+      Score(&tables[t], &vec[row * size], score);
+      TopK(score, top_k, approx);
+      for (b = 0; b < top_k; b++) for (c = 0; c < top_k; c++) if (exact[b] == approx[c]) found++;
+    }
+    printf("  %-6s recall %.4f\n", tables[t].name, found / (n * top_k));
+  }
+  free(exact);
+  free(approx);
+  free(score);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i;
+  if (argc == 1) {
+    printf("Evaluation of the quantized embedding tables\n\n");
+    printf("Options:\n");
+    printf("\t-vec <file>\n");
+    printf("\t\tFloat vectors written by pcwe (-output-word etc.), or converted by pcwe-convert\n");
+    printf("\t-binary <int>\n");
+    printf("\t\tThe float vectors are in binary mode; default is 0 (the format is detected)\n");
+    printf("\t-q8 <file>\n");
+    printf("\t\tInt8 table; default is <vec>.q8\n");
+    printf("\t-pq <file>\n");
+    printf("\t\tProduct quantized table; default is <vec>.pq\n");
+    printf("\t-sim <file>\n");
+    printf("\t\tWord similarity set (word word score per line); may be given several times\n");
+    printf("\t-analogy <file>\n");
+    printf("\t\tWord analogy set (a b c d per line, ': section' headers)\n");
+    printf("\t-k <int>\n");
+    printf("\t\tNeighbours compared for the recall; default is 10\n");
+    printf("\t-queries <int>\n");
+    printf("\t\tQuery words for the recall; default is 1000\n");
+    printf("\nExamples:\n");
+    printf("./qeval -vec word.txt -sim ../evaluation/240.txt -sim ../evaluation/297.txt -analogy ../evaluation/analogy.txt\n\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-vec", argc, argv)) > 0) strcpy(vec_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-analogy", argc, argv)) > 0) strcpy(analogy_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-k", argc, argv)) > 0) top_k = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-queries", argc, argv)) > 0) num_queries = atoi(argv[i + 1]);
+  sprintf(q8_file, "%s.q8", vec_file);
+  sprintf(pq_file, "%s.pq", vec_file);
+  if ((i = ArgPos((char *)"-q8", argc, argv)) > 0) strcpy(q8_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-pq", argc, argv)) > 0) strcpy(pq_file, argv[i + 1]);
+  if (vec_file[0] == 0 || top_k < 1) {
+    printf("-vec must be given and -k must be positive\n");
+    return 1;
+  }
+  ReadVectors();
+  tables[0].name = "float";
+  num_tables = 1;
+  LoadTable("int8", q8_file);
+  LoadTable("pq", pq_file);
+  printf("%lld words, %lld dimensions\n", words, size);
+  for (i = 1; i < argc - 1; i++) if (!strcmp(argv[i], "-sim")) EvaluateSimilarity(argv[i + 1]);
+  if (analogy_file[0] != 0) EvaluateAnalogy(analogy_file);
+  EvaluateRecall();
+  return 0;
+}
@@ -0,0 +1,408 @@
+// Quantized embedding tables: int8 per-row scaling and 4-bit product quantization.
+// See quant.h for the encodings.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "quant.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define QUANT_X86
+#endif
+
+#define QUANT_MAGIC 0x51574350  // "PCWQ"
+#define PQ_SAMPLE 65536         // rows used to train the centroids
+
+static void *QuantAlloc(size_t size) {
+  void *p = calloc(size ? size : 1, 1);
+  if (p == NULL) {
+    fprintf(stderr, "quant: memory allocation failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+// Normalizes a row into unit[0..dim), returns its norm
+static float UnitRow(const float *row, float *unit, long long dim) {
+  long long c;
+  double len = 0;
+  for (c = 0; c < dim; c++) len += (double)row[c] * row[c];
+  len = sqrt(len);
+  for (c = 0; c < dim; c++) unit[c] = len > 0 ? row[c] / len : 0;
+  return len;
+}
+
+static void CopyWords(struct quant_table *q, char **words) {
+  long long a;
+  if (words == NULL) return;
+  q->words = (char **)QuantAlloc(q->rows * sizeof(char *));
+  for (a = 0; a < q->rows; a++) {
+    q->words[a] = (char *)QuantAlloc(strlen(words[a]) + 1);
+    strcpy(q->words[a], words[a]);
+  }
+}
+
+//********* int8 ************
+
+void QuantInt8(struct quant_table *q, const float *vec, long long rows, long long dim, char **words) {
+  long long a, c;
+  float *unit = (float *)QuantAlloc(dim * sizeof(float)), max;
+  memset(q, 0, sizeof(struct quant_table));
+  q->type = QUANT_INT8;
+  q->rows = rows;
+  q->dim = dim;
+  q->norm = (float *)QuantAlloc(rows * sizeof(float));
+  q->scale = (float *)QuantAlloc(rows * sizeof(float));
+  q->code8 = (signed char *)QuantAlloc(rows * dim);
+  for (a = 0; a < rows; a++) {
+    q->norm[a] = UnitRow(vec + a * dim, unit, dim);
+    max = 0;
+    for (c = 0; c < dim; c++) if (fabsf(unit[c]) > max) max = fabsf(unit[c]);
+    q->scale[a] = max > 0 ? max / 127 : 1;
+    for (c = 0; c < dim; c++) q->code8[a * dim + c] = (signed char)lrintf(unit[c] / q->scale[a]);
+  }
+  CopyWords(q, words);
+  free(unit);
+}
+
+static long long DotInt8(const signed char *x, const signed char *y, long long n) {
+  long long c, sum = 0;
+  for (c = 0; c < n; c++) sum += x[c] * y[c];
+  return sum;
+}
+
+#ifdef QUANT_X86
+__attribute__((target("avx2")))
+static long long DotInt8Avx2(const signed char *x, const signed char *y, long long n) {
+  long long c = 0, sum;
+  int part[8], i;
+  __m256i acc = _mm256_setzero_si256();
+  for (; c + 16 <= n; c += 16) {
+    __m256i a = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(x + c)));
+    __m256i b = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(y + c)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+  }
+  _mm256_storeu_si256((__m256i *)part, acc);
+  for (sum = 0, i = 0; i < 8; i++) sum += part[i];
+  for (; c < n; c++) sum += x[c] * y[c];
+  return sum;
+}
+#endif
+
+static void ScoreInt8(struct quant_table *q, const float *query, float *score) {
+  long long a, c;
+  float max = 0, qscale;
+  signed char *code = (signed char *)QuantAlloc(q->dim);
+  long long (*dot)(const signed char *, const signed char *, long long) = DotInt8;
+#ifdef QUANT_X86
+  if (__builtin_cpu_supports("avx2")) dot = DotInt8Avx2;
+#endif
+  for (c = 0; c < q->dim; c++) if (fabsf(query[c]) > max) max = fabsf(query[c]);
+  qscale = max > 0 ? max / 127 : 1;
+  for (c = 0; c < q->dim; c++) code[c] = (signed char)lrintf(query[c] / qscale);
+  for (a = 0; a < q->rows; a++)
+    score[a] = dot(code, q->code8 + a * q->dim, q->dim) * qscale * q->scale[a];
+  free(code);
+}
+
+//********* product quantization ************
+
+// k-means of the subvectors sub[0..n) (stride P) of dimension dsub into PQ_K centroids
+static void TrainSubspace(const float *sub, long long n, long long stride, long long dsub,
+                          int iterations, float *centroid, unsigned long long *next_random) {
+  long long a, c, k, best, *count = (long long *)QuantAlloc(PQ_K * sizeof(long long));
+  int it;
+  double *sum = (double *)QuantAlloc(PQ_K * dsub * sizeof(double));
+  float d, best_d;
+  for (k = 0; k < PQ_K; k++) {
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    a = (*next_random >> 16) % n;
+    for (c = 0; c < dsub; c++) centroid[k * dsub + c] = sub[a * stride + c];
+  }
+  for (it = 0; it < iterations; it++) {
+    memset(sum, 0, PQ_K * dsub * sizeof(double));
+    memset(count, 0, PQ_K * sizeof(long long));
+    for (a = 0; a < n; a++) {
+      best = 0;
+      best_d = INFINITY;
+      for (k = 0; k < PQ_K; k++) {
+        for (d = 0, c = 0; c < dsub; c++)
+          d += (sub[a * stride + c] - centroid[k * dsub + c]) * (sub[a * stride + c] - centroid[k * dsub + c]);
+        if (d < best_d) {
+          best_d = d;
+          best = k;
+        }
+      }
+      count[best]++;
+      for (c = 0; c < dsub; c++) sum[best * dsub + c] += sub[a * stride + c];
+    }
+    for (k = 0; k < PQ_K; k++) {
+      if (count[k] == 0) {  // reseed an empty cluster with a random subvector
+        *next_random = *next_random * (unsigned long long)25214903917 + 11;
+        a = (*next_random >> 16) % n;
+        for (c = 0; c < dsub; c++) centroid[k * dsub + c] = sub[a * stride + c];
+      } else for (c = 0; c < dsub; c++) centroid[k * dsub + c] = sum[k * dsub + c] / count[k];
+    }
+  }
+  free(sum);
+  free(count);
+}
+
+static int NearestCentroid(const float *x, const float *centroid, long long dsub) {
+  int k, best = 0;
+  long long c;
+  float d, best_d = INFINITY;
+  for (k = 0; k < PQ_K; k++) {
+    for (d = 0, c = 0; c < dsub; c++) d += (x[c] - centroid[k * dsub + c]) * (x[c] - centroid[k * dsub + c]);
+    if (d < best_d) {
+      best_d = d;
+      best = k;
+    }
+  }
+  return best;
+}
+
+void QuantPq(struct quant_table *q, const float *vec, long long rows, long long dim, char **words,
+             long long m, int iterations) {
+  long long a, j, P, n, blocks;
+  unsigned long long next_random = 1;
+  float *unit, *sample;
+  int code;
+  memset(q, 0, sizeof(struct quant_table));
+  if (m < 1) m = 1;
+  if (m > PQ_MAX_M) m = PQ_MAX_M;
+  if (m > dim) m = dim;
+  q->type = QUANT_PQ;
+  q->rows = rows;
+  q->dim = dim;
+  q->m = m;
+  q->dsub = (dim + m - 1) / m;
+  P = q->m * q->dsub;
+  q->norm = (float *)QuantAlloc(rows * sizeof(float));
+  q->centroid = (float *)QuantAlloc(m * PQ_K * q->dsub * sizeof(float));
+  blocks = (rows + PQ_BLOCK - 1) / PQ_BLOCK;
+  q->code4 = (unsigned char *)QuantAlloc(blocks * m * 16);
+
+  // unit rows padded with zeros to P values
+  unit = (float *)QuantAlloc(rows * P * sizeof(float));
+  for (a = 0; a < rows; a++) q->norm[a] = UnitRow(vec + a * dim, unit + a * P, dim);
+
+  // train on a random sample of the rows
+  n = rows < PQ_SAMPLE ? rows : PQ_SAMPLE;
+  sample = (float *)QuantAlloc(n * P * sizeof(float));
+  for (a = 0; a < n; a++) {
+    long long r = a;
+    if (rows > PQ_SAMPLE) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      r = (next_random >> 16) % rows;
+    }
+    memcpy(sample + a * P, unit + r * P, P * sizeof(float));
+  }
+  if (n > 0) for (j = 0; j < m; j++)
+    TrainSubspace(sample + j * q->dsub, n, P, q->dsub, iterations, q->centroid + j * PQ_K * q->dsub, &next_random);
+
+  for (a = 0; a < rows; a++) for (j = 0; j < m; j++) {
+    unsigned char *byte = q->code4 + (a / PQ_BLOCK) * m * 16 + j * 16 + (a % 16);
+    code = NearestCentroid(unit + a * P + j * q->dsub, q->centroid + j * PQ_K * q->dsub, q->dsub);
+    if (a % PQ_BLOCK < 16) *byte |= code;
+    else *byte |= code << 4;
+  }
+  CopyWords(q, words);
+  free(sample);
+  free(unit);
+}
+
+static int PqCode(struct quant_table *q, long long row, long long j) {
+  unsigned char byte = q->code4[(row / PQ_BLOCK) * q->m * 16 + j * 16 + (row % 16)];
+  return row % PQ_BLOCK < 16 ? byte & 0x0F : byte >> 4;
+}
+
+// Sums the 8-bit lookup table entries of the codes of every row into sum[]
+static void PqScan(struct quant_table *q, const unsigned char *lut, unsigned short *sum) {
+  long long a, j;
+  for (a = 0; a < q->rows; a++) {
+    sum[a] = 0;
+    for (j = 0; j < q->m; j++) sum[a] += lut[j * PQ_K + PqCode(q, a, j)];
+  }
+}
+
+#ifdef QUANT_X86
+// The same sums, 32 rows at a time: every subspace is a 16-entry table looked up by pshufb
+__attribute__((target("ssse3")))
+static void PqScanSsse3(struct quant_table *q, const unsigned char *lut, unsigned short *sum) {
+  long long b, j, blocks = (q->rows + PQ_BLOCK - 1) / PQ_BLOCK;
+  const __m128i mask = _mm_set1_epi8(0x0F), zero = _mm_setzero_si128();
+  unsigned short part[PQ_BLOCK];
+  for (b = 0; b < blocks; b++) {
+    const unsigned char *code = q->code4 + b * q->m * 16;
+    __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+    for (j = 0; j < q->m; j++) {
+      __m128i table = _mm_loadu_si128((const __m128i *)(lut + j * PQ_K));
+      __m128i c = _mm_loadu_si128((const __m128i *)(code + j * 16));
+      __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(c, mask));
+      __m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(c, 4), mask));
+      acc0 = _mm_add_epi16(acc0, _mm_unpacklo_epi8(lo, zero));
+      acc1 = _mm_add_epi16(acc1, _mm_unpackhi_epi8(lo, zero));
+      acc2 = _mm_add_epi16(acc2, _mm_unpacklo_epi8(hi, zero));
+      acc3 = _mm_add_epi16(acc3, _mm_unpackhi_epi8(hi, zero));
+    }
+    _mm_storeu_si128((__m128i *)(part + 0), acc0);
+    _mm_storeu_si128((__m128i *)(part + 8), acc1);
+    _mm_storeu_si128((__m128i *)(part + 16), acc2);
+    _mm_storeu_si128((__m128i *)(part + 24), acc3);
+    j = q->rows - b * PQ_BLOCK < PQ_BLOCK ? q->rows - b * PQ_BLOCK : PQ_BLOCK;
+    memcpy(sum + b * PQ_BLOCK, part, j * sizeof(unsigned short));
+  }
+}
+#endif
+
+static void ScorePq(struct quant_table *q, const float *query, float *score) {
+  long long a, j, k, c;
+  float *lut = (float *)QuantAlloc(q->m * PQ_K * sizeof(float)), *sub, lo, hi, delta = 0, base = 0;
+  unsigned char *lut8 = (unsigned char *)QuantAlloc(q->m * PQ_K);
+  unsigned short *sum = (unsigned short *)QuantAlloc(q->rows * sizeof(unsigned short));
+  void (*scan)(struct quant_table *, const unsigned char *, unsigned short *) = PqScan;
+#ifdef QUANT_X86
+  if (__builtin_cpu_supports("ssse3")) scan = PqScanSsse3;
+#endif
+  // float lookup tables: the dot products of the query subvectors with the centroids
+  for (j = 0; j < q->m; j++) for (k = 0; k < PQ_K; k++) {
+    sub = q->centroid + (j * PQ_K + k) * q->dsub;
+    lut[j * PQ_K + k] = 0;
+    for (c = 0; c < q->dsub && j * q->dsub + c < q->dim; c++) lut[j * PQ_K + k] += query[j * q->dsub + c] * sub[c];
+  }
+  // quantize them to 8 bits with a per-subspace offset and a shared step
+  for (j = 0; j < q->m; j++) {
+    lo = hi = lut[j * PQ_K];
+    for (k = 1; k < PQ_K; k++) {
+      if (lut[j * PQ_K + k] < lo) lo = lut[j * PQ_K + k];
+      if (lut[j * PQ_K + k] > hi) hi = lut[j * PQ_K + k];
+    }
+    if ((hi - lo) / 255 > delta) delta = (hi - lo) / 255;
+  }
+  if (delta == 0) delta = 1;
+  for (j = 0; j < q->m; j++) {
+    lo = lut[j * PQ_K];
+    for (k = 1; k < PQ_K; k++) if (lut[j * PQ_K + k] < lo) lo = lut[j * PQ_K + k];
+    base += lo;
+    for (k = 0; k < PQ_K; k++) lut8[j * PQ_K + k] = (unsigned char)lrintf((lut[j * PQ_K + k] - lo) / delta);
+  }
+  scan(q, lut8, sum);
+  for (a = 0; a < q->rows; a++) score[a] = base + sum[a] * delta;
+  free(sum);
+  free(lut8);
+  free(lut);
+}
+
+//********* common ************
+
+void QuantDecode(struct quant_table *q, long long row, float *out) {
+  long long c, j;
+  if (q->type == QUANT_INT8) {
+    for (c = 0; c < q->dim; c++) out[c] = q->code8[row * q->dim + c] * q->scale[row];
+  } else {
+    for (j = 0; j < q->m; j++) {
+      const float *sub = q->centroid + (j * PQ_K + PqCode(q, row, j)) * q->dsub;
+      for (c = 0; c < q->dsub && j * q->dsub + c < q->dim; c++) out[j * q->dsub + c] = sub[c];
+    }
+  }
+}
+
+void QuantScore(struct quant_table *q, const float *query, float *score) {
+  if (q->type == QUANT_INT8) ScoreInt8(q, query, score);
+  else ScorePq(q, query, score);
+}
+
+// File layout: magic, type, rows, dim, m, dsub, has_words, words (length, bytes),
+// norms, then scales and int8 codes, or centroids and 4-bit code blocks
+int QuantSave(struct quant_table *q, const char *file) {
+  long long a, header[4] = {q->rows, q->dim, q->m, q->dsub};
+  int magic = QUANT_MAGIC, has_words = q->words != NULL, len;
+  FILE *fo = fopen(file, "wb");
+  if (fo == NULL) return -1;
+  fwrite(&magic, sizeof(int), 1, fo);
+  fwrite(&q->type, sizeof(int), 1, fo);
+  fwrite(header, sizeof(long long), 4, fo);
+  fwrite(&has_words, sizeof(int), 1, fo);
+  if (has_words) for (a = 0; a < q->rows; a++) {
+    len = strlen(q->words[a]);
+    fwrite(&len, sizeof(int), 1, fo);
+    fwrite(q->words[a], 1, len, fo);
+  }
+  fwrite(q->norm, sizeof(float), q->rows, fo);
+  if (q->type == QUANT_INT8) {
+    fwrite(q->scale, sizeof(float), q->rows, fo);
+    fwrite(q->code8, 1, q->rows * q->dim, fo);
+  } else {
+    fwrite(q->centroid, sizeof(float), q->m * PQ_K * q->dsub, fo);
+    fwrite(q->code4, 1, (q->rows + PQ_BLOCK - 1) / PQ_BLOCK * q->m * 16, fo);
+  }
+  return fclose(fo);
+}
+
+static int ReadAll(void *p, size_t size, size_t n, FILE *fin) {
+  return fread(p, size, n, fin) == n;
+}
+
+int QuantLoad(struct quant_table *q, const char *file) {
+  long long a, header[4];
+  int magic = 0, has_words = 0, len, ok;
+  FILE *fin = fopen(file, "rb");
+  memset(q, 0, sizeof(struct quant_table));
+  if (fin == NULL) return -1;
+  ok = ReadAll(&magic, sizeof(int), 1, fin) && magic == QUANT_MAGIC &&
+       ReadAll(&q->type, sizeof(int), 1, fin) && ReadAll(header, sizeof(long long), 4, fin) &&
+       ReadAll(&has_words, sizeof(int), 1, fin) &&
+       (q->type == QUANT_INT8 || q->type == QUANT_PQ);
+  if (!ok) {
+    fclose(fin);
+    return -1;
+  }
+  q->rows = header[0];
+  q->dim = header[1];
+  q->m = header[2];
+  q->dsub = header[3];
+  if (has_words) {
+    q->words = (char **)QuantAlloc(q->rows * sizeof(char *));
+    for (a = 0; a < q->rows && ok; a++) {
+      ok = ReadAll(&len, sizeof(int), 1, fin) && len >= 0;
+      if (!ok) break;
+      q->words[a] = (char *)QuantAlloc(len + 1);
+      ok = ReadAll(q->words[a], 1, len, fin);
+    }
+  }
+  q->norm = (float *)QuantAlloc(q->rows * sizeof(float));
+  ok = ok && ReadAll(q->norm, sizeof(float), q->rows, fin);
+  if (q->type == QUANT_INT8) {
+    q->scale = (float *)QuantAlloc(q->rows * sizeof(float));
+    q->code8 = (signed char *)QuantAlloc(q->rows * q->dim);
+    ok = ok && ReadAll(q->scale, sizeof(float), q->rows, fin) && ReadAll(q->code8, 1, q->rows * q->dim, fin);
+  } else {
+    a = (q->rows + PQ_BLOCK - 1) / PQ_BLOCK * q->m * 16;
+    q->centroid = (float *)QuantAlloc(q->m * PQ_K * q->dsub * sizeof(float));
+    q->code4 = (unsigned char *)QuantAlloc(a);
+    ok = ok && ReadAll(q->centroid, sizeof(float), q->m * PQ_K * q->dsub, fin) && ReadAll(q->code4, 1, a, fin);
+  }
+  fclose(fin);
+  if (!ok) {
+    QuantFree(q);
+    return -1;
+  }
+  return 0;
+}
+
+void QuantFree(struct quant_table *q) {
+  long long a;
+  if (q->words != NULL) {
+    for (a = 0; a < q->rows; a++) free(q->words[a]);
+    free(q->words);
+  }
+  free(q->norm);
+  free(q->scale);
+  free(q->code8);
+  free(q->centroid);
+  free(q->code4);
+  memset(q, 0, sizeof(struct quant_table));
+}
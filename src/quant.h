@@ -0,0 +1,54 @@
+// Quantized embedding tables for serving.
+//
+// Two encodings of a table of float rows are supported; both quantize the rows
+// normalized to unit length and keep their norms, so cosine scores are computed
+// directly on the codes:
+//   QUANT_INT8 : every value is an int8 scaled by a per-row scale (4x smaller)
+//   QUANT_PQ   : product quantization, the row is split into m subvectors, each
+//                encoded by the 4-bit id of its nearest of PQ_K centroids. Scores
+//                are computed from lookup tables with SIMD shuffles (fast scan).
+
+#ifndef PCWE_QUANT_H
+#define PCWE_QUANT_H
+
+#define QUANT_INT8 1
+#define QUANT_PQ 2
+
+#define PQ_K 16      // centroids of a subspace (4-bit codes)
+#define PQ_BLOCK 32  // rows of a block of PQ codes
+#define PQ_MAX_M 256 // the 8-bit lookup table sums of a row must fit in 16 bits
+
+struct quant_table {
+  int type;
+  long long rows, dim;
+  char **words;          // the string of every row (may be NULL)
+  float *norm;           // |row| of every row
+
+  // QUANT_INT8
+  float *scale;          // value = code8[i] * scale[row]
+  signed char *code8;    // rows * dim
+
+  // QUANT_PQ
+  long long m, dsub;     // subspaces and their dimension, dim is padded to m * dsub
+  float *centroid;       // m * PQ_K * dsub
+  unsigned char *code4;  // for every block of PQ_BLOCK rows and every subspace, 16 bytes:
+                         // byte r holds the code of row r in the low nibble and
+                         // the code of row r + 16 in the high nibble
+};
+
+// Encodes rows x dim float vectors; words (may be NULL) are copied
+void QuantInt8(struct quant_table *q, const float *vec, long long rows, long long dim, char **words);
+void QuantPq(struct quant_table *q, const float *vec, long long rows, long long dim, char **words,
+             long long m, int iterations);
+
+int QuantSave(struct quant_table *q, const char *file);
+int QuantLoad(struct quant_table *q, const char *file);
+void QuantFree(struct quant_table *q);
+
+// Decodes the unit vector of a row
+void QuantDecode(struct quant_table *q, long long row, float *out);
+
+// Approximate cosine of a unit query with every row: score[r] ~ query . row / |row|
+void QuantScore(struct quant_table *q, const float *query, float *score);
+
+#endif
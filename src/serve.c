@@ -0,0 +1,758 @@
+// pcwe-serve: a daemon that answers vector lookups, out-of-vocabulary compositions and
+// nearest neighbour queries on the vectors written by pcwe, over a Unix domain socket
+// (see serve.h for the protocol):
+//
+//   ./pcwe-serve -word word_vec -char char_vec -comp comp_vec -pron pron_vec
+//                -char2comp ../subcharacter/char2comp.txt -homophone homophones
+//                -socket /tmp/pcwe.sock
+//
+// The vector files are read once, in any format of pcwe-convert; files in its mmap format
+// are mapped read-only instead, so that the daemons of a host share their pages. A pool of
+// threads waits on the connections with epoll; a thread reads the requests a connection has
+// sent, up to MAX_BATCH bytes, answers them as one batch, and returns the connection to the
+// pool, behind the others that are ready. The answers a client does not read yet are kept
+// with its connection, which is then polled for writing, and no more of its requests are
+// read until they are sent.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "serve.h"
+#include "homophone.h"
+#include "vecio.h"
+
+#define MAX_STRING 100
+#define MAX_K 1000
+#define KNN_BLOCK 256            // rows scored for all knn requests of a batch at once
+#define MAX_BATCH (64 * SERVE_MAX_LINE) // bytes of requests read from a connection at once
+#define TABLES 4
+
+#define TABLE_WORD 0
+#define TABLE_CHAR 1
+#define TABLE_COMP 2
+#define TABLE_PRON 3
+
+struct table {
+  long long rows;
+  char **keys;
+  long long stride;               // floats from a row to the next
+  float *vec;                    // the rows as read or mapped; they are not modified
+  float *norm;                   // and their lengths
+  long long *hash, hash_size;    // the rows of the keys by open addressing, -1 if empty
+};
+
+// The components of a character, as rows of the comp table
+struct char_comps {
+  long long *comp;
+  int size;
+};
+
+struct conn {
+  int fd;
+  char *in;                      // requests read and not yet answered, MAX_BATCH bytes
+  long long in_len;
+  char *out;                     // answers not yet sent: out[out_sent .. out_len)
+  long long out_len, out_sent, out_max;
+  int eof;                       // the client sent all its requests
+};
+
+// A knn request of a batch
+struct knn {
+  long long k, exclude, n;       // exclude: the row of the word itself, or -1
+  float *vec;
+  long long *best;
+  float *score;
+};
+
+#define REQ_ERROR 0
+#define REQ_GET 1
+#define REQ_VEC 2
+#define REQ_KNN 3
+#define REQ_STATS 4
+#define REQ_HOMOPHONE 5
+
+struct request {
+  int type, table;
+  char *arg;                     // the key or word (the words of a homophone request), or the error message
+  long long k;
+  struct knn *knn;
+};
+
+// Scratch space of a worker thread
+struct worker {
+  char *out;
+  long long out_len, out_max;
+  struct request *request;
+  struct knn *knn;
+  long long max_requests;
+  float *vec, *sum;
+  struct knn near;               // of a homophone request
+  char **token;
+  int *key;
+};
+
+const char *table_names[TABLES] = {"word", "char", "comp", "pron"};
+char table_files[TABLES][MAX_STRING], char2comp_file[MAX_STRING], homophone_file[MAX_STRING],
+     socket_path[MAX_STRING] = SERVE_SOCKET;
+int binary = 0, num_threads = 0, epoll_fd;
+long long dim;
+struct table tables[TABLES];
+struct char_comps *char2comp;    // by the row of the char table
+struct homophone_index homophones;
+long long *homophone_pron;       // the rows of the pron table of the pronunciations of the index, or -1
+float *syllable_vec, *syllable_norm; // the mean unit vector of the tones of every syllable, and its length
+struct latency latency;
+unsigned long long batches;
+
+void *Alloc(long long bytes) {
+  void *p = malloc(bytes);
+  if (p == NULL) {
+    fprintf(stderr, "Memory allocation failed: %lld bytes\n", bytes);
+    exit(1);
+  }
+  return p;
+}
+
+unsigned long long KeyHash(const char *key, long long n) {
+  unsigned long long h = 14695981039346656037ull;
+  long long a;
+  for (a = 0; a < n; a++) h = (h ^ (unsigned char)key[a]) * 1099511628211ull;
+  return h;
+}
+
+// The row of the n bytes of key in t, or -1
+long long Search(struct table *t, const char *key, long long n) {
+  unsigned long long h;
+  long long row;
+  if (t->rows == 0) return -1;
+  for (h = KeyHash(key, n) & (t->hash_size - 1); (row = t->hash[h]) >= 0; h = (h + 1) & (t->hash_size - 1))
+    if (!strncmp(t->keys[row], key, n) && t->keys[row][n] == 0) return row;
+  return -1;
+}
+
+void LoadTable(struct table *t, const char *file) {
+  struct vec_table v;
+  long long a, b;
+  unsigned long long h;
+  float len;
+  int format = binary ? VEC_BINARY : VecFormat(file);
+  if ((format == VEC_MMAP ? VecMap(&v, file) : VecRead(&v, file, format, num_threads)) != 0) {
+    fprintf(stderr, "Cannot read %s\n", file);
+    exit(1);
+  }
+  if (v.rows <= 0 || (dim != 0 && v.dim != dim)) {
+    fprintf(stderr, "Invalid header in %s\n", file);
+    exit(1);
+  }
+  // the words and rows of v are kept by t
+  dim = v.dim;
+  t->rows = v.rows;
+  t->keys = v.words;
+  t->stride = v.stride;
+  t->vec = v.vec;
+  t->norm = (float *)Alloc(t->rows * sizeof(float));
+  for (t->hash_size = 1; t->hash_size < t->rows * 2; t->hash_size *= 2);
+  t->hash = (long long *)Alloc(t->hash_size * sizeof(long long));
+  for (h = 0; h < (unsigned long long)t->hash_size; h++) t->hash[h] = -1;
+  for (a = 0; a < t->rows; a++) {
+    len = 0;
+    for (b = 0; b < dim; b++) len += t->vec[a * t->stride + b] * t->vec[a * t->stride + b];
+    t->norm[a] = sqrtf(len);
+    if (Search(t, t->keys[a], strlen(t->keys[a])) >= 0) continue;   // the first row of a key is kept
+    for (h = KeyHash(t->keys[a], strlen(t->keys[a])) & (t->hash_size - 1); t->hash[h] >= 0; h = (h + 1) & (t->hash_size - 1));
+    t->hash[h] = a;
+  }
+}
+
+// The components of every character of the char table, from a char2comp file
+void LoadChar2Comp(const char *file) {
+  char *line = NULL, *s, *save;
+  size_t max = 0;
+  long long row, comp, n;
+  FILE *f = fopen(file, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Input file not found: %s\n", file);
+    exit(1);
+  }
+  char2comp = (struct char_comps *)calloc(tables[TABLE_CHAR].rows, sizeof(struct char_comps));
+  while ((n = getline(&line, &max, f)) > 0) {
+    if ((s = strtok_r(line, " \t\r\n", &save)) == NULL) continue;
+    if ((row = Search(&tables[TABLE_CHAR], s, strlen(s))) < 0 || char2comp[row].comp != NULL) continue;
+    // every component takes at least a byte and a separator
+    char2comp[row].comp = (long long *)Alloc((n / 2 + 1) * sizeof(long long));
+    while ((s = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+      if ((comp = Search(&tables[TABLE_COMP], s, strlen(s))) >= 0) char2comp[row].comp[char2comp[row].size++] = comp;
+  }
+  free(line);
+  fclose(f);
+}
+
+// Length of the UTF-8 character at s
+static int CharLength(const char *s) {
+  unsigned char c = *s;
+  int n = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4, a;
+  for (a = 1; a < n; a++) if (s[a] == 0) return a;
+  return n;
+}
+
+// The vector of a word out of the vocabulary: the mean of the mean of its character
+// vectors and the mean of the vectors of their components; returns 0 if it has neither
+int Compose(const char *word, float *out, float *sum) {
+  struct table *c = &tables[TABLE_CHAR], *m = &tables[TABLE_COMP];
+  long long b, row, chars = 0, comps = 0, a;
+  int n, parts = 0;
+  for (b = 0; b < dim; b++) out[b] = 0;
+  if (c->rows == 0) return 0;
+  for (b = 0; b < dim; b++) sum[b] = 0;
+  for (; *word != 0; word += n) {
+    n = CharLength(word);
+    if ((row = Search(c, word, n)) < 0) continue;
+    for (b = 0; b < dim; b++) out[b] += c->vec[row * c->stride + b];
+    chars++;
+    if (char2comp != NULL) for (a = 0; a < char2comp[row].size; a++) {
+      for (b = 0; b < dim; b++) sum[b] += m->vec[char2comp[row].comp[a] * m->stride + b];
+      comps++;
+    }
+  }
+  if (chars > 0) {
+    for (b = 0; b < dim; b++) out[b] /= chars;
+    parts++;
+  }
+  if (comps > 0) {
+    for (b = 0; b < dim; b++) out[b] += sum[b] / comps;
+    parts++;
+  }
+  if (parts > 1) for (b = 0; b < dim; b++) out[b] /= parts;
+  return parts > 0;
+}
+
+// The vector of a word into out; returns its row, -1 if it was composed, or -2 if it has none
+long long WordVector(const char *word, float *out, float *sum) {
+  struct table *t = &tables[TABLE_WORD];
+  long long b, row = Search(t, word, strlen(word));
+  if (row >= 0) {
+    for (b = 0; b < dim; b++) out[b] = t->vec[row * t->stride + b];
+    return row;
+  }
+  return Compose(word, out, sum) ? -1 : -2;
+}
+
+void Reserve(struct worker *w, long long bytes) {
+  if (w->out_len + bytes <= w->out_max) return;
+  while (w->out_len + bytes > w->out_max) w->out_max = w->out_max * 2 + 65536;
+  w->out = (char *)realloc(w->out, w->out_max);
+  if (w->out == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+void Print(struct worker *w, const char *s) {
+  long long n = strlen(s);
+  Reserve(w, n);
+  memcpy(w->out + w->out_len, s, n);
+  w->out_len += n;
+}
+
+void PrintVector(struct worker *w, const char *status, float *v) {
+  long long b;
+  Reserve(w, strlen(status) + dim * 16 + 2);
+  w->out_len += sprintf(w->out + w->out_len, "%s", status);
+  for (b = 0; b < dim; b++) w->out_len += sprintf(w->out + w->out_len, " %.6f", v[b]);
+  w->out[w->out_len++] = '\n';
+}
+
+// Adds row with score s to the best rows of q, best first
+static inline void KnnAdd(struct knn *q, long long row, float s) {
+  long long b;
+  if (q->n == q->k && s <= q->score[q->n - 1]) return;
+  if (q->n < q->k) q->n++;
+  for (b = q->n - 1; b > 0 && q->score[b - 1] < s; b--) {
+    q->best[b] = q->best[b - 1];
+    q->score[b] = q->score[b - 1];
+  }
+  q->best[b] = row;
+  q->score[b] = s;
+}
+
+// Scores the n knn requests of a batch in one pass over the word table: a block of rows
+// is scored for every request while it is in the cache
+void KnnBatch(struct knn *knn, long long n) {
+  struct table *t = &tables[TABLE_WORD];
+  long long a, q, r, end, b;
+  float s, *row;
+  for (a = 0; a < t->rows; a += KNN_BLOCK) {
+    end = a + KNN_BLOCK < t->rows ? a + KNN_BLOCK : t->rows;
+    for (q = 0; q < n; q++) {
+      if (knn[q].k == 0) continue;
+      for (r = a; r < end; r++) {
+        if (r == knn[q].exclude) continue;
+        row = &t->vec[r * t->stride];
+        s = 0;
+        for (b = 0; b < dim; b++) s += knn[q].vec[b] * row[b];
+        KnnAdd(&knn[q], r, t->norm[r] > 0 ? s / t->norm[r] : 0);
+      }
+    }
+  }
+}
+
+// Parses a request line into r
+void Parse(char *line, struct request *r) {
+  char *save, *s = strtok_r(line, " \t", &save), *k;
+  r->type = REQ_ERROR;
+  r->arg = "error unknown request";
+  if (s == NULL) r->arg = "error empty request";
+  else if (!strcmp(s, "get")) {
+    s = strtok_r(NULL, " \t", &save);
+    for (r->table = 0; r->table < TABLES && (s == NULL || strcmp(s, table_names[r->table])); r->table++);
+    r->arg = strtok_r(NULL, " \t", &save);
+    if (r->table < TABLES && r->arg != NULL) r->type = REQ_GET;
+    else r->arg = "error usage: get word|char|comp|pron <key>";
+  } else if (!strcmp(s, "vec")) {
+    r->arg = strtok_r(NULL, " \t", &save);
+    if (r->arg != NULL) r->type = REQ_VEC;
+    else r->arg = "error usage: vec <word>";
+  } else if (!strcmp(s, "knn")) {
+    k = strtok_r(NULL, " \t", &save);
+    r->arg = strtok_r(NULL, " \t", &save);
+    r->k = k != NULL ? strtoll(k, &s, 10) : 0;
+    if (r->arg != NULL && r->k > 0 && *s == 0) r->type = REQ_KNN;
+    else r->arg = "error usage: knn <k> <word>";
+  } else if (!strcmp(s, "homophone")) {
+    k = strtok_r(NULL, " \t", &save);
+    r->k = k != NULL ? strtoll(k, &s, 10) : 0;
+    // the words of the query are split when it is answered
+    for (r->arg = save; r->arg != NULL && (*r->arg == ' ' || *r->arg == '\t'); r->arg++);
+    if (homophones.words == 0) r->arg = "error no homophone index (-homophone)";
+    else if (r->arg != NULL && *r->arg != 0 && r->k > 0 && *s == 0) r->type = REQ_HOMOPHONE;
+    else r->arg = "error usage: homophone <k> <word> | <pinyin> ...";
+  } else if (!strcmp(s, "stats")) r->type = REQ_STATS;
+}
+
+// Cosine of two pronunciations of the homophone index by their vectors; 1 if they are
+// the same, 0 if either has no vector
+static inline float PronSimilarity(int p, int q) {
+  struct table *t = &tables[TABLE_PRON];
+  long long b, x = homophone_pron[p], y = homophone_pron[q];
+  float s = 0;
+  if (p == q) return 1;
+  if (x < 0 || y < 0) return 0;
+  if (t->norm[x] == 0 || t->norm[y] == 0) return 0;
+  for (b = 0; b < dim; b++) s += t->vec[x * t->stride + b] * t->vec[y * t->stride + b];
+  return s / (t->norm[x] * t->norm[y]);
+}
+
+// The mean of the unit vectors of the pronunciations of every syllable of the homophone
+// index, e.g. of zhong1 .. zhong4 for zhong; 0 for a syllable without any
+void InitSyllableVectors() {
+  struct table *t = &tables[TABLE_PRON];
+  long long a, b, row;
+  float *v;
+  syllable_vec = (float *)calloc(homophones.syllables * dim, sizeof(float));
+  syllable_norm = (float *)calloc(homophones.syllables, sizeof(float));
+  if (syllable_vec == NULL || syllable_norm == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < homophones.prons; a++) {
+    if ((row = homophone_pron[a]) < 0 || t->norm[row] == 0) continue;
+    v = &syllable_vec[homophones.syllable[a] * dim];
+    for (b = 0; b < dim; b++) v[b] += t->vec[row * t->stride + b] / t->norm[row];
+  }
+  for (a = 0; a < homophones.syllables; a++) {
+    for (b = 0; b < dim; b++) syllable_norm[a] += syllable_vec[a * dim + b] * syllable_vec[a * dim + b];
+    syllable_norm[a] = sqrtf(syllable_norm[a]);
+  }
+}
+
+// Cosine of a syllable and a pronunciation of the homophone index by their vectors, 0
+// if either has none
+static inline float SyllableSimilarity(int s, int p) {
+  struct table *t = &tables[TABLE_PRON];
+  long long b, x = homophone_pron[p];
+  float d = 0;
+  if (x < 0 || t->norm[x] == 0 || syllable_norm[s] == 0) return 0;
+  for (b = 0; b < dim; b++) d += syllable_vec[s * dim + b] * t->vec[x * t->stride + b];
+  return d / (syllable_norm[s] * t->norm[x]);
+}
+
+// The row of the word table of a word of the homophone index, or -1
+static inline long long HomophoneRow(long long word) {
+  struct table *t = &tables[TABLE_WORD];
+  long long id = homophones.id[word];
+  if (id >= 0 && id < t->rows && !strcmp(t->keys[id], homophones.word[word])) return id;
+  return Search(t, homophones.word[word], strlen(homophones.word[word]));
+}
+
+// Answers a homophone request: the query is a word of the index or a sequence of
+// pinyin, with tones (zhong1 guo2) or without (zhong guo). The candidates are the
+// words whose pinyin without tones is that of the query; they are ranked by the mean
+// cosine of their pronunciations and those of the query (for pinyin without tones, the
+// mean vectors of the tones of its syllables), and, for a query word with a vector, by
+// the mean of that and the cosine of the word vectors
+void Homophones(struct worker *w, struct request *r) {
+  struct homophone_index *h = &homophones;
+  struct table *t = &tables[TABLE_WORD];
+  struct knn *q = &w->near;
+  long long a, b, n = 0, word = -1, row = -1, first, count, c, crow;
+  int toneless = 0, *key = w->key, *syllables = w->key + SERVE_MAX_LINE / 2;
+  char *s, *save;
+  float score, sim;
+  for (s = strtok_r(r->arg, " \t", &save); s != NULL; s = strtok_r(NULL, " \t", &save)) {
+    if (n == SERVE_MAX_LINE / 2) {
+      Print(w, "error request too long\n");
+      return;
+    }
+    w->token[n++] = s;
+  }
+  if (n == 1 && (word = HomophoneWord(h, w->token[0])) >= 0) {
+    n = h->key_start[word + 1] - h->key_start[word];
+    if (n > SERVE_MAX_LINE / 2) n = 0;
+    for (a = 0; a < n; a++) key[a] = h->key[h->key_start[word] + a];
+    row = HomophoneRow(word);
+  } else {
+    for (a = 0; a < n && (key[a] = HomophonePron(h, w->token[a])) >= 0; a++);
+    if (a < n) {
+      toneless = 1;
+      for (a = 0; a < n && (key[a] = HomophoneSyllable(h, w->token[a])) >= 0; a++);
+      if (a < n || n == 0) {
+        Print(w, "none\n");
+        return;
+      }
+    }
+  }
+  for (a = 0; a < n; a++) syllables[a] = toneless ? key[a] : h->syllable[key[a]];
+  if (q->best == NULL) {
+    q->best = (long long *)Alloc(MAX_K * sizeof(long long));
+    q->score = (float *)Alloc(MAX_K * sizeof(float));
+  }
+  q->k = r->k < MAX_K ? r->k : MAX_K;
+  q->n = 0;
+  // the candidates are in order of frequency, which breaks the ties of the scores
+  count = HomophoneFind(h, syllables, n, 1, &first);
+  for (a = first; a < first + count; a++) {
+    if ((c = h->by_syllable[a]) == word) continue;
+    for (b = 0, score = 0; b < n; b++)
+      score += toneless ? SyllableSimilarity(key[b], h->key[h->key_start[c] + b])
+                        : PronSimilarity(key[b], h->key[h->key_start[c] + b]);
+    score /= n;
+    if (row >= 0 && (crow = HomophoneRow(c)) >= 0) {
+      for (b = 0, sim = 0; b < dim; b++) sim += t->vec[row * t->stride + b] * t->vec[crow * t->stride + b];
+      sim = t->norm[row] > 0 && t->norm[crow] > 0 ? sim / (t->norm[row] * t->norm[crow]) : 0;
+      score = (score + sim) / 2;
+    }
+    KnnAdd(q, c, score);
+  }
+  Print(w, "ok");
+  for (b = 0; b < q->n; b++) {
+    Reserve(w, strlen(h->word[q->best[b]]) + 16);
+    w->out_len += sprintf(w->out + w->out_len, " %s %.4f", h->word[q->best[b]], q->score[b]);
+  }
+  Print(w, "\n");
+}
+
+// Answers the complete lines of c->in into w->out; returns the number of requests
+long long Answer(struct conn *c, struct worker *w) {
+  long long a, b, n = 0, knns = 0, row;
+  char *p, *end, *s, buf[160];
+  struct request *r;
+  struct knn *q;
+  float len;
+  for (p = c->in, end = c->in + c->in_len; p < end; p = s + 1) {
+    if ((s = memchr(p, '\n', end - p)) == NULL) break;
+    if (n == w->max_requests) {
+      w->max_requests = w->max_requests * 2 + 64;
+      w->request = (struct request *)realloc(w->request, w->max_requests * sizeof(struct request));
+      w->knn = (struct knn *)realloc(w->knn, w->max_requests * sizeof(struct knn));
+      if (w->request == NULL || w->knn == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+      }
+      for (a = n; a < w->max_requests; a++) w->knn[a].vec = NULL;
+    }
+    *s = 0;
+    if (s > p && s[-1] == '\r') s[-1] = 0;
+    Parse(p, &w->request[n++]);
+  }
+  if (n == 0) return 0;
+  // the queries of the knn requests, scored together
+  for (a = 0; a < n; a++) if (w->request[a].type == REQ_KNN) {
+    r = &w->request[a];
+    q = r->knn = &w->knn[knns++];
+    if (q->vec == NULL) {
+      q->vec = (float *)Alloc(dim * sizeof(float));
+      q->best = (long long *)Alloc(MAX_K * sizeof(long long));
+      q->score = (float *)Alloc(MAX_K * sizeof(float));
+    }
+    q->k = r->k < MAX_K ? r->k : MAX_K;
+    q->n = 0;
+    q->exclude = WordVector(r->arg, q->vec, w->sum);
+    if (q->exclude == -2) q->k = 0;   // none
+    len = 0;
+    for (b = 0; b < dim; b++) len += q->vec[b] * q->vec[b];
+    len = sqrtf(len);
+    if (len > 0) for (b = 0; b < dim; b++) q->vec[b] /= len;
+  }
+  if (knns > 0) KnnBatch(w->knn, knns);
+  for (a = 0; a < n; a++) {
+    r = &w->request[a];
+    switch (r->type) {
+    case REQ_GET:
+      if ((row = Search(&tables[r->table], r->arg, strlen(r->arg))) < 0) Print(w, "none\n");
+      else {
+        for (b = 0; b < dim; b++) w->vec[b] = tables[r->table].vec[row * tables[r->table].stride + b];
+        PrintVector(w, "ok", w->vec);
+      }
+      break;
+    case REQ_VEC:
+      if ((row = WordVector(r->arg, w->vec, w->sum)) == -2) Print(w, "none\n");
+      else PrintVector(w, row >= 0 ? "ok" : "oov", w->vec);
+      break;
+    case REQ_KNN:
+      if (r->knn->k == 0) {
+        Print(w, "none\n");
+        break;
+      }
+      Print(w, "ok");
+      for (b = 0; b < r->knn->n; b++) {
+        Reserve(w, strlen(tables[TABLE_WORD].keys[r->knn->best[b]]) + 16);
+        w->out_len += sprintf(w->out + w->out_len, " %s %.4f", tables[TABLE_WORD].keys[r->knn->best[b]], r->knn->score[b]);
+      }
+      Print(w, "\n");
+      break;
+    case REQ_HOMOPHONE:
+      Homophones(w, r);
+      break;
+    case REQ_STATS:
+      snprintf(buf, sizeof(buf), "ok requests %llu batches %llu p50 %.0f p90 %.0f p99 %.0f max %.0f\n",
+               __atomic_load_n(&latency.count, __ATOMIC_RELAXED), __atomic_load_n(&batches, __ATOMIC_RELAXED),
+               LatencyQuantile(&latency, 0.5), LatencyQuantile(&latency, 0.9), LatencyQuantile(&latency, 0.99),
+               __atomic_load_n(&latency.max, __ATOMIC_RELAXED) * 1e-3);
+      Print(w, buf);
+      break;
+    default:
+      Print(w, r->arg);
+      Print(w, "\n");
+    }
+  }
+  // keep the incomplete last line
+  c->in_len = end - p;
+  memmove(c->in, p, c->in_len);
+  return n;
+}
+
+// Sends what the socket takes of c->out; returns 0 if all is sent, 1 if some is left,
+// or -1 if the connection is closed
+int Flush(struct conn *c) {
+  long long n;
+  while (c->out_sent < c->out_len) {
+    n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+    if (n > 0) c->out_sent += n;
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+    else if (n < 0 && errno == EINTR) continue;
+    else return -1;
+  }
+  c->out_len = c->out_sent = 0;
+  return 0;
+}
+
+void *WorkerThread(void *id) {
+  struct epoll_event ev;
+  struct conn *c;
+  struct worker w;
+  double start;
+  long long n, requests, out_max;
+  char *out;
+  int pending;
+  memset(&w, 0, sizeof(w));
+  w.vec = (float *)Alloc(dim * sizeof(float));
+  w.sum = (float *)Alloc(dim * sizeof(float));
+  // the words of a homophone request and its keys with and without tones
+  w.token = (char **)Alloc(SERVE_MAX_LINE / 2 * sizeof(char *));
+  w.key = (int *)Alloc(SERVE_MAX_LINE * sizeof(int));
+  while (1) {
+    if (epoll_wait(epoll_fd, &ev, 1, -1) != 1) continue;
+    c = (struct conn *)ev.data.ptr;
+    start = Now();
+    requests = 0;
+    // the answers left from the last batch go first
+    if ((pending = Flush(c)) == 0 && !c->eof) {
+      if (c->in == NULL) c->in = (char *)Alloc(MAX_BATCH);
+      // the rest of a longer batch is read when the connection is ready again
+      while (c->in_len < MAX_BATCH) {
+        n = read(c->fd, c->in + c->in_len, MAX_BATCH - c->in_len);
+        if (n > 0) c->in_len += n;
+        else if (n < 0 && errno == EINTR) continue;
+        else {
+          if (n == 0) c->eof = 1;
+          else if (errno != EAGAIN && errno != EWOULDBLOCK) pending = -1;
+          break;
+        }
+      }
+      requests = Answer(c, &w);
+      if (c->in_len > SERVE_MAX_LINE) {
+        Print(&w, "error request too long\n");
+        c->in_len = 0;
+        c->eof = 1;
+      }
+      if (w.out_len > 0 && pending == 0) {
+        // c->out is empty: the answers are handed to the connection and its buffer to w
+        out = c->out;
+        c->out = w.out;
+        w.out = out;
+        out_max = c->out_max;
+        c->out_max = w.out_max;
+        w.out_max = out_max;
+        c->out_len = w.out_len;
+        pending = Flush(c);
+      }
+      w.out_len = 0;
+    }
+    if (requests > 0) {
+      LatencyAdd(&latency, Now() - start, requests);
+      __atomic_add_fetch(&batches, 1, __ATOMIC_RELAXED);
+    }
+    if (pending > 0 || (pending == 0 && !c->eof)) {
+      ev.events = (pending > 0 ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+      ev.data.ptr = c;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    } else {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+      close(c->fd);
+      free(c->in);
+      free(c->out);
+      free(c);
+    }
+  }
+  return id;
+}
+
+void Stop(int sig) {
+  unlink(socket_path);
+  _exit(sig == SIGTERM || sig == SIGINT ? 0 : 1);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i, fd, listen_fd;
+  struct sockaddr_un sa;
+  struct epoll_event ev;
+  struct conn *c;
+  pthread_t *pt;
+  if (argc == 1) {
+    printf("Embedding lookup daemon\n\n");
+    printf("Options:\n");
+    printf("\t-word <file>\n");
+    printf("\t\tWord vectors written by pcwe (-output-word); files of pcwe-convert -format mmap are mapped read-only\n");
+    printf("\t-char <file>, -comp <file>, -pron <file>\n");
+    printf("\t\tCharacter, component and pronunciation vectors (-output-char etc.); optional\n");
+    printf("\t-binary <int>\n");
+    printf("\t\tThe vectors are in binary mode; default is 0 (the format is detected)\n");
+    printf("\t-char2comp <file>\n");
+    printf("\t\tComponents of the characters, used with -char and -comp to compose the vectors of unknown words\n");
+    printf("\t-homophone <file>\n");
+    printf("\t\tHomophone index written by pcwe (-output-homophone), for homophone requests; their candidates\n");
+    printf("\t\tare ranked with the vectors of -pron and -word\n");
+    printf("\t-socket <file>\n");
+    printf("\t\tPath of the Unix domain socket; default is %s\n", SERVE_SOCKET);
+    printf("\t-threads <int>\n");
+    printf("\t\tWorker threads; default is the number of cores\n");
+    printf("\nRequests, one per line: get <table> <key>, vec <word>, knn <k> <word>,\n");
+    printf("homophone <k> <word> | <pinyin> ..., stats (see serve.h)\n");
+    printf("\nExamples:\n");
+    printf("./pcwe-serve -word word_vec -char char_vec -comp comp_vec -char2comp ../subcharacter/char2comp.txt\n\n");
+    return 0;
+  }
+  for (i = 0; i < TABLES; i++) {
+    char option[16];
+    sprintf(option, "-%s", table_names[i]);
+    if ((fd = ArgPos(option, argc, argv)) > 0) strcpy(table_files[i], argv[fd + 1]);
+  }
+  if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-char2comp", argc, argv)) > 0) strcpy(char2comp_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-homophone", argc, argv)) > 0) strcpy(homophone_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-socket", argc, argv)) > 0) strcpy(socket_path, argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  if (table_files[TABLE_WORD][0] == 0) {
+    printf("-word must be given\n");
+    return 1;
+  }
+  for (i = 0; i < TABLES; i++) if (table_files[i][0] != 0) {
+    LoadTable(&tables[i], table_files[i]);
+    printf("%s: %lld rows of %s\n", table_names[i], tables[i].rows, table_files[i]);
+  }
+  if (char2comp_file[0] != 0 && tables[TABLE_CHAR].rows > 0 && tables[TABLE_COMP].rows > 0) LoadChar2Comp(char2comp_file);
+  if (homophone_file[0] != 0) {
+    if (HomophoneLoad(&homophones, homophone_file) != 0) {
+      fprintf(stderr, "Invalid homophone index: %s\n", homophone_file);
+      return 1;
+    }
+    homophone_pron = (long long *)Alloc((homophones.prons + 1) * sizeof(long long));
+    for (i = 0; i < homophones.prons; i++)
+      homophone_pron[i] = Search(&tables[TABLE_PRON], homophones.pron[i], strlen(homophones.pron[i]));
+    InitSyllableVectors();
+    printf("homophone: %lld words, %lld syllables of %s\n", homophones.words, homophones.syllables, homophone_file);
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return 1;
+  }
+  strcpy(sa.sun_path, socket_path);
+  unlink(socket_path);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listen_fd, 128) < 0) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, Stop);
+  signal(SIGTERM, Stop);
+  epoll_fd = epoll_create1(0);
+  pt = (pthread_t *)Alloc(num_threads * sizeof(pthread_t));
+  for (i = 0; i < num_threads; i++) pthread_create(&pt[i], NULL, WorkerThread, (void *)(long long)i);
+  printf("Listening on %s with %d threads\n", socket_path, num_threads);
+  fflush(stdout);
+  while (1) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR) fprintf(stderr, "accept: %s\n", strerror(errno));
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c = (struct conn *)calloc(1, sizeof(struct conn));
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+  return 0;
+}
@@ -0,0 +1,67 @@
+// Protocol of pcwe-serve, and the latency histograms of pcwe-serve and pcwe-load.
+//
+// A client connects to the Unix domain socket of the daemon and sends requests, one
+// per line; every request is answered by one line, in order:
+//   get <table> <key>   the vector of key in the word, char, comp or pron table:
+//                       "ok <values>", or "none"
+//   vec <word>          the vector of word, or, for a word out of the vocabulary, the
+//                       vector composed from its characters and their components:
+//                       "ok <values>", "oov <values>", or "none"
+//   knn <k> <word>      the k words nearest to the vector of vec <word> by cosine:
+//                       "ok <word> <cosine> <word> <cosine> ...", or "none"
+//   homophone <k> <word> | <pinyin> ...
+//                       the k words that sound most like a word of the homophone index,
+//                       or like pinyin with tones (zhong1 guo2) or without (zhong guo):
+//                       "ok <word> <score> <word> <score> ...", or "none"
+//   stats               "ok requests <n> batches <n> p50 <us> p90 <us> p99 <us> max <us>",
+//                       the latencies of all requests answered so far
+// A malformed request is answered by "error <message>". Every complete line read from a
+// connection at once is a batch: the knn requests of a batch are scored in one pass over
+// the word table, and the answers are sent at once, so clients should send many requests
+// before they read the answers. No more requests of a connection are read while its
+// answers wait to be sent, so a client that sends more than the socket holds must read
+// the answers meanwhile.
+
+#ifndef PCWE_SERVE_H
+#define PCWE_SERVE_H
+
+#include <time.h>
+#include "hist.h"
+
+#define SERVE_SOCKET "/tmp/pcwe.sock"
+#define SERVE_MAX_LINE 4096        // bytes of a request
+#define LATENCY_BUCKETS HIST_BUCKETS
+
+// Latencies in ns, in log-scale buckets of 4 per power of 2
+struct latency {
+  unsigned long long count, max, hist[LATENCY_BUCKETS];
+};
+
+static inline double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Adds n requests of the same latency; safe to call from several threads
+static inline void LatencyAdd(struct latency *l, double seconds, unsigned long long n) {
+  unsigned long long ns = seconds > 0 ? seconds * 1e9 : 0, max = l->max;
+  __atomic_add_fetch(&l->count, n, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&l->hist[HistBucket(ns)], n, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&l->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// The latency in us below which the share q of the requests are
+static inline double LatencyQuantile(struct latency *l, double q) {
+  unsigned long long seen = 0, count = __atomic_load_n(&l->count, __ATOMIC_RELAXED);
+  int b;
+  if (count == 0) return 0;
+  for (b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += __atomic_load_n(&l->hist[b], __ATOMIC_RELAXED);
+    if (seen >= q * count) break;
+  }
+  if (b == LATENCY_BUCKETS) b--;
+  return HistBucketEnd(b) * 1e-3;
+}
+
+#endif
@@ -0,0 +1,620 @@
+// Reading and writing of the vector files of pcwe. See vecio.h for the formats.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vecio.h"
+
+#define VEC_MAGIC "PCWEVEC1"
+#define VEC_PAGE 4096
+#define VEC_WRITE_ROWS 4096      // rows formatted by the threads between two writes
+#define VEC_FLOAT_TEXT 48        // bytes of a value formatted like printf("%lf"), at most
+
+// Header of a VEC_MMAP file; the offsets are from the start of the file:
+//   word_offset  rows + 1 long long offsets of the words in the word data that follows
+//   vec_offset   rows x stride floats, a multiple of VEC_PAGE
+struct vec_header {
+  char magic[8];
+  long long rows, dim, stride, word_offset, word_bytes, vec_offset, reserved;
+};
+
+// A part of a text file parsed or written by a thread
+struct vec_part {
+  struct vec_table *t;
+  const char *begin, *end, *file;
+  long long rows, first_row, word_bytes, first_byte;
+  char *out;                     // text of the rows a thread formats
+  long long out_len, out_max;
+  int ok;
+};
+
+static const float pow10f_[11] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+static void *VecAlloc(size_t size) {
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) {
+    fprintf(stderr, "vecio: memory allocation failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+static int Threads(int threads) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > 0) return threads;
+  return n > 0 ? n : 1;
+}
+
+static inline int Space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parses the float at p like strtof: the decimals of pcwe (-0.123456) are the integer of
+// their digits divided by a power of ten, both exact floats, which is the correctly
+// rounded value; anything else (exponents, hexadecimals, inf, a number not ended by a
+// space, a line end or a 0) is left to strtof.
+static inline float ParseFloat(const char *p, char **end) {
+  const char *s = p;
+  unsigned long long m = 0;
+  int neg = 0, digits = 0, frac = 0;
+  float f;
+  if (*p == '-') {
+    neg = 1;
+    p++;
+  } else if (*p == '+') p++;
+  for (; *p >= '0' && *p <= '9' && digits < 19; p++, digits++) m = m * 10 + (*p - '0');
+  if (*p == '.') for (p++; *p >= '0' && *p <= '9' && digits < 19; p++, digits++, frac++) m = m * 10 + (*p - '0');
+  if (digits == 0 || digits == 19 || m > (1 << 24) || frac > 10 || !(Space(*p) || *p == '\n' || *p == 0))
+    return strtof(s, end);
+  f = (float)m / pow10f_[frac];
+  *end = (char *)p;
+  return neg ? -f : f;
+}
+
+// Parses the line [p, eol) into row and its word into word (when not NULL); returns the
+// length of the word, or -1 if the line does not hold a word and dim values
+static long long ParseLine(const char *p, const char *eol, long long dim, float *row, char *word) {
+  const char *w;
+  char *q;
+  long long b, n;
+  while (p < eol && Space(*p)) p++;
+  for (w = p; p < eol && !Space(*p); p++);
+  n = p - w;
+  if (n == 0) return -1;
+  if (word != NULL) {
+    memcpy(word, w, n);
+    word[n] = 0;
+  }
+  for (b = 0; b < dim; b++) {
+    while (p < eol && Space(*p)) p++;
+    if (p == eol) return -1;
+    row[b] = ParseFloat(p, &q);
+    if (q == p || q > eol) return -1;
+    p = q;
+  }
+  while (p < eol && Space(*p)) p++;
+  return p == eol ? n : -1;
+}
+
+// Whether [p, end) holds a line with characters other than spaces
+static inline int Blank(const char *p, const char *end) {
+  for (; p < end; p++) if (!Space(*p)) return 0;
+  return 1;
+}
+
+// The rows of a part and the bytes of their words
+static void *CountPart(void *arg) {
+  struct vec_part *part = (struct vec_part *)arg;
+  const char *p = part->begin, *eol, *w;
+  part->rows = part->word_bytes = 0;
+  for (; p < part->end; p = eol + 1) {
+    if ((eol = memchr(p, '\n', part->end - p)) == NULL) eol = part->end;
+    if (Blank(p, eol)) continue;
+    while (Space(*p)) p++;
+    for (w = p; p < eol && !Space(*p); p++);
+    part->rows++;
+    part->word_bytes += p - w + 1;
+  }
+  return NULL;
+}
+
+// Parses the rows of a part, from its first row and the first byte of its words
+static void *ParsePart(void *arg) {
+  struct vec_part *part = (struct vec_part *)arg;
+  struct vec_table *t = part->t;
+  const char *p = part->begin, *eol;
+  char *last = NULL;
+  long long row = part->first_row, byte = part->first_byte, n;
+  part->ok = 1;
+  for (; last == NULL && p < part->end; p = eol + 1) {
+    if ((eol = memchr(p, '\n', part->end - p)) == NULL) {
+      // the last line of a file without a newline at its end is parsed from a copy,
+      // so that strtof stops before the end of the file
+      last = (char *)VecAlloc(part->end - p + 1);
+      memcpy(last, p, part->end - p);
+      last[part->end - p] = 0;
+      eol = last + (part->end - p);
+      p = last;
+    }
+    if (Blank(p, eol)) continue;
+    t->words[row] = t->word_data + byte;
+    if ((n = ParseLine(p, eol, t->dim, &t->vec[row * t->dim], t->words[row])) < 0) {
+      fprintf(stderr, "vecio: row %lld of %s does not hold a word and %lld values\n", row + 1, part->file, t->dim);
+      part->ok = 0;
+      break;
+    }
+    byte += n + 1;
+    row++;
+  }
+  free(last);
+  return NULL;
+}
+
+static void RunThreads(void *(*f)(void *), struct vec_part *parts, int n) {
+  pthread_t *pt = (pthread_t *)VecAlloc(n * sizeof(pthread_t));
+  int i;
+  for (i = 1; i < n; i++) pthread_create(&pt[i], NULL, f, &parts[i]);
+  f(&parts[0]);
+  for (i = 1; i < n; i++) pthread_join(pt[i], NULL);
+  free(pt);
+}
+
+// Maps a whole file for reading; returns NULL if it cannot
+static char *MapFile(const char *file, long long *size) {
+  struct stat st;
+  char *data;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  data = st.st_size == 0 ? MAP_FAILED : (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return data == MAP_FAILED ? NULL : data;
+}
+
+// The "rows dim" header of a text or binary file; returns the offset of the first row
+static long long ReadHeader(const char *data, long long size, long long *rows, long long *dim) {
+  char header[64], *p;
+  long long n = size < 63 ? size : 63;
+  memcpy(header, data, n);
+  header[n] = 0;
+  *rows = strtoll(header, &p, 10);
+  *dim = strtoll(p, &p, 10);
+  while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+  if (*rows < 0 || *dim <= 0 || *p != '\n') return -1;
+  return p + 1 - header;
+}
+
+static int ReadText(struct vec_table *t, const char *file, const char *data, long long size, long long start,
+                    int threads) {
+  struct vec_part *parts;
+  const char *p;
+  long long rows = 0, bytes = 0;
+  int i, n = Threads(threads), ok = 1;
+  // a part begins after the line end at or after its share of the file
+  if ((size - start) / n < 65536) n = 1;
+  parts = (struct vec_part *)VecAlloc(n * sizeof(struct vec_part));
+  memset(parts, 0, n * sizeof(struct vec_part));
+  for (i = 0; i < n; i++) {
+    p = data + start + (size - start) / n * i;
+    if (i > 0) {
+      p = memchr(p - 1, '\n', data + size - (p - 1));
+      p = p == NULL ? data + size : p + 1;
+    }
+    parts[i].begin = p;
+    parts[i].t = t;
+    parts[i].file = file;
+  }
+  for (i = 0; i < n; i++) parts[i].end = i + 1 < n ? parts[i + 1].begin : data + size;
+  RunThreads(CountPart, parts, n);
+  for (i = 0; i < n; i++) {
+    parts[i].first_row = rows;
+    parts[i].first_byte = bytes;
+    rows += parts[i].rows;
+    bytes += parts[i].word_bytes;
+  }
+  if (rows != t->rows) {
+    fprintf(stderr, "vecio: %s has %lld rows, its header %lld\n", file, rows, t->rows);
+    free(parts);
+    return -1;
+  }
+  t->vec = (float *)VecAlloc(t->rows * t->dim * sizeof(float));
+  t->words = (char **)VecAlloc(t->rows * sizeof(char *));
+  t->word_data = (char *)VecAlloc(bytes);
+  RunThreads(ParsePart, parts, n);
+  for (i = 0; i < n; i++) ok = ok && parts[i].ok;
+  free(parts);
+  return ok ? 0 : -1;
+}
+
+static int ReadBinary(struct vec_table *t, const char *file, const char *data, long long size, long long start) {
+  const char *p = data + start, *end = data + size, *w;
+  long long a, bytes = 0, row_bytes = t->dim * sizeof(float);
+  // the word bytes are counted first, then copied with the rows
+  for (a = 0; a < t->rows; a++) {
+    while (p < end && (Space(*p) || *p == '\n')) p++;
+    for (w = p; p < end && *p != ' ' && *p != '\t'; p++);
+    if (p == end || p == w || end - (p + 1) < row_bytes) break;
+    bytes += p - w + 1;
+    p += 1 + row_bytes;
+  }
+  if (a < t->rows) {
+    fprintf(stderr, "vecio: truncated input file %s at row %lld\n", file, a + 1);
+    return -1;
+  }
+  t->vec = (float *)VecAlloc(t->rows * row_bytes);
+  t->words = (char **)VecAlloc(t->rows * sizeof(char *));
+  t->word_data = (char *)VecAlloc(bytes);
+  bytes = 0;
+  for (a = 0, p = data + start; a < t->rows; a++) {
+    while (Space(*p) || *p == '\n') p++;
+    for (w = p; *p != ' ' && *p != '\t'; p++);
+    t->words[a] = t->word_data + bytes;
+    memcpy(t->words[a], w, p - w);
+    t->words[a][p - w] = 0;
+    bytes += p - w + 1;
+    memcpy(&t->vec[a * t->dim], p + 1, row_bytes);
+    p += 1 + row_bytes;
+  }
+  return 0;
+}
+
+// The words of a .npy file, one per line of <file>.words
+static int ReadWords(struct vec_table *t, const char *file) {
+  char *name = (char *)VecAlloc(strlen(file) + 8), *data;
+  const char *p, *end, *eol;
+  long long a, size = 0;
+  sprintf(name, "%s.words", file);
+  data = MapFile(name, &size);
+  if (data == NULL && t->rows > 0) {
+    fprintf(stderr, "vecio: cannot read the words of %s from %s\n", file, name);
+    free(name);
+    return -1;
+  }
+  free(name);
+  t->words = (char **)VecAlloc(t->rows * sizeof(char *));
+  t->word_data = (char *)VecAlloc(size + 1);
+  if (data != NULL) memcpy(t->word_data, data, size);
+  end = t->word_data + size;
+  for (a = 0, p = t->word_data; a < t->rows && p < end; a++, p = eol + 1) {
+    if ((eol = memchr(p, '\n', end - p)) == NULL) eol = end;
+    t->words[a] = (char *)p;
+    t->word_data[eol - t->word_data] = 0;
+    if (eol > p && eol[-1] == '\r') t->word_data[eol - 1 - t->word_data] = 0;
+  }
+  if (data != NULL) munmap(data, size);
+  if (a < t->rows) {
+    fprintf(stderr, "vecio: %s.words has %lld words for %lld rows\n", file, a, t->rows);
+    return -1;
+  }
+  return 0;
+}
+
+// The shape of a little-endian float32 array in C order from the header of a .npy file;
+// returns the offset of the data
+static long long NpyHeader(const char *data, long long size, long long *rows, long long *dim) {
+  long long len, start;
+  char *dict, *p;
+  if (size < 10 || memcmp(data, "\x93NUMPY", 6)) return -1;
+  if (data[6] == 1) {
+    len = (unsigned char)data[8] | (unsigned char)data[9] << 8;
+    start = 10;
+  } else {
+    if (size < 12) return -1;
+    len = (unsigned char)data[8] | (unsigned char)data[9] << 8 | (unsigned char)data[10] << 16 |
+          (long long)(unsigned char)data[11] << 24;
+    start = 12;
+  }
+  if (start + len > size) return -1;
+  dict = (char *)VecAlloc(len + 1);
+  memcpy(dict, data + start, len);
+  dict[len] = 0;
+  *rows = *dim = -1;
+  if (strstr(dict, "'<f4'") != NULL && strstr(dict, "'fortran_order': False") != NULL &&
+      (p = strstr(dict, "'shape':")) != NULL && (p = strchr(p, '(')) != NULL) {
+    *rows = strtoll(p + 1, &p, 10);
+    while (*p == ',' || *p == ' ') p++;
+    *dim = *p == ')' ? 1 : strtoll(p, &p, 10);
+    while (*p == ',' || *p == ' ') p++;
+    if (*p != ')') *rows = -1;
+  }
+  free(dict);
+  if (*rows < 0 || *dim <= 0) return -1;
+  return start + len;
+}
+
+int VecFormat(const char *file) {
+  char head[8], *data, *p, *eol;
+  long long size, start, rows, dim, b;
+  float *row;
+  int format = -1;
+  FILE *f = fopen(file, "rb");
+  if (f == NULL) return -1;
+  if (fread(head, 1, 8, f) == 8) {
+    if (!memcmp(head, "\x93NUMPY", 6)) format = VEC_NPY;
+    else if (!memcmp(head, VEC_MAGIC, 8)) format = VEC_MMAP;
+  }
+  fclose(f);
+  if (format >= 0) return format;
+  // text if the first row is a word and dim values up to a line end
+  if ((data = MapFile(file, &size)) == NULL) return -1;
+  if ((start = ReadHeader(data, size, &rows, &dim)) >= 0) {
+    format = VEC_BINARY;
+    if (rows > 0 && (eol = memchr(data + start, '\n', size - start)) != NULL) {
+      p = (char *)VecAlloc(eol - (data + start) + 1);
+      memcpy(p, data + start, eol - (data + start));
+      p[eol - (data + start)] = 0;
+      row = (float *)VecAlloc(dim * sizeof(float));
+      b = ParseLine(p, p + (eol - (data + start)), dim, row, NULL);
+      if (b > 0) format = VEC_TEXT;
+      free(row);
+      free(p);
+    }
+  }
+  munmap(data, size);
+  return format;
+}
+
+int VecFormatByName(const char *name) {
+  if (!strcmp(name, "text")) return VEC_TEXT;
+  if (!strcmp(name, "binary")) return VEC_BINARY;
+  if (!strcmp(name, "npy")) return VEC_NPY;
+  if (!strcmp(name, "mmap")) return VEC_MMAP;
+  return -1;
+}
+
+int VecMap(struct vec_table *t, const char *file) {
+  struct vec_header h;
+  long long a, size, *offset;
+  char *data;
+  memset(t, 0, sizeof(struct vec_table));
+  if ((data = MapFile(file, &size)) == NULL) return -1;
+  memcpy(&h, data, size < (long long)sizeof(h) ? size : (long long)sizeof(h));
+  if (size < (long long)sizeof(h) || memcmp(h.magic, VEC_MAGIC, 8) || h.rows < 0 || h.dim <= 0 || h.stride < h.dim ||
+      h.word_offset < (long long)sizeof(h) || h.word_bytes < 0 || h.word_offset % sizeof(long long) ||
+      (h.rows + 1) > (size - h.word_offset) / (long long)sizeof(long long) ||
+      h.word_bytes > size - h.word_offset - (h.rows + 1) * (long long)sizeof(long long) ||
+      h.vec_offset % VEC_PAGE || h.vec_offset < 0 || h.vec_offset > size ||
+      h.rows > (size - h.vec_offset) / (h.stride * (long long)sizeof(float))) {
+    fprintf(stderr, "vecio: invalid header in %s\n", file);
+    munmap(data, size);
+    return -1;
+  }
+  t->rows = h.rows;
+  t->dim = h.dim;
+  t->stride = h.stride;
+  t->vec = (float *)(data + h.vec_offset);
+  t->map = data;
+  t->map_size = size;
+  offset = (long long *)(data + h.word_offset);
+  t->word_data = (char *)&offset[h.rows + 1];
+  t->words = (char **)VecAlloc(t->rows * sizeof(char *));
+  for (a = 0; a < t->rows; a++) {
+    if (offset[a] < 0 || offset[a + 1] <= offset[a] || offset[a + 1] > h.word_bytes || t->word_data[offset[a + 1] - 1] != 0) {
+      fprintf(stderr, "vecio: invalid word %lld in %s\n", a + 1, file);
+      VecFree(t);
+      return -1;
+    }
+    t->words[a] = t->word_data + offset[a];
+  }
+  return 0;
+}
+
+int VecRead(struct vec_table *t, const char *file, int format, int threads) {
+  struct vec_table m;
+  long long a, start, size = 0;
+  char *data;
+  int r;
+  memset(t, 0, sizeof(struct vec_table));
+  if (format == VEC_AUTO) format = VecFormat(file);
+  if (format == VEC_MMAP) {
+    // copied without the padding of the rows
+    if (VecMap(&m, file) != 0) return -1;
+    t->rows = m.rows;
+    t->dim = t->stride = m.dim;
+    t->vec = (float *)VecAlloc(t->rows * t->dim * sizeof(float));
+    t->words = (char **)VecAlloc(t->rows * sizeof(char *));
+    size = m.rows > 0 ? m.words[m.rows - 1] + strlen(m.words[m.rows - 1]) + 1 - m.word_data : 0;
+    t->word_data = (char *)VecAlloc(size);
+    memcpy(t->word_data, m.word_data, size);
+    for (a = 0; a < t->rows; a++) {
+      t->words[a] = t->word_data + (m.words[a] - m.word_data);
+      memcpy(&t->vec[a * t->dim], &m.vec[a * m.stride], t->dim * sizeof(float));
+    }
+    VecFree(&m);
+    return 0;
+  }
+  if (format < 0 || (data = MapFile(file, &size)) == NULL) {
+    fprintf(stderr, "vecio: cannot read %s\n", file);
+    return -1;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+  if (format == VEC_NPY) {
+    start = NpyHeader(data, size, &t->rows, &t->dim);
+    if (start < 0 || t->rows > (size - start) / (t->dim * (long long)sizeof(float))) {
+      fprintf(stderr, "vecio: %s is not a float32 matrix in C order\n", file);
+      r = -1;
+    } else {
+      t->vec = (float *)VecAlloc(t->rows * t->dim * sizeof(float));
+      memcpy(t->vec, data + start, t->rows * t->dim * sizeof(float));
+      r = ReadWords(t, file);
+    }
+  } else if ((start = ReadHeader(data, size, &t->rows, &t->dim)) < 0) {
+    fprintf(stderr, "vecio: invalid header in %s\n", file);
+    r = -1;
+  } else if (format == VEC_TEXT) r = ReadText(t, file, data, size, start, threads);
+  else r = ReadBinary(t, file, data, size, start);
+  munmap(data, size);
+  t->stride = t->dim;
+  if (r != 0) VecFree(t);
+  return r;
+}
+
+// Formats v like printf("%lf"): a float times 1e6 is exact in a double, so its rounding
+// to an integer is that of printf
+static inline char *FormatFloat(char *p, float v) {
+  double x = fabs((double)v) * 1e6;
+  unsigned long long n, i;
+  char digits[24];
+  int d = 0, a;
+  if (!(x < 9e18)) return p + sprintf(p, "%lf", v);
+  n = llrint(x);
+  if (signbit(v)) *p++ = '-';
+  i = n / 1000000;
+  do digits[d++] = '0' + i % 10; while ((i /= 10) > 0);
+  while (d > 0) *p++ = digits[--d];
+  *p++ = '.';
+  n %= 1000000;
+  for (a = 5; a >= 0; a--, n /= 10) p[a] = '0' + n % 10;
+  return p + 6;
+}
+
+// Formats the rows [first_row, first_row + rows) of a part as the text output of pcwe
+static void *FormatPart(void *arg) {
+  struct vec_part *part = (struct vec_part *)arg;
+  struct vec_table *t = part->t;
+  long long a, b;
+  char *p = part->out;
+  for (a = part->first_row; a < part->first_row + part->rows; a++) {
+    b = strlen(t->words[a]);
+    memcpy(p, t->words[a], b);
+    p += b;
+    *p++ = ' ';
+    for (b = 0; b < t->dim; b++) {
+      p = FormatFloat(p, t->vec[a * t->stride + b]);
+      *p++ = ' ';
+    }
+    *p++ = '\n';
+  }
+  part->out_len = p - part->out;
+  return NULL;
+}
+
+static int WriteText(struct vec_table *t, FILE *fo, int threads) {
+  struct vec_part *parts;
+  long long a, b, block, max;
+  int i, n = Threads(threads);
+  parts = (struct vec_part *)VecAlloc(n * sizeof(struct vec_part));
+  memset(parts, 0, n * sizeof(struct vec_part));
+  for (a = 0; a < t->rows; a += block) {
+    block = t->rows - a < VEC_WRITE_ROWS ? t->rows - a : VEC_WRITE_ROWS;
+    for (i = 0; i < n; i++) {
+      parts[i].t = t;
+      parts[i].first_row = a + block * i / n;
+      parts[i].rows = a + block * (i + 1) / n - parts[i].first_row;
+      for (b = parts[i].first_row, max = 0; b < parts[i].first_row + parts[i].rows; b++)
+        max += strlen(t->words[b]) + 2 + t->dim * (VEC_FLOAT_TEXT + 1);
+      if (max > parts[i].out_max) {
+        free(parts[i].out);
+        parts[i].out = (char *)VecAlloc(max);
+        parts[i].out_max = max;
+      }
+    }
+    RunThreads(FormatPart, parts, n);
+    for (i = 0; i < n; i++) fwrite(parts[i].out, 1, parts[i].out_len, fo);
+  }
+  for (i = 0; i < n; i++) free(parts[i].out);
+  free(parts);
+  return 0;
+}
+
+static void WriteNpyHeader(struct vec_table *t, FILE *fo) {
+  char dict[128];
+  unsigned short len;
+  int n = sprintf(dict, "{'descr': '<f4', 'fortran_order': False, 'shape': (%lld, %lld), }", t->rows, t->dim);
+  // the data begins at a multiple of 64 bytes
+  while ((10 + n + 1) % 64) dict[n++] = ' ';
+  dict[n++] = '\n';
+  len = n;
+  fwrite("\x93NUMPY\x01\x00", 1, 8, fo);
+  fputc(len & 255, fo);
+  fputc(len >> 8, fo);
+  fwrite(dict, 1, n, fo);
+}
+
+static int WriteMmap(struct vec_table *t, FILE *fo) {
+  struct vec_header h;
+  long long a, pos, *offset = (long long *)VecAlloc((t->rows + 1) * sizeof(long long));
+  static const char zero[VEC_PAGE];
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, VEC_MAGIC, 8);
+  h.rows = t->rows;
+  h.dim = t->dim;
+  h.stride = (t->dim + VEC_ALIGN / sizeof(float) - 1) / (VEC_ALIGN / sizeof(float)) * (VEC_ALIGN / sizeof(float));
+  h.word_offset = sizeof(h);
+  for (a = 0, offset[0] = 0; a < t->rows; a++) offset[a + 1] = offset[a] + strlen(t->words[a]) + 1;
+  h.word_bytes = offset[t->rows];
+  pos = h.word_offset + (t->rows + 1) * sizeof(long long) + h.word_bytes;
+  h.vec_offset = (pos + VEC_PAGE - 1) / VEC_PAGE * VEC_PAGE;
+  fwrite(&h, sizeof(h), 1, fo);
+  fwrite(offset, sizeof(long long), t->rows + 1, fo);
+  for (a = 0; a < t->rows; a++) fwrite(t->words[a], 1, offset[a + 1] - offset[a], fo);
+  fwrite(zero, 1, h.vec_offset - pos, fo);
+  for (a = 0; a < t->rows; a++) {
+    fwrite(&t->vec[a * t->stride], sizeof(float), t->dim, fo);
+    fwrite(zero, sizeof(float), h.stride - t->dim, fo);
+  }
+  free(offset);
+  return 0;
+}
+
+int VecWrite(struct vec_table *t, const char *file, int format, int threads) {
+  char *name;
+  long long a;
+  int error;
+  FILE *fo = fopen(file, "wb"), *fw;
+  if (fo == NULL) return -1;
+  setvbuf(fo, NULL, _IOFBF, 1 << 20);
+  if (format == VEC_TEXT || format == VEC_BINARY) fprintf(fo, "%lld %lld\n", t->rows, t->dim);
+  if (format == VEC_TEXT) WriteText(t, fo, threads);
+  else if (format == VEC_BINARY) {
+    for (a = 0; a < t->rows; a++) {
+      fprintf(fo, "%s ", t->words[a]);
+      fwrite(&t->vec[a * t->stride], sizeof(float), t->dim, fo);
+      fputc('\n', fo);
+    }
+  } else if (format == VEC_NPY) {
+    WriteNpyHeader(t, fo);
+    for (a = 0; a < t->rows; a++) fwrite(&t->vec[a * t->stride], sizeof(float), t->dim, fo);
+    name = (char *)VecAlloc(strlen(file) + 8);
+    sprintf(name, "%s.words", file);
+    fw = fopen(name, "wb");
+    free(name);
+    if (fw == NULL) {
+      fclose(fo);
+      return -1;
+    }
+    for (a = 0; a < t->rows; a++) fprintf(fw, "%s\n", t->words[a]);
+    error = ferror(fw);
+    if (fclose(fw) != 0 || error) {
+      fclose(fo);
+      return -1;
+    }
+  } else if (format == VEC_MMAP) WriteMmap(t, fo);
+  else {
+    fclose(fo);
+    return -1;
+  }
+  // a write that failed, e.g. on a full disk, is only seen in the error flag of fo
+  error = ferror(fo);
+  return fclose(fo) != 0 || error ? -1 : 0;
+}
+
+void VecFree(struct vec_table *t) {
+  if (t->map != NULL) munmap(t->map, t->map_size);
+  else {
+    free(t->vec);
+    free(t->word_data);
+  }
+  free(t->words);
+  memset(t, 0, sizeof(struct vec_table));
+}
@@ -0,0 +1,53 @@
+// Reading and writing of the vector files of pcwe.
+//
+// Four formats of a table of rows x dim float vectors and their words are supported:
+//   VEC_TEXT    the text output of pcwe: a "rows dim" line, then a line of a word and
+//               its values per row
+//   VEC_BINARY  the binary output of pcwe (-binary 1): the same header line, then per row
+//               the word, a space, dim native floats and a newline
+//   VEC_NPY     a NumPy .npy array of float32, rows x dim, and the words one per line in
+//               <file>.words, so that np.load(file, mmap_mode='r') reads the vectors
+//   VEC_MMAP    an aligned layout to be mapped: a header, the words, and the rows padded
+//               to VEC_ALIGN bytes from a page boundary
+// Text files are parsed by several threads, each on a part of the file split at line
+// ends. Words are of any length.
+
+#ifndef PCWE_VECIO_H
+#define PCWE_VECIO_H
+
+#define VEC_AUTO -1
+#define VEC_TEXT 0
+#define VEC_BINARY 1
+#define VEC_NPY 2
+#define VEC_MMAP 3
+
+#define VEC_ALIGN 64
+
+struct vec_table {
+  long long rows, dim;
+  long long stride;      // floats from a row to the next: dim, or more in a mapped VEC_MMAP file
+  float *vec;
+  char **words;          // the word of every row
+  char *word_data;       // the words, each ended by a 0
+  void *map;             // the file mapped by VecMap, or NULL
+  long long map_size;
+};
+
+// The format of a file from its first bytes, or -1 if it cannot be read
+int VecFormat(const char *file);
+int VecFormatByName(const char *name);   // "text", "binary", "npy" or "mmap", or -1
+
+// Reads a file of format (VEC_AUTO to detect it) with threads threads (0: one per core)
+// into t, with stride dim; returns -1 and prints why if the file is invalid
+int VecRead(struct vec_table *t, const char *file, int format, int threads);
+
+// Maps a VEC_MMAP file into t without copying it; the rows are read-only and shared
+// with the other processes mapping the file
+int VecMap(struct vec_table *t, const char *file);
+
+// Writes t in format with threads threads (0: one per core)
+int VecWrite(struct vec_table *t, const char *file, int format, int threads);
+
+void VecFree(struct vec_table *t);
+
+#endif